@@ -0,0 +1,121 @@
+/*
+   Copyright 2015 Software Reliability Lab, ETH Zurich
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ */
+
+#ifndef BASE_BLOOM_FILTER_H_
+#define BASE_BLOOM_FILTER_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <algorithm>
+#include <vector>
+
+// A blocked Bloom filter over 64-bit keys. All the bits of a key are in one 64-byte block (one bit in each of
+// its eight words), so a probe touches a single cache line. There are no false negatives. A filter without
+// blocks (before Reset) contains every key.
+class BlockedBloomFilter {
+public:
+  BlockedBloomFilter() : num_blocks_(0), first_word_(0) {}
+
+  BlockedBloomFilter(const BlockedBloomFilter& o) : num_blocks_(0), first_word_(0) {
+    *this = o;
+  }
+
+  BlockedBloomFilter& operator=(const BlockedBloomFilter& o) {
+    if (this == &o) return *this;
+    Allocate(o.num_blocks_);
+    std::copy(o.Block(0), o.Block(0) + num_blocks_ * kWordsPerBlock, Block(0));
+    return *this;
+  }
+
+  // Removes all keys and sizes the filter for num_keys keys with bits_per_key bits each, but not larger than
+  // max_bytes. A filter with zero bits_per_key has no blocks.
+  void Reset(size_t num_keys, double bits_per_key, size_t max_bytes) {
+    size_t num_blocks = static_cast<size_t>(num_keys * bits_per_key / (kWordsPerBlock * 64)) + 1;
+    num_blocks = std::min(num_blocks, std::max<size_t>(max_bytes / kBlockBytes, 1));
+    Allocate(bits_per_key > 0 ? num_blocks : 0);
+  }
+
+  void Add(uint64_t key) {
+    if (num_blocks_ == 0) return;
+    uint64_t hash = Mix(key);
+    uint64_t* block = Block(BlockIndex(hash));
+    uint32_t h = static_cast<uint32_t>(hash);
+    for (int i = 0; i < kWordsPerBlock; ++i) {
+      block[i] |= BitInWord(h, i);
+    }
+  }
+
+  bool MayContain(uint64_t key) const {
+    if (num_blocks_ == 0) return true;
+    uint64_t hash = Mix(key);
+    const uint64_t* block = Block(BlockIndex(hash));
+    uint32_t h = static_cast<uint32_t>(hash);
+    for (int i = 0; i < kWordsPerBlock; ++i) {
+      if ((block[i] & BitInWord(h, i)) == 0) return false;
+    }
+    return true;
+  }
+
+  size_t SizeBytes() const {
+    return num_blocks_ * kBlockBytes;
+  }
+
+private:
+  static const int kWordsPerBlock = 8;
+  static const size_t kBlockBytes = kWordsPerBlock * sizeof(uint64_t);
+
+  // The MurmurHash3 finalizer, the keys may be weak hashes.
+  static uint64_t Mix(uint64_t key) {
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    key *= 0xc4ceb9fe1a85ec53ULL;
+    key ^= key >> 33;
+    return key;
+  }
+
+  // Uses the upper half of the hash to choose the block and the lower half to choose the bits in it.
+  size_t BlockIndex(uint64_t hash) const {
+    return static_cast<size_t>(((hash >> 32) * num_blocks_) >> 32);
+  }
+
+  static uint64_t BitInWord(uint32_t h, int word) {
+    static const uint32_t kSalts[kWordsPerBlock] = {
+        0x47b6137bU, 0x44974d91U, 0x8824ad5bU, 0xa2b7289dU, 0x705495c7U, 0x2df1424bU, 0x9efc4947U, 0x5c6bfb31U };
+    return 1ULL << ((h * kSalts[word]) >> 26);
+  }
+
+  // The blocks start at a cache line boundary inside words_.
+  void Allocate(size_t num_blocks) {
+    num_blocks_ = num_blocks;
+    words_.assign(num_blocks * kWordsPerBlock + kWordsPerBlock - 1, 0);
+    size_t misalignment = reinterpret_cast<uintptr_t>(words_.data()) % kBlockBytes;
+    first_word_ = misalignment == 0 ? 0 : (kBlockBytes - misalignment) / sizeof(uint64_t);
+  }
+
+  uint64_t* Block(size_t index) {
+    return words_.data() + first_word_ + index * kWordsPerBlock;
+  }
+  const uint64_t* Block(size_t index) const {
+    return words_.data() + first_word_ + index * kWordsPerBlock;
+  }
+
+  size_t num_blocks_;
+  std::vector<uint64_t> words_;
+  size_t first_word_;
+};
+
+#endif /* BASE_BLOOM_FILTER_H_ */
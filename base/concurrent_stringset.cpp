@@ -0,0 +1,182 @@
+/*
+   Copyright 2015 Software Reliability Lab, ETH Zurich
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ */
+
+#include "concurrent_stringset.h"
+
+#include <limits.h>
+#include <string.h>
+#include <algorithm>
+
+#include <glog/logging.h>
+
+// The segment of a string is given by the top bits of its hash, its slot by the bottom bits.
+static const int kSegmentBits = 6;
+static const size_t kNumSegments = 1 << kSegmentBits;
+static const size_t kInitialTableSize = 64;
+
+struct ConcurrentStringSet::Entry {
+  uint64_t hash;
+  int id;
+  size_t length;
+  std::unique_ptr<char[]> data;
+};
+
+// An open addressing table of entries. A full table is replaced by a larger one, but not deleted until the
+// dictionary is reset, so that lookups in progress can finish on it.
+struct ConcurrentStringSet::Table {
+  explicit Table(size_t size) : mask(size - 1), slots(new std::atomic<const Entry*>[size]) {
+    for (size_t i = 0; i < size; ++i) {
+      slots[i].store(NULL, std::memory_order_relaxed);
+    }
+  }
+
+  void Insert(const Entry* entry) {
+    size_t p = entry->hash & mask;
+    while (slots[p].load(std::memory_order_relaxed) != NULL) {
+      p = (p + 1) & mask;
+    }
+    slots[p].store(entry, std::memory_order_release);
+  }
+
+  size_t mask;
+  std::unique_ptr<std::atomic<const Entry*>[]> slots;
+};
+
+struct ConcurrentStringSet::Segment {
+  Segment() : table(NULL) {}
+
+  // Guards all fields but table for adds. Lookups only read table.
+  std::mutex mutex;
+  std::atomic<const Table*> table;
+  std::vector<std::unique_ptr<Table> > tables;
+  std::vector<std::unique_ptr<Entry> > entries;
+
+  void AddEntry(Entry* entry) {
+    entries.emplace_back(entry);
+    const Table* current = table.load(std::memory_order_relaxed);
+    if (current == NULL || entries.size() * 2 > current->mask + 1) {
+      Table* larger = new Table(current == NULL ? kInitialTableSize : (current->mask + 1) * 2);
+      for (const std::unique_ptr<Entry>& e : entries) {
+        larger->Insert(e.get());
+      }
+      tables.emplace_back(larger);
+      table.store(larger, std::memory_order_release);
+    } else {
+      tables.back()->Insert(entry);
+    }
+  }
+};
+
+ConcurrentStringSet::ConcurrentStringSet()
+    : segments_(new Segment[kNumSegments]), next_id_(0), first_new_id_(0) {
+}
+
+ConcurrentStringSet::~ConcurrentStringSet() {
+}
+
+void ConcurrentStringSet::Reset(const StringSet& strings) {
+  segments_.reset(new Segment[kNumSegments]);
+  std::vector<int> ids;
+  strings.getAllStrings(&ids);
+  for (int id : ids) {
+    const char* s = strings.getString(id);
+    Entry* entry = new Entry();
+    entry->length = strlen(s);
+    entry->hash = Hash(s, entry->length);
+    entry->id = id;
+    entry->data.reset(new char[entry->length + 1]);
+    memcpy(entry->data.get(), s, entry->length + 1);
+    GetSegment(entry->hash)->AddEntry(entry);
+  }
+  next_id_ = strings.getSize();
+  first_new_id_ = strings.getSize();
+}
+
+uint64_t ConcurrentStringSet::Hash(const char* s, size_t length) {
+  // FNV-1a, with the finalizer of MurmurHash3 so that the top bits (the segment) are mixed as well.
+  uint64_t hash = 14695981039346656037ULL;
+  for (size_t i = 0; i < length; ++i) {
+    hash = (hash ^ static_cast<unsigned char>(s[i])) * 1099511628211ULL;
+  }
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdULL;
+  hash ^= hash >> 33;
+  hash *= 0xc4ceb9fe1a85ec53ULL;
+  hash ^= hash >> 33;
+  return hash;
+}
+
+ConcurrentStringSet::Segment* ConcurrentStringSet::GetSegment(uint64_t hash) const {
+  return &segments_[hash >> (64 - kSegmentBits)];
+}
+
+int ConcurrentStringSet::Find(const char* s, size_t length, uint64_t hash) const {
+  const Table* table = GetSegment(hash)->table.load(std::memory_order_acquire);
+  if (table == NULL) return -1;
+  for (size_t p = hash & table->mask;; p = (p + 1) & table->mask) {
+    const Entry* entry = table->slots[p].load(std::memory_order_acquire);
+    if (entry == NULL) return -1;
+    if (entry->hash == hash && entry->length == length && memcmp(entry->data.get(), s, length) == 0) {
+      return entry->id;
+    }
+  }
+}
+
+int ConcurrentStringSet::Add(const char* s, size_t length, uint64_t hash) {
+  int id = Find(s, length, hash);
+  if (id >= 0) return id;
+  Segment* segment = GetSegment(hash);
+  std::lock_guard<std::mutex> lock(segment->mutex);
+  // Another thread may have added the string since the lookup.
+  id = Find(s, length, hash);
+  if (id >= 0) return id;
+  int64_t new_id = next_id_.fetch_add(length + 1);
+  CHECK_LE(new_id + static_cast<int64_t>(length) + 1, INT_MAX) << "Too many strings.";
+  Entry* entry = new Entry();
+  entry->hash = hash;
+  entry->id = new_id;
+  entry->length = length;
+  entry->data.reset(new char[length + 1]);
+  memcpy(entry->data.get(), s, length);
+  entry->data[length] = 0;
+  segment->AddEntry(entry);
+  return entry->id;
+}
+
+void ConcurrentStringSet::AddNewStringsTo(StringSet* strings) const {
+  CHECK_EQ(strings->getSize(), first_new_id_) << "The StringSet changed since Reset.";
+  std::vector<const Entry*> new_entries;
+  for (size_t i = 0; i < kNumSegments; ++i) {
+    for (const std::unique_ptr<Entry>& entry : segments_[i].entries) {
+      if (entry->id >= first_new_id_) new_entries.push_back(entry.get());
+    }
+  }
+  // The ids are consecutive offsets, so adding the strings in the order of their ids reproduces them.
+  std::sort(new_entries.begin(), new_entries.end(), [](const Entry* x, const Entry* y) { return x->id < y->id; });
+  for (const Entry* entry : new_entries) {
+    CHECK_EQ(strings->addString(entry->data.get()), entry->id);
+  }
+}
+
+size_t ConcurrentStringSet::NumNewStrings() const {
+  size_t num_strings = 0;
+  for (size_t i = 0; i < kNumSegments; ++i) {
+    for (const std::unique_ptr<Entry>& entry : segments_[i].entries) {
+      if (entry->id >= first_new_id_) ++num_strings;
+    }
+  }
+  return num_strings;
+}
@@ -0,0 +1,79 @@
+/*
+   Copyright 2015 Software Reliability Lab, ETH Zurich
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ */
+
+#ifndef BASE_CONCURRENT_STRINGSET_H_
+#define BASE_CONCURRENT_STRINGSET_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "stringset.h"
+
+// A string interning dictionary that many threads can add to and look up in at the same time. Lookups take no
+// lock. The strings are spread over segments by their hash, and adds only lock the segment of the string.
+//
+// The ids are the ids the strings would get in a StringSet (offsets in its data), starting after the strings of
+// the StringSet the dictionary was created from. AddNewStringsTo adds the new strings to that StringSet under
+// the same ids, so that features counted with the ids of the dictionary can be saved with the StringSet.
+class ConcurrentStringSet {
+public:
+  ConcurrentStringSet();
+  ~ConcurrentStringSet();
+
+  // Removes all strings and starts over with the strings of a StringSet. Not thread-safe.
+  void Reset(const StringSet& strings);
+
+  // The hash that Find and Add take, to hash a string once for several lookups.
+  static uint64_t Hash(const char* s, size_t length);
+
+  // Returns the id of a string or -1 if it has not been added.
+  int Find(const char* s, size_t length, uint64_t hash) const;
+  int Find(const std::string& s) const { return Find(s.data(), s.size(), Hash(s.data(), s.size())); }
+
+  // Returns the id of a string, adding it if needed.
+  int Add(const char* s, size_t length, uint64_t hash);
+  int Add(const std::string& s) { return Add(s.data(), s.size(), Hash(s.data(), s.size())); }
+
+  // Adds the strings added since Reset to the StringSet given to Reset, which must not have been changed since.
+  // Not thread-safe.
+  void AddNewStringsTo(StringSet* strings) const;
+
+  // The number of strings added since Reset.
+  size_t NumNewStrings() const;
+
+private:
+  struct Entry;
+  struct Table;
+  struct Segment;
+
+  Segment* GetSegment(uint64_t hash) const;
+
+  std::unique_ptr<Segment[]> segments_;
+  // The id of the next added string. Ids are offsets in the data of a StringSet, so each string takes its
+  // length plus one.
+  std::atomic<int64_t> next_id_;
+  int first_new_id_;
+
+  ConcurrentStringSet(const ConcurrentStringSet&) = delete;
+  ConcurrentStringSet& operator=(const ConcurrentStringSet&) = delete;
+};
+
+#endif /* BASE_CONCURRENT_STRINGSET_H_ */
@@ -0,0 +1,147 @@
+/*
+   Copyright 2015 Software Reliability Lab, ETH Zurich
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ */
+
+#include "huge_pages.h"
+
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <atomic>
+#include <new>
+#include <vector>
+
+#include "stringprintf.h"
+
+static const size_t kHugePageSize = 2 << 20;
+
+static const char* const kPageBackingNames[kNumPageBackings] = {
+  "regular pages", "transparent huge pages", "explicit huge pages"
+};
+
+static std::atomic<bool> huge_pages_enabled(true);
+
+void SetHugePagesEnabled(bool enabled) {
+  huge_pages_enabled = enabled;
+}
+
+static size_t RoundUpToHugePages(size_t bytes) {
+  return (bytes + kHugePageSize - 1) / kHugePageSize * kHugePageSize;
+}
+
+// Maps whole huge pages, falling back from explicit to transparent huge pages to regular pages.
+static void* MapHugePages(size_t bytes, PageBacking* backing) {
+  size_t length = RoundUpToHugePages(bytes);
+  void* p = MAP_FAILED;
+#ifdef MAP_HUGETLB
+  // Fails unless huge pages are reserved (vm.nr_hugepages).
+  p = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+  if (p != MAP_FAILED) {
+    *backing = kExplicitHugePages;
+    return p;
+  }
+#endif
+  p = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED) return NULL;
+  *backing = kRegularPages;
+#ifdef MADV_HUGEPAGE
+  // Fails if transparent huge pages are disabled. The pages are not touched yet, so they are faulted in as huge
+  // pages if the kernel has them.
+  if (madvise(p, length, MADV_HUGEPAGE) == 0) {
+    *backing = kTransparentHugePages;
+  }
+#endif
+  return p;
+}
+
+static std::mutex& RegionsMutex() {
+  static std::mutex mutex;
+  return mutex;
+}
+
+static std::vector<const HugePageRegion*>& Regions() {
+  static std::vector<const HugePageRegion*> regions;
+  return regions;
+}
+
+HugePageRegion::HugePageRegion(const char* name) : name_(name) {
+  for (int i = 0; i < kNumPageBackings; ++i) {
+    bytes_[i] = 0;
+  }
+  std::lock_guard<std::mutex> lock(RegionsMutex());
+  Regions().push_back(this);
+}
+
+void* HugePageRegion::Allocate(size_t bytes) {
+  void* p = NULL;
+  PageBacking backing = kRegularPages;
+  bool mapped = huge_pages_enabled && bytes >= kHugePageSize;
+  if (mapped) {
+    p = MapHugePages(bytes, &backing);
+    mapped = p != NULL;
+  }
+  if (!mapped) {
+    p = malloc(bytes);
+    if (p == NULL && bytes != 0) throw std::bad_alloc();
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  bytes_[backing] += bytes;
+  if (mapped) mapped_[p] = backing;
+  return p;
+}
+
+void HugePageRegion::Deallocate(void* p, size_t bytes) {
+  if (p == NULL) return;
+  PageBacking backing = kRegularPages;
+  bool mapped = false;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = mapped_.find(p);
+    if (it != mapped_.end()) {
+      backing = it->second;
+      mapped = true;
+      mapped_.erase(it);
+    }
+    bytes_[backing] -= bytes;
+  }
+  if (mapped) {
+    munmap(p, RoundUpToHugePages(bytes));
+  } else {
+    free(p);
+  }
+}
+
+std::string HugePageRegion::ToString() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  std::string result = name_;
+  result += ":";
+  bool first = true;
+  for (int i = kNumPageBackings - 1; i >= 0; --i) {
+    if (bytes_[i] == 0) continue;
+    StringAppendF(&result, "%s %.1fMB %s", first ? "" : ",", bytes_[i] / (1024.0 * 1024.0), kPageBackingNames[i]);
+    first = false;
+  }
+  if (first) result += " empty";
+  return result;
+}
+
+std::string HugePageRegion::AllRegionsToString() {
+  std::lock_guard<std::mutex> lock(RegionsMutex());
+  std::string result;
+  for (const HugePageRegion* region : Regions()) {
+    if (!result.empty()) result += "\n";
+    result += region->ToString();
+  }
+  return result;
+}
@@ -0,0 +1,116 @@
+/*
+   Copyright 2015 Software Reliability Lab, ETH Zurich
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ */
+
+#ifndef BASE_HUGE_PAGES_H_
+#define BASE_HUGE_PAGES_H_
+
+#include <stddef.h>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+// Large arrays that are accessed at random are allocated on huge pages to save TLB misses: explicit huge pages
+// (MAP_HUGETLB) if the system has them reserved, otherwise memory advised for transparent huge pages, otherwise
+// regular pages. Allocations smaller than a huge page always use malloc.
+
+enum PageBacking {
+  kRegularPages = 0,
+  kTransparentHugePages,
+  kExplicitHugePages,
+  kNumPageBackings
+};
+
+// Whether new allocations try to get huge pages (on by default).
+void SetHugePagesEnabled(bool enabled);
+
+// The allocations of one kind of data structure (e.g. "feature table"). Keeps the bytes in use by page backing.
+class HugePageRegion {
+public:
+  // The region is registered for AllRegionsToString and must live until the end of the program.
+  explicit HugePageRegion(const char* name);
+
+  void* Allocate(size_t bytes);
+  void Deallocate(void* p, size_t bytes);
+
+  // Bytes in use per page backing, e.g. "feature table: 64.0MB explicit huge pages, 0.2MB regular pages".
+  std::string ToString() const;
+  static std::string AllRegionsToString();
+
+private:
+  const char* name_;
+  mutable std::mutex mutex_;
+  size_t bytes_[kNumPageBackings];
+  // The mmap-ed allocations and their backing.
+  std::unordered_map<void*, PageBacking> mapped_;
+};
+
+// An allocator for STL containers (and dense_hash_map) that allocates in the HugePageRegion Region::Get().
+template <class T, class Region>
+class HugePageAllocator {
+public:
+  typedef T value_type;
+  typedef T* pointer;
+  typedef const T* const_pointer;
+  typedef T& reference;
+  typedef const T& const_reference;
+  typedef size_t size_type;
+  typedef ptrdiff_t difference_type;
+
+  template <class U>
+  struct rebind {
+    typedef HugePageAllocator<U, Region> other;
+  };
+
+  HugePageAllocator() {}
+  template <class U>
+  HugePageAllocator(const HugePageAllocator<U, Region>&) {}
+
+  pointer allocate(size_type n, const void* = 0) {
+    return static_cast<pointer>(Region::Get().Allocate(n * sizeof(T)));
+  }
+  void deallocate(pointer p, size_type n) {
+    Region::Get().Deallocate(p, n * sizeof(T));
+  }
+
+  size_type max_size() const {
+    return static_cast<size_type>(-1) / sizeof(T);
+  }
+  pointer address(reference x) const {
+    return &x;
+  }
+  const_pointer address(const_reference x) const {
+    return &x;
+  }
+  template <class U, class... Args>
+  void construct(U* p, Args&&... args) {
+    new (p) U(std::forward<Args>(args)...);
+  }
+  template <class U>
+  void destroy(U* p) {
+    p->~U();
+  }
+
+  template <class U>
+  bool operator==(const HugePageAllocator<U, Region>&) const {
+    return true;
+  }
+  template <class U>
+  bool operator!=(const HugePageAllocator<U, Region>&) const {
+    return false;
+  }
+};
+
+#endif /* BASE_HUGE_PAGES_H_ */
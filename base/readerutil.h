@@ -17,13 +17,19 @@
 #ifndef BASE_READERUTIL_H_
 #define BASE_READERUTIL_H_
 
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
 #include <unistd.h>
 
 #include <mutex>
 #include <vector>
 #include <fstream>
+#include <future>
 #include <string>
 #include <algorithm>
+#include <utility>
 
 #include <glog/logging.h>
 
@@ -38,6 +44,54 @@ public:
   virtual ~InputRecordReader() {}
   virtual bool ReachedEnd() = 0;
   virtual bool Read(RecordType* s) = 0;
+
+  // Reads up to max_records records into the first elements of records, which grows as needed and is reused
+  // between calls (the records keep their allocations). Returns the number of records read, zero only at the
+  // end. Readers override it to take their lock once per batch.
+  virtual size_t ReadBatch(size_t max_records, std::vector<RecordType>* records) {
+    size_t num_records = 0;
+    while (num_records < max_records && !ReachedEnd()) {
+      if (records->size() <= num_records) records->emplace_back();
+      if (Read(&(*records)[num_records])) ++num_records;
+    }
+    return num_records;
+  }
+
+  // As ReadBatch, but without copying the records if possible: fills records with pointers either to the
+  // elements of buffer or to records owned by the reader, valid as long as the reader.
+  virtual size_t ReadBorrowedBatch(size_t max_records, std::vector<RecordType>* buffer,
+                                   std::vector<const RecordType*>* records) {
+    size_t num_records = ReadBatch(max_records, buffer);
+    records->clear();
+    for (size_t i = 0; i < num_records; ++i) {
+      records->push_back(&(*buffer)[i]);
+    }
+    return num_records;
+  }
+};
+
+// The number of records a thread reads per batch. Grows while the batches are processed quickly, so that
+// threads with small records rarely take the reader lock, and shrinks for slow batches, so that the last
+// records are spread over the threads.
+class AdaptiveBatchSize {
+public:
+  AdaptiveBatchSize() : size_(1) {}
+
+  size_t size() const { return size_; }
+
+  // Adapts the size to the time it took to process the last batch.
+  void Update(int64_t batch_micros) {
+    if (batch_micros < kTargetBatchMicros / 2 && size_ < kMaxBatchSize) {
+      size_ *= 2;
+    } else if (batch_micros > kTargetBatchMicros * 2 && size_ > 1) {
+      size_ /= 2;
+    }
+  }
+
+private:
+  static const int64_t kTargetBatchMicros = 10000;
+  static const size_t kMaxBatchSize = 1024;
+  size_t size_;
 };
 
 template <class ProtoClass>
@@ -55,7 +109,8 @@ class FileInputRecordReader : public InputRecordReader<ProtoClass> {
       proto->Clear();
       return false;
     }
-    *proto = std::move(prefetched_proto);
+    // The prefetched proto then reuses the memory of proto for the next record.
+    proto->Swap(&prefetched_proto);
     has_prefetched = false;
     return true;
   }
@@ -65,6 +120,17 @@ class FileInputRecordReader : public InputRecordReader<ProtoClass> {
     return !has_prefetched && !PrefetchProto();
   }
 
+  virtual size_t ReadBatch(size_t max_records, std::vector<ProtoClass>* records) override {
+    std::lock_guard<std::mutex> lock(reader_mutex);
+    size_t num_records = 0;
+    while (num_records < max_records && (has_prefetched || PrefetchProto())) {
+      if (records->size() <= num_records) records->emplace_back();
+      (*records)[num_records++].Swap(&prefetched_proto);
+      has_prefetched = false;
+    }
+    return num_records;
+  }
+
  private:
 
   bool PrefetchProto() {
@@ -110,6 +176,18 @@ class FileInputRecordReader<std::string> : public InputRecordReader<std::string>
     std::lock_guard<std::mutex> lock(filemutex);
     return file.eof();
   }
+
+  virtual size_t ReadBatch(size_t max_records, std::vector<std::string>* records) override {
+    std::lock_guard<std::mutex> lock(filemutex);
+    size_t num_records = 0;
+    while (num_records < max_records && !file.eof() && file.good()) {
+      if (records->size() <= num_records) records->emplace_back();
+      std::string* s = &(*records)[num_records];
+      std::getline(file, *s);
+      if (!s->empty()) ++num_records;
+    }
+    return num_records;
+  }
  private:
   inline bool exists (const std::string& name) {
     return ( access( name.c_str(), F_OK ) != -1 );
@@ -146,6 +224,24 @@ public:
     return file_index_ >= filelist_.size();
   }
 
+  virtual size_t ReadBatch(size_t max_records, std::vector<std::string>* records) override {
+    size_t first_file, num_records;
+    {
+      std::lock_guard<std::mutex> lock(file_index_mutex_);
+      first_file = file_index_;
+      num_records = std::min(max_records, filelist_.size() - file_index_);
+      file_index_ += num_records;
+    }
+    if (records->size() < num_records) records->resize(num_records);
+    for (size_t i = 0; i < num_records; ++i) {
+      const std::string& filename = filelist_[first_file + i];
+      CHECK(exists(filename)) << "File '" << filename << "' does not exist!";
+      (*records)[i].clear();
+      ReadFileToStringOrDie(filename.c_str(), &(*records)[i]);
+    }
+    return num_records;
+  }
+
 private:
   inline bool exists (const std::string& name) {
     return ( access( name.c_str(), F_OK ) != -1 );
@@ -156,13 +252,14 @@ private:
   std::mutex file_index_mutex_;
 };
 
-template <class T>
+// Recording is std::vector<T> or any other class with push_back(const T&).
+template <class T, class Recording = std::vector<T> >
 class CachingInputRecordReader : public InputRecordReader<T> {
 public:
   // The class takes ownership of underlying_reader.
   explicit CachingInputRecordReader(
       InputRecordReader<T>* underlying_reader,
-      std::vector<T>* recording) : underlying_reader_(underlying_reader), recording_(recording) {
+      Recording* recording) : underlying_reader_(underlying_reader), recording_(recording) {
   }
   virtual ~CachingInputRecordReader() override {
     delete underlying_reader_;
@@ -181,9 +278,18 @@ public:
     return underlying_reader_->ReachedEnd();
   }
 
+  virtual size_t ReadBatch(size_t max_records, std::vector<T>* records) override {
+    size_t num_records = underlying_reader_->ReadBatch(max_records, records);
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (size_t i = 0; i < num_records; ++i) {
+      recording_->push_back((*records)[i]);
+    }
+    return num_records;
+  }
+
 private:
   InputRecordReader<T>* underlying_reader_;
-  std::vector<T>* recording_;
+  Recording* recording_;
   std::mutex mutex_;
 };
 
@@ -192,6 +298,10 @@ class RecordedRecordReader : public InputRecordReader<T> {
 public:
   explicit RecordedRecordReader(const std::vector<T>* recording) : recording_(recording), pos_(0) {
   }
+  // Takes the recording, which is released with the reader.
+  explicit RecordedRecordReader(std::vector<T>&& recording)
+      : owned_recording_(std::move(recording)), recording_(&owned_recording_), pos_(0) {
+  }
   virtual ~RecordedRecordReader() {
   }
 
@@ -205,12 +315,34 @@ public:
     return true;
   }
 
+  virtual size_t ReadBatch(size_t max_records, std::vector<T>* records) override {
+    std::lock_guard<std::mutex> lock(mutex_);
+    size_t num_records = std::min(max_records, recording_->size() - pos_);
+    if (records->size() < num_records) records->resize(num_records);
+    std::copy(recording_->begin() + pos_, recording_->begin() + pos_ + num_records, records->begin());
+    pos_ += num_records;
+    return num_records;
+  }
+
+  virtual size_t ReadBorrowedBatch(size_t max_records, std::vector<T>* buffer,
+                                   std::vector<const T*>* records) override {
+    std::lock_guard<std::mutex> lock(mutex_);
+    size_t num_records = std::min(max_records, recording_->size() - pos_);
+    records->clear();
+    for (size_t i = 0; i < num_records; ++i) {
+      records->push_back(&(*recording_)[pos_ + i]);
+    }
+    pos_ += num_records;
+    return num_records;
+  }
+
   virtual bool ReachedEnd() override {
     std::lock_guard<std::mutex> lock(mutex_);
     return pos_ >= recording_->size();
   }
 
 private:
+  std::vector<T> owned_recording_;
   const std::vector<T>* recording_;
   size_t pos_;
   std::mutex mutex_;
@@ -260,6 +392,8 @@ private:
 /**
  * Input for which the first created reader reads the records from a file and then remembers them in RAM.
  * Each subsequent reader gets the cached records (file lines), but in randomly shuffled order.
+ * With max_shuffled_readers > 0, only that many readers get the cached records and the last of them takes
+ * the cache, which is released with it. Later readers get no records.
  * Concurrency: Once a reader is created, multiple threads can read from it. However, only one
  * reader should be created at a time.
  */
@@ -267,7 +401,8 @@ template <class T>
 class ShuffledCacheInput : public RecordInput<T> {
 public:
   // The class takes ownership of underlying_input.
-  explicit ShuffledCacheInput(RecordInput<T>* underlying_input) : underlying_input_(underlying_input), has_recorded_(false) {
+  explicit ShuffledCacheInput(RecordInput<T>* underlying_input, int max_shuffled_readers = -1)
+      : underlying_input_(underlying_input), has_recorded_(false), max_shuffled_readers_(max_shuffled_readers) {
   }
   virtual ~ShuffledCacheInput() override {
     delete underlying_input_;
@@ -280,15 +415,212 @@ public:
     }
 
     std::random_shuffle(recorded_cache_.begin(), recorded_cache_.end());
+    if (max_shuffled_readers_ > 0 && --max_shuffled_readers_ == 0) {
+      std::vector<T> cache;
+      cache.swap(recorded_cache_);
+      return new RecordedRecordReader<T>(std::move(cache));
+    }
     return new RecordedRecordReader<T>(&recorded_cache_);
   }
 
 private:
   RecordInput<T>* underlying_input_;
   bool has_recorded_;
+  int max_shuffled_readers_;
   std::vector<T> recorded_cache_;
 };
 
+// Records in a block file, each as its length (uint32) followed by its bytes. A record is a string or a proto.
+inline void AppendRecordToBlock(const std::string& record, std::string* block) {
+  uint32_t size = record.size();
+  block->append(reinterpret_cast<const char*>(&size), sizeof(size));
+  block->append(record);
+}
+
+template <class ProtoClass>
+void AppendRecordToBlock(const ProtoClass& record, std::string* block) {
+  AppendRecordToBlock(record.SerializeAsString(), block);
+}
+
+inline void ParseRecordFromBlock(const char* data, uint32_t size, std::string* record) {
+  record->assign(data, size);
+}
+
+template <class ProtoClass>
+void ParseRecordFromBlock(const char* data, uint32_t size, ProtoClass* record) {
+  CHECK(record->ParseFromArray(data, size)) << "Corrupt record in a block file.";
+}
+
+// A block of records in a block file.
+struct RecordBlock {
+  int64_t offset;
+  size_t size;
+};
+
+template <class T>
+std::vector<T> ReadRecordBlock(int fd, const RecordBlock& block) {
+  std::string data(block.size, 0);
+  size_t done = 0;
+  while (done < block.size) {
+    ssize_t n = pread(fd, &data[done], block.size - done, block.offset + done);
+    CHECK_GT(n, 0) << "Cannot read a block of records.";
+    done += n;
+  }
+  std::vector<T> records;
+  for (size_t pos = 0; pos < data.size();) {
+    uint32_t size;
+    memcpy(&size, data.data() + pos, sizeof(size));
+    pos += sizeof(size);
+    records.emplace_back();
+    ParseRecordFromBlock(data.data() + pos, size, &records.back());
+    pos += size;
+  }
+  return records;
+}
+
+// Reads the blocks of a block file in the given order, each block with its records shuffled. The next block is
+// read in the background while the records of the current one are consumed.
+template <class T>
+class BlockFileRecordReader : public InputRecordReader<T> {
+public:
+  BlockFileRecordReader(const std::string& filename, const std::vector<RecordBlock>& blocks)
+      : blocks_(blocks), num_loaded_blocks_(0), pos_(0) {
+    fd_ = open(filename.c_str(), O_RDONLY);
+    CHECK_GE(fd_, 0) << "Cannot open " << filename;
+    ReadNextBlockAsync();
+  }
+  virtual ~BlockFileRecordReader() override {
+    if (next_block_.valid()) next_block_.wait();
+    close(fd_);
+  }
+
+  virtual bool Read(T* s) override {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!HasRecord()) {
+      return false;
+    }
+    *s = std::move(current_block_[pos_]);
+    ++pos_;
+    return true;
+  }
+
+  virtual size_t ReadBatch(size_t max_records, std::vector<T>* records) override {
+    std::lock_guard<std::mutex> lock(mutex_);
+    size_t num_records = 0;
+    while (num_records < max_records && HasRecord()) {
+      if (records->size() <= num_records) records->emplace_back();
+      (*records)[num_records++] = std::move(current_block_[pos_]);
+      ++pos_;
+    }
+    return num_records;
+  }
+
+  virtual bool ReachedEnd() override {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return pos_ >= current_block_.size() && num_loaded_blocks_ == blocks_.size();
+  }
+
+private:
+  // Moves to the next block when the current one is consumed. Returns false at the end.
+  bool HasRecord() {
+    while (pos_ >= current_block_.size()) {
+      if (!next_block_.valid()) {
+        return false;
+      }
+      current_block_ = next_block_.get();
+      ++num_loaded_blocks_;
+      std::random_shuffle(current_block_.begin(), current_block_.end());
+      pos_ = 0;
+      ReadNextBlockAsync();
+    }
+    return true;
+  }
+
+  void ReadNextBlockAsync() {
+    if (num_loaded_blocks_ >= blocks_.size()) return;
+    next_block_ = std::async(std::launch::async, &ReadRecordBlock<T>, fd_, blocks_[num_loaded_blocks_]);
+  }
+
+  int fd_;
+  std::vector<RecordBlock> blocks_;
+  size_t num_loaded_blocks_;
+  std::future<std::vector<T> > next_block_;
+  std::vector<T> current_block_;
+  size_t pos_;
+  std::mutex mutex_;
+};
+
+/**
+ * Input like ShuffledCacheInput that keeps the records in a file instead of RAM. The first created reader
+ * reads the records from the underlying input and writes them to the file in blocks of about block_bytes.
+ * Each subsequent reader reads the blocks in a random order and shuffles the records within each block, so at
+ * most two blocks are in memory. The file is removed when the input is destroyed.
+ * Concurrency: as for ShuffledCacheInput.
+ */
+template <class T>
+class ShuffledBlockFileInput : public RecordInput<T> {
+public:
+  // The class takes ownership of underlying_input.
+  ShuffledBlockFileInput(RecordInput<T>* underlying_input, const std::string& filename, size_t block_bytes)
+      : underlying_input_(underlying_input), filename_(filename), block_bytes_(block_bytes), has_recorded_(false),
+        file_(NULL), file_size_(0) {
+  }
+  virtual ~ShuffledBlockFileInput() override {
+    delete underlying_input_;
+    if (file_ != NULL) fclose(file_);
+    if (has_recorded_) unlink(filename_.c_str());
+  }
+
+  virtual InputRecordReader<T>* CreateReader() override {
+    if (!has_recorded_) {
+      has_recorded_ = true;
+      file_ = fopen(filename_.c_str(), "wb");
+      CHECK(file_ != NULL) << "Cannot create " << filename_;
+      return new CachingInputRecordReader<T, ShuffledBlockFileInput<T> >(underlying_input_->CreateReader(), this);
+    }
+    if (file_ != NULL) {
+      WriteBlock();
+      fclose(file_);
+      file_ = NULL;
+      LOG(INFO) << "Cached " << file_size_ / (1 << 20) << "MB of records in " << blocks_.size() << " blocks in "
+                << filename_;
+    }
+    std::random_shuffle(blocks_.begin(), blocks_.end());
+    return new BlockFileRecordReader<T>(filename_, blocks_);
+  }
+
+  // Called by the caching reader of the first pass.
+  void push_back(const T& record) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    AppendRecordToBlock(record, &block_);
+    if (block_.size() >= block_bytes_) {
+      WriteBlock();
+    }
+  }
+
+private:
+  void WriteBlock() {
+    if (block_.empty()) return;
+    CHECK_EQ(block_.size(), fwrite(block_.data(), 1, block_.size(), file_)) << "Cannot write to " << filename_;
+    RecordBlock block;
+    block.offset = file_size_;
+    block.size = block_.size();
+    blocks_.push_back(block);
+    file_size_ += block_.size();
+    block_.clear();
+  }
+
+  RecordInput<T>* underlying_input_;
+  std::string filename_;
+  size_t block_bytes_;
+  bool has_recorded_;
+  FILE* file_;
+  int64_t file_size_;
+  std::mutex mutex_;
+  std::string block_;
+  std::vector<RecordBlock> blocks_;
+};
+
 
 // Cross validation.
 
@@ -331,9 +663,28 @@ public:
     return underlying_reader_->ReachedEnd();
   }
 
+  virtual size_t ReadBatch(size_t max_records, std::vector<T>* records) override {
+    std::lock_guard<std::mutex> lock(mutex_);
+    size_t num_records = 0;
+    // The rows of the batch may all be in the other set.
+    while (num_records == 0) {
+      size_t num_rows = underlying_reader_->ReadBatch(max_records, &batch_);
+      if (num_rows == 0) break;
+      for (size_t i = 0; i < num_rows; ++i) {
+        ++row_id_;
+        if ((row_id_ % num_folds_ != fold_id_) == training_) {
+          if (records->size() <= num_records) records->emplace_back();
+          std::swap((*records)[num_records++], batch_[i]);
+        }
+      }
+    }
+    return num_records;
+  }
+
 private:
   InputRecordReader<T>* underlying_reader_;
   std::mutex mutex_;
+  std::vector<T> batch_;
   int fold_id_;
   int num_folds_;
   bool training_;
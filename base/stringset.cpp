@@ -15,6 +15,7 @@
  */
 
 #include <string.h>
+#include <algorithm>
 #include <string>
 
 #include <glog/logging.h>
@@ -50,10 +51,31 @@ int StringSet::addStringL(const char* s, int slen) {
     pos = m_data.size();
     addHash(hash, pos);
     m_data.insert(m_data.end(), s, s + slen + 1);
+    addStringStart(pos);
   }
   return pos;
 }
 
+void StringSet::addStringStart(int index) {
+  setStringStartBit(index);
+  // Strings are only appended, so only the rank of the word of index (if it is new) and of the words after it
+  // change.
+  updateStringStartsRank(index >> 6);
+}
+
+void StringSet::setStringStartBit(int index) {
+  size_t num_words = (m_data.size() + 63) / 64;
+  m_stringStarts.resize(num_words, 0);
+  m_stringStarts[index >> 6] |= static_cast<uint64_t>(1) << (index & 63);
+}
+
+void StringSet::updateStringStartsRank(size_t first_word) {
+  m_stringStartsRank.resize(m_stringStarts.size(), 0);
+  for (size_t i = std::max<size_t>(first_word, 1); i < m_stringStarts.size(); ++i) {
+    m_stringStartsRank[i] = m_stringStartsRank[i - 1] + __builtin_popcountll(m_stringStarts[i - 1]);
+  }
+}
+
 int StringSet::findStringL(const char* s, int slen, int hash) const {
   if (m_hashes.size() == 0)
     return -1;
@@ -98,13 +120,17 @@ void StringSet::addHashNoRehash(int hash, int value) {
 
 void StringSet::rehashAll() {
   m_hashTableLoad = 0;
+  m_stringStarts.clear();
+  m_stringStartsRank.clear();
   size_t pos = 0;
   while (pos < m_data.size()) {
     const char* str = getString(pos);
     int len = strlen(str);
     addHashNoRehash(stringHash(str, len), pos);
+    setStringStartBit(pos);
     pos += len + 1;
   }
+  updateStringStartsRank(0);
 }
 
 void StringSet::getAllStrings(std::vector<int>* strings) const {
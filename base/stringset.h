@@ -17,6 +17,7 @@
 #ifndef STRINGSET_H_
 #define STRINGSET_H_
 
+#include <stdint.h>
 #include <stdio.h>
 #include <vector>
 
@@ -52,6 +53,18 @@ public:
 	// Return the data size. Entries after this number are free for use
 	int getSize() const { return m_data.size(); }
 
+	// Returns a dense id in [0, numEntries()) for the index of a string or -1 if
+	// the index is not the beginning of a string. Dense ids are given in the order
+	// in which the strings were added (the order of getAllStrings), so they can be
+	// used to index flat arrays of per-string data.
+	int denseId(int index) const {
+		if (index < 0 || static_cast<size_t>(index) >= m_data.size()) return -1;
+		uint64_t word = m_stringStarts[index >> 6];
+		uint64_t bit = static_cast<uint64_t>(1) << (index & 63);
+		if ((word & bit) == 0) return -1;
+		return m_stringStartsRank[index >> 6] + __builtin_popcountll(word & (bit - 1));
+	}
+
 private:
 	// Returns the index of the added string.
 	int addStringL(const char* s, int slen);
@@ -68,7 +81,17 @@ private:
 
 	void rehashAll();
 
+	// Marks the beginning of a string at the given index in m_data.
+	void addStringStart(int index);
+	void setStringStartBit(int index);
+	// Recomputes the ranks of the words from first_word on.
+	void updateStringStartsRank(size_t first_word);
+
 	std::vector<char> m_data;
+	// A bit for every char of m_data that begins a string and the number of
+	// such bits before every 64-bit word (used by denseId).
+	std::vector<uint64_t> m_stringStarts;
+	std::vector<int> m_stringStartsRank;
 	std::vector<int> m_hashes;
 	int m_hashTableLoad;
 };
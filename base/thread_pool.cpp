@@ -0,0 +1,103 @@
+/*
+   Copyright 2015 Software Reliability Lab, ETH Zurich
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ */
+
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <atomic>
+
+#include <glog/logging.h>
+
+// A loop shared by the thread that runs it and its helpers. Helpers that are woken after the last iteration
+// was taken find nothing to do, so the loop is kept alive by whoever still refers to it.
+struct ThreadPool::Loop {
+  Loop(size_t n, const std::function<void(size_t)>* fn) : n(n), fn(fn), next(0), finished(0) {}
+
+  const size_t n;
+  const std::function<void(size_t)>* fn;
+  std::atomic<size_t> next;
+
+  std::mutex mutex;
+  std::condition_variable all_finished;
+  size_t finished;
+};
+
+ThreadPool::ThreadPool(int num_threads) : stopping_(false) {
+  CHECK_GE(num_threads, 0);
+  for (int i = 0; i < num_threads; ++i) {
+    threads_.push_back(std::thread(&ThreadPool::WorkerLoop, this));
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  work_available_.notify_all();
+  for (std::thread& thread : threads_) {
+    thread.join();
+  }
+}
+
+void ThreadPool::ParallelFor(size_t n, int max_helpers, const std::function<void(size_t)>& fn) {
+  std::shared_ptr<Loop> loop(new Loop(n, &fn));
+  size_t helpers = std::min<size_t>(std::max(max_helpers, 0), std::min<size_t>(threads_.size(), n));
+  if (helpers > 0) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      for (size_t i = 0; i < helpers; ++i) {
+        pending_.push_back(loop);
+      }
+    }
+    if (helpers == 1) {
+      work_available_.notify_one();
+    } else {
+      work_available_.notify_all();
+    }
+  }
+  RunIterations(loop.get());
+  std::unique_lock<std::mutex> lock(loop->mutex);
+  loop->all_finished.wait(lock, [&loop]() { return loop->finished == loop->n; });
+}
+
+void ThreadPool::RunIterations(Loop* loop) {
+  size_t done = 0;
+  for (size_t i = loop->next++; i < loop->n; i = loop->next++) {
+    (*loop->fn)(i);
+    ++done;
+  }
+  if (done == 0) return;
+  std::lock_guard<std::mutex> lock(loop->mutex);
+  loop->finished += done;
+  if (loop->finished == loop->n) {
+    loop->all_finished.notify_all();
+  }
+}
+
+void ThreadPool::WorkerLoop() {
+  for (;;) {
+    std::shared_ptr<Loop> loop;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      work_available_.wait(lock, [this]() { return stopping_ || !pending_.empty(); });
+      if (pending_.empty()) return;
+      loop = pending_.front();
+      pending_.pop_front();
+    }
+    RunIterations(loop.get());
+  }
+}
@@ -0,0 +1,59 @@
+/*
+   Copyright 2015 Software Reliability Lab, ETH Zurich
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ */
+
+#ifndef BASE_THREAD_POOL_H_
+#define BASE_THREAD_POOL_H_
+
+#include <stddef.h>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A fixed set of worker threads that run parallel loops. The threads are started once, so that a loop does
+// not pay for creating and joining threads.
+class ThreadPool {
+public:
+  explicit ThreadPool(int num_threads);
+  ~ThreadPool();
+
+  int num_threads() const { return threads_.size(); }
+
+  // Calls fn(i) for every i in [0, n) on the calling thread and at most max_helpers workers, and returns when
+  // all the calls returned. Any number of threads may run loops on the pool at the same time.
+  void ParallelFor(size_t n, int max_helpers, const std::function<void(size_t)>& fn);
+
+private:
+  struct Loop;
+
+  void WorkerLoop();
+  static void RunIterations(Loop* loop);
+
+  std::mutex mutex_;
+  std::condition_variable work_available_;
+  // One entry per worker asked to help with a loop.
+  std::deque<std::shared_ptr<Loop> > pending_;
+  bool stopping_;
+  std::vector<std::thread> threads_;
+
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+};
+
+#endif /* BASE_THREAD_POOL_H_ */
@@ -20,6 +20,9 @@
 #include <unordered_set>
 #include <algorithm>
 #include <iterator>
+#include <limits>
+#include <atomic>
+#include <thread>
 
 #include <gflags/gflags.h>
 #include <glog/logging.h>
@@ -28,6 +31,7 @@
 #include "base/maputil.h"
 #include "base/nbest.h"
 #include "base/simple_histogram.h"
+#include "base/thread_pool.h"
 #include "base/updatable_priority_queue.h"
 
 #include "graph_inference.h"
@@ -48,6 +52,38 @@ DEFINE_int32(graph_loopy_bp_passes, 0, "Number of loopy belief propagation passe
 DEFINE_int32(graph_loopy_bp_steps_per_pass, 3, "Number of loopy belief propagation steps in each inference pass");
 DEFINE_int32(skip_per_arc_optimization_for_nodes_above_degree, 32,
     "Skip the per-arc optimization pass if an edge is connected to a node with the in+out degree more than the given value");
+DEFINE_bool(graph_tree_inference, true,
+    "Whether to label the components in which the nodes to infer form a tree by exact dynamic programming.");
+DEFINE_int32(graph_inference_threads, 1,
+    "Number of threads that optimize the connected components of a query in parallel.");
+DEFINE_int32(min_nodes_for_parallel_inference, 2000,
+    "Queries with fewer nodes have their components optimized on the calling thread.");
+
+DEFINE_double(weight_filter_bits_per_key, 10,
+    "Bits per feature of the Bloom filters consulted before the weight lookups. 0 disables the filters.");
+DEFINE_int32(max_weight_filter_kb, 4096,
+    "Maximum size of each weight Bloom filter, so that it stays in the cache for large models.");
+DEFINE_int32(min_keys_for_weight_filter, 65536,
+    "Weight maps with fewer keys fit in the cache and are probed without a Bloom filter.");
+DEFINE_bool(weight_filter_stats, false,
+    "Whether to count the outcome of the weight lookups that go through a Bloom filter (see "
+    "LogWeightFilterStats). The counts are shared by all threads.");
+
+DEFINE_bool(query_local_weights, false,
+    "Whether to materialize the weights probed while optimizing a query in small per-component tables, so "
+    "that the passes after the first lookup of a feature do not touch the model.");
+
+DEFINE_int32(gradient_merge_samples, 1,
+    "Number of samples each training thread accumulates gradients for in a thread-local buffer before applying "
+    "them to the shared weights. 1 applies the gradients of every sample immediately.");
+
+DEFINE_int32(candidate_list_size, -1,
+    "If positive, PrepareForInference keeps only the best candidates of each candidate list (at least as many as "
+    "the largest beam of the inference reads). Shortens the rebuild after each training pass. If negative, the "
+    "lists are bounded by the largest beam when training and kept whole otherwise. Zero keeps them whole.");
+DEFINE_bool(huge_pages, true,
+    "Whether to allocate the feature table, the serving weights and the candidate lists on huge pages when "
+    "the system provides them.");
 
 DEFINE_bool(use_factors, true, "Flag that enable the use of the factors in training and MAP inference.");
 DEFINE_int32(maximum_depth, 2, "Maximum depth of the multi-level map used to store the factor features");
@@ -69,8 +105,395 @@ static const size_t kStartPerNodeBeamSize = 4;
 static const size_t kMaxPerNodeBeamSize = 64;
 static const size_t kLoopyBPBeamSize = 32;
 
+static const size_t kTreeInferenceBeamSize = 8;
+static const size_t kMaxTreeInferenceLabels = 64;
+
 static const size_t kFactorsLimitBeforeGoingDepperMultiLevelMap = 16;
 
+// The candidate lists of labels are sorted by tasks of this many lists.
+static const size_t kCandidateListsPerTask = 256;
+
+// A GradientBuffer with more entries is applied before it has the gradients of --gradient_merge_samples samples.
+static const size_t kMaxBufferedGradients = 1 << 16;
+
+// A label that no node can have. Used for nodes without an SSVM margin penalty.
+static const int kNoPenaltyLabel = -2;
+
+// A factor hash that is never put in a QueryWeightCache (it is the empty key of its table).
+static const uint64 kNoCachedFactorHash = ~0ULL;
+
+// The empty and deleted keys of the factor weights. Factors with these hashes are not added to the model.
+static const uint64 kEmptyFactorHash = ~0ULL;
+static const uint64 kDeletedFactorHash = ~0ULL - 1;
+
+// Sorts a candidate list best first. With a positive max_size, only the max_size best candidates are kept.
+// Returns the new size of the list.
+template <class T>
+static size_t SortCandidateList(size_t max_size, T* begin, T* end) {
+  typedef std::greater<T> BestFirst;
+  if (max_size > 0 && static_cast<size_t>(end - begin) > max_size) {
+    std::nth_element(begin, begin + max_size, end, BestFirst());
+    end = begin + max_size;
+  }
+  std::sort(begin, end, BestFirst());
+  return end - begin;
+}
+
+// The workers that build the candidate lists and merge the model counts, with one thread per core (the calling
+// thread is one of them). Started on first use and shared by all models.
+static ThreadPool* GetModelBuildingThreadPool() {
+  static ThreadPool* pool = new ThreadPool(std::max(static_cast<int>(std::thread::hardware_concurrency()) - 1, 1));
+  return pool;
+}
+
+// Sorts the lists of a candidate array concurrently, lists_per_task lists at a time on up to num_threads
+// threads. The ranges must be in the order of their lists in the array. With a positive max_size, the
+// truncated lists are moved together and the array shrinks to their total size.
+template <class Array>
+static void SortCandidateLists(const std::vector<CandidateRange*>& ranges, size_t max_size, size_t lists_per_task,
+    int num_threads, Array* candidates) {
+  typename Array::value_type* base = candidates->data();
+  auto sort_lists = [&ranges, base, max_size, lists_per_task](size_t task) {
+    size_t end = std::min((task + 1) * lists_per_task, ranges.size());
+    for (size_t i = task * lists_per_task; i < end; ++i) {
+      CandidateRange* range = ranges[i];
+      range->end = range->begin + SortCandidateList(max_size, base + range->begin, base + range->end);
+    }
+  };
+  size_t num_tasks = (ranges.size() + lists_per_task - 1) / lists_per_task;
+  if (num_threads <= 1 || num_tasks <= 1) {
+    for (size_t task = 0; task < num_tasks; ++task) {
+      sort_lists(task);
+    }
+  } else {
+    GetModelBuildingThreadPool()->ParallelFor(num_tasks, num_threads - 1, sort_lists);
+  }
+  if (max_size == 0) return;
+  uint32_t next = 0;
+  for (CandidateRange* range : ranges) {
+    uint32_t size = range->end - range->begin;
+    std::move(base + range->begin, base + range->end, base + next);
+    range->begin = next;
+    range->end = next + size;
+    next += size;
+  }
+  candidates->resize(next);
+  candidates->shrink_to_fit();
+}
+
+LabelCandidateLists::LabelCandidateLists() {
+  ranges_.set_empty_key(IntPair(-1, -1));
+}
+
+void LabelCandidateLists::Clear() {
+  LabelCandidates().swap(candidates_);
+  ranges_.clear();
+  std::vector<IntPair>().swap(keys_);
+}
+
+void LabelCandidateLists::Count(const IntPair& key) {
+  CandidateRange& range = ranges_[key];
+  if (range.end == 0) keys_.push_back(key);
+  ++range.end;
+}
+
+void LabelCandidateLists::Allocate() {
+  size_t total = 0;
+  for (const IntPair& key : keys_) {
+    CandidateRange& range = ranges_[key];
+    size_t size = range.end;
+    range.begin = range.end = total;
+    total += size;
+  }
+  CHECK_LE(total, std::numeric_limits<uint32_t>::max()) << "Too many label candidates.";
+  candidates_.resize(total);
+}
+
+void LabelCandidateLists::Add(const IntPair& key, const LabelCandidate& candidate) {
+  candidates_[ranges_[key].end++] = candidate;
+}
+
+void LabelCandidateLists::Sort(size_t max_size, int num_threads) {
+  std::vector<CandidateRange*> ranges;
+  ranges.reserve(keys_.size());
+  for (const IntPair& key : keys_) {
+    ranges.push_back(&ranges_.find(key)->second);
+  }
+  SortCandidateLists(ranges, max_size, kCandidateListsPerTask, num_threads, &candidates_);
+}
+
+CandidateSpan<LabelCandidate> LabelCandidateLists::Get(const IntPair& key) const {
+  auto it = ranges_.find(key);
+  if (it == ranges_.end()) return CandidateSpan<LabelCandidate>();
+  const LabelCandidate* base = candidates_.data();
+  return CandidateSpan<LabelCandidate>(base + it->second.begin, base + it->second.end);
+}
+
+size_t LabelCandidateLists::MemoryBytes() const {
+  return candidates_.capacity() * sizeof(LabelCandidate) +
+      ranges_.bucket_count() * sizeof(std::pair<IntPair, CandidateRange>) + keys_.capacity() * sizeof(IntPair);
+}
+
+static inline uint64 HashGraphFeature(const GraphFeature& feature) {
+  return ((static_cast<uint64>(static_cast<uint32_t>(feature.a_)) << 32) | static_cast<uint32_t>(feature.b_)) ^
+      (static_cast<uint64>(static_cast<uint32_t>(feature.type_)) * 0x9e3779b97f4a7c15ULL);
+}
+
+// The MurmurHash3 finalizer.
+static inline uint64 MixHash(uint64 hash) {
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdULL;
+  hash ^= hash >> 33;
+  hash *= 0xc4ceb9fe1a85ec53ULL;
+  hash ^= hash >> 33;
+  return hash;
+}
+
+// The hash of a feature in a HashedFeatureWeights or QuantizedWeights table (HashGraphFeature mixed with the MurmurHash3 finalizer).
+static inline uint64 HashFeatureForTable(const GraphFeature& feature) {
+  return MixHash(HashGraphFeature(feature));
+}
+
+// The hash of a factor in a QuantizedWeights table.
+static inline uint64 HashFactorForTable(uint64 hash) {
+  return MixHash(hash);
+}
+
+// Consults the Bloom filters of the model before the weight lookups of a reader. With --weight_filter_stats,
+// counts the outcome of the probes that go through a filter and adds the counts to the stats of the model when
+// the reader goes away.
+class FilteredWeightProbes {
+public:
+  explicit FilteredWeightProbes(const GraphInference& fweights)
+      : fweights_(fweights),
+        feature_filter_(fweights.feature_filter_.SizeBytes() != 0 ? &fweights.feature_filter_ : NULL),
+        factor_filter_(fweights.factor_filter_.SizeBytes() != 0 ? &fweights.factor_filter_ : NULL),
+        count_(FLAGS_weight_filter_stats), probes_(0), filtered_(0), false_positives_(0) {
+  }
+  ~FilteredWeightProbes() {
+    if (probes_ == 0) return;
+    WeightFilterStats& stats = fweights_.weight_filter_stats_;
+    stats.probes.fetch_add(probes_, std::memory_order_relaxed);
+    stats.filtered.fetch_add(filtered_, std::memory_order_relaxed);
+    stats.false_positives.fetch_add(false_positives_, std::memory_order_relaxed);
+  }
+
+  bool MayHaveFeature(const GraphFeature& feature) {
+    return MayContain(feature_filter_, HashGraphFeature(feature));
+  }
+
+  bool MayHaveFactor(uint64 hash) {
+    return MayContain(factor_filter_, hash);
+  }
+
+  // A lookup that passed MayHaveFeature or MayHaveFactor found no weight.
+  void CountFeatureMiss() {
+    if (count_ && feature_filter_ != NULL) ++false_positives_;
+  }
+  void CountFactorMiss() {
+    if (count_ && factor_filter_ != NULL) ++false_positives_;
+  }
+
+private:
+  bool MayContain(const BlockedBloomFilter* filter, uint64 key) {
+    if (filter == NULL) return true;
+    if (count_) ++probes_;
+    if (filter->MayContain(key)) return true;
+    if (count_) ++filtered_;
+    return false;
+  }
+
+  const GraphInference& fweights_;
+  // NULL for the weights that are not filtered.
+  const BlockedBloomFilter* feature_filter_;
+  const BlockedBloomFilter* factor_filter_;
+  bool count_;
+  int64 probes_;
+  int64 filtered_;
+  int64 false_positives_;
+};
+
+// Readers of the feature and factor weights used by the scoring kernels. Missing weights are zero.
+class FullPrecisionWeights {
+public:
+  explicit FullPrecisionWeights(const GraphInference& fweights)
+      : features_(fweights.features_), factor_features_(fweights.factor_features_),
+        hashed_weights_(fweights.hashed_weights_.IsEnabled() ? &fweights.hashed_weights_ : NULL),
+        probes_(fweights) {
+  }
+
+  double GetFeatureWeight(const GraphFeature& feature) {
+    if (hashed_weights_ != NULL) return hashed_weights_->Get(HashFeatureForTable(feature));
+    if (!probes_.MayHaveFeature(feature)) return 0.0;
+    auto feature_it = features_.find(feature);
+    if (feature_it == features_.end()) {
+      probes_.CountFeatureMiss();
+      return 0.0;
+    }
+    return feature_it->second.getValue();
+  }
+
+  double GetFactorWeight(uint64 hash) {
+    if (!probes_.MayHaveFactor(hash)) return 0.0;
+    auto factor_feature = factor_features_.find(hash);
+    if (factor_feature == factor_features_.end()) {
+      probes_.CountFactorMiss();
+      return 0.0;
+    }
+    return factor_feature->second.getValue();
+  }
+
+private:
+  const GraphInference::FeaturesMap& features_;
+  const GraphInference::FactorWeightsMap& factor_features_;
+  const HashedFeatureWeights* hashed_weights_;
+  FilteredWeightProbes probes_;
+};
+
+template <class Code>
+class QuantizedWeightsReader {
+public:
+  explicit QuantizedWeightsReader(const GraphInference& fweights)
+      : weights_(GetQuantizedWeights(fweights)), probes_(fweights) {
+  }
+
+  double GetFeatureWeight(const GraphFeature& feature) {
+    if (!probes_.MayHaveFeature(feature)) return 0.0;
+    const Code* code = weights_.features.Find(feature, HashFeatureForTable(feature));
+    if (code == NULL) {
+      probes_.CountFeatureMiss();
+      return 0.0;
+    }
+    return weights_.feature_quantizer.Dequantize(*code);
+  }
+
+  double GetFactorWeight(uint64 hash) {
+    if (!probes_.MayHaveFactor(hash)) return 0.0;
+    const Code* code = weights_.factor_features.Find(hash, HashFactorForTable(hash));
+    if (code == NULL) {
+      probes_.CountFactorMiss();
+      return 0.0;
+    }
+    return weights_.factor_quantizer.Dequantize(*code);
+  }
+
+private:
+  static const QuantizedWeights<Code>& GetQuantizedWeights(const GraphInference& fweights);
+
+  const QuantizedWeights<Code>& weights_;
+  FilteredWeightProbes probes_;
+};
+
+template <>
+const QuantizedWeights<uint8_t>& QuantizedWeightsReader<uint8_t>::GetQuantizedWeights(
+    const GraphInference& fweights) {
+  return *fweights.quantized_weights_8_;
+}
+
+template <>
+const QuantizedWeights<uint16_t>& QuantizedWeightsReader<uint16_t>::GetQuantizedWeights(
+    const GraphInference& fweights) {
+  return *fweights.quantized_weights_16_;
+}
+
+class FrozenWeightsReader {
+public:
+  explicit FrozenWeightsReader(const GraphInference& fweights)
+      : fweights_(fweights), weights_(*fweights.frozen_weights_), lazy_segments_(fweights.lazy_segments_ != NULL),
+        hashed_weights_(fweights.hashed_weights_.IsEnabled() ? &fweights.hashed_weights_ : NULL),
+        probes_(fweights) {
+  }
+
+  double GetFeatureWeight(const GraphFeature& feature) {
+    if (hashed_weights_ != NULL) return hashed_weights_->Get(HashFeatureForTable(feature));
+    if (!probes_.MayHaveFeature(feature)) return 0.0;
+    const FrozenWeights::FeaturesMap& features =
+        lazy_segments_ ? fweights_.GetRelationSegment(feature.type_).features : weights_.features;
+    auto feature_it = features.find(feature);
+    if (feature_it == features.end()) {
+      probes_.CountFeatureMiss();
+      return 0.0;
+    }
+    return feature_it->second;
+  }
+
+  double GetFactorWeight(uint64 hash) {
+    if (!probes_.MayHaveFactor(hash)) return 0.0;
+    auto factor_feature = weights_.factor_features.find(hash);
+    if (factor_feature == weights_.factor_features.end()) {
+      probes_.CountFactorMiss();
+      return 0.0;
+    }
+    return factor_feature->second;
+  }
+
+private:
+  const GraphInference& fweights_;
+  const FrozenWeights& weights_;
+  bool lazy_segments_;
+  const HashedFeatureWeights* hashed_weights_;
+  FilteredWeightProbes probes_;
+};
+
+// The weights looked up while optimizing one connected component of a query (zero for missing ones). The table
+// is sized to the features actually probed, so the passes score against a cache-resident table.
+struct QueryWeightCache {
+  QueryWeightCache() {
+    features.set_empty_key(GraphFeature(-1, -1, -1));
+    factor_features.set_empty_key(kNoCachedFactorHash);
+  }
+
+  google::dense_hash_map<GraphFeature, double> features;
+  google::dense_hash_map<uint64, double> factor_features;
+};
+
+// Serves the weights from a QueryWeightCache and looks up the ones missing in it with the Reader of the model.
+// Without a cache, all lookups go to the Reader.
+template <class Reader>
+class CachedWeights {
+public:
+  CachedWeights(const GraphInference& fweights, QueryWeightCache* cache) : reader_(fweights), cache_(cache) {
+  }
+
+  double GetFeatureWeight(const GraphFeature& feature) {
+    if (cache_ == NULL) return reader_.GetFeatureWeight(feature);
+    auto feature_it = cache_->features.find(feature);
+    if (feature_it != cache_->features.end()) return feature_it->second;
+    double weight = reader_.GetFeatureWeight(feature);
+    cache_->features.insert(std::pair<GraphFeature, double>(feature, weight));
+    return weight;
+  }
+
+  double GetFactorWeight(uint64 hash) {
+    if (cache_ == NULL || hash == kNoCachedFactorHash) return reader_.GetFactorWeight(hash);
+    auto factor_feature = cache_->factor_features.find(hash);
+    if (factor_feature != cache_->factor_features.end()) return factor_feature->second;
+    double weight = reader_.GetFactorWeight(hash);
+    cache_->factor_features.insert(std::pair<uint64, double>(hash, weight));
+    return weight;
+  }
+
+private:
+  Reader reader_;
+  QueryWeightCache* cache_;
+};
+
+// Compile-time configuration of the scoring kernels and of the optimization passes that use them, chosen once
+// per query. Serving and pseudo-likelihood training score without a penalty, max-margin training adds the
+// margin penalty. Queries without factors skip the factor lookups. Frozen and quantized models read their
+// weights through a FrozenWeightsReader or a QuantizedWeightsReader.
+template <bool kWithPenalty, bool kWithFactors, class WeightsType = FullPrecisionWeights>
+struct ScoringPolicy {
+  static const bool with_penalty = kWithPenalty;
+  static const bool with_factors = kWithFactors;
+  typedef WeightsType Weights;
+};
+
+// Calls functor(Policy()) with the ScoringPolicy of an assignment on a model. All the scoring with a policy
+// chooses it here, once per query.
+template <class Functor>
+static void DispatchScoringPolicy(const GraphInference& model, const GraphNodeAssignment& a, const Functor& functor);
+
 // Returns -1 if the result will overflow.
 uint64 CalculateFactorial(int n) {
   uint64 result = 1;
@@ -96,6 +519,29 @@ uint64 HashInt(uint64 x) {
   return x;
 }
 
+// The hash of a factor is the sum of the hashes of the labels of its variables.
+template <int kArity>
+inline uint64 HashFactorLabelsOfArity(const int* vars, const int* labels) {
+  uint64 hash = 0;
+  for (int i = 0; i < kArity; ++i) {
+    hash += HashInt(labels[vars[i]]);
+  }
+  return hash;
+}
+
+inline uint64 HashFactorLabels(const std::vector<int>& vars, const std::vector<int>& labels) {
+  switch (vars.size()) {
+  case 2: return HashFactorLabelsOfArity<2>(vars.data(), labels.data());
+  case 3: return HashFactorLabelsOfArity<3>(vars.data(), labels.data());
+  case 4: return HashFactorLabelsOfArity<4>(vars.data(), labels.data());
+  }
+  uint64 hash = 0;
+  for (int var : vars) {
+    hash += HashInt(labels[var]);
+  }
+  return hash;
+}
+
 
 class GraphQuery : public Nice2Query {
 public:
@@ -109,6 +555,7 @@ public:
   virtual void FromFeaturesQueryProto(const FeaturesQuery &query) override {
     arcs_.clear();
     factors_.clear();
+    nodes_in_scope_.clear();
 
     int max_index = 0;
     for (const Feature& feature : query) {
@@ -144,8 +591,71 @@ public:
       }
     }
     std::sort(arcs_.begin(), arcs_.end());
+    BuildIndexes(max_index + 1);
+  }
+
+  void FromCompactQuery(const CompactQuery& query) {
+    arcs_.resize(query.arcs.size() / 3);
+    for (size_t i = 0; i < arcs_.size(); ++i) {
+      arcs_[i].node_a = query.arcs[3 * i];
+      arcs_[i].node_b = query.arcs[3 * i + 1];
+      arcs_[i].type = query.arcs[3 * i + 2];
+    }
+    nodes_in_scope_.resize(query.scope_offsets.size() - 1);
+    for (size_t i = 0; i < nodes_in_scope_.size(); ++i) {
+      nodes_in_scope_[i].assign(query.scope_nodes.begin() + query.scope_offsets[i],
+                                query.scope_nodes.begin() + query.scope_offsets[i + 1]);
+    }
+    factors_.resize(query.factor_offsets.size() - 1);
+    for (size_t i = 0; i < factors_.size(); ++i) {
+      factors_[i] = Factor(query.factor_nodes.begin() + query.factor_offsets[i],
+                           query.factor_nodes.begin() + query.factor_offsets[i + 1]);
+    }
+    // The adjacency is already sorted and without duplicates.
+    arcs_adjacent_to_node_.resize(query.num_nodes);
+    for (int node = 0; node < query.num_nodes; ++node) {
+      std::vector<Arc>& adjacent = arcs_adjacent_to_node_[node];
+      adjacent.clear();
+      adjacent.reserve(query.adjacent_offsets[node + 1] - query.adjacent_offsets[node]);
+      for (int i = query.adjacent_offsets[node]; i < query.adjacent_offsets[node + 1]; ++i) {
+        adjacent.push_back(arcs_[query.adjacent_arcs[i]]);
+      }
+    }
+    BuildIndexesFromAdjacency();
+  }
+
+  void ToCompactQuery(CompactQuery* query) const {
+    query->num_nodes = arcs_adjacent_to_node_.size();
+    query->arcs.clear();
+    for (const Arc& a : arcs_) {
+      query->arcs.insert(query->arcs.end(), {a.node_a, a.node_b, a.type});
+    }
+    query->scope_offsets.assign(1, 0);
+    query->scope_nodes.clear();
+    for (const std::vector<int>& scope : nodes_in_scope_) {
+      query->scope_nodes.insert(query->scope_nodes.end(), scope.begin(), scope.end());
+      query->scope_offsets.push_back(query->scope_nodes.size());
+    }
+    query->factor_offsets.assign(1, 0);
+    query->factor_nodes.clear();
+    for (const Factor& factor : factors_) {
+      query->factor_nodes.insert(query->factor_nodes.end(), factor.begin(), factor.end());
+      query->factor_offsets.push_back(query->factor_nodes.size());
+    }
+    query->adjacent_offsets.assign(1, 0);
+    query->adjacent_arcs.clear();
+    for (const std::vector<Arc>& adjacent : arcs_adjacent_to_node_) {
+      for (const Arc& a : adjacent) {
+        query->adjacent_arcs.push_back(std::lower_bound(arcs_.begin(), arcs_.end(), a) - arcs_.begin());
+      }
+      query->adjacent_offsets.push_back(query->adjacent_arcs.size());
+    }
+  }
 
-    arcs_adjacent_to_node_.assign(max_index + 1, std::vector<Arc>());
+private:
+  // Builds the per-node, per-pair and per-component indexes of arcs_, nodes_in_scope_ and factors_.
+  void BuildIndexes(int num_nodes) {
+    arcs_adjacent_to_node_.assign(num_nodes, std::vector<Arc>());
     for (const Arc& a : arcs_) {
       arcs_adjacent_to_node_[a.node_a].push_back(a);
       arcs_adjacent_to_node_[a.node_b].push_back(a);
@@ -154,30 +664,38 @@ public:
       std::sort(v.begin(), v.end());
       v.erase(std::unique(v.begin(), v.end()), v.end());
     }
+    BuildIndexesFromAdjacency();
+  }
 
+  // Builds the indexes other than arcs_adjacent_to_node_, which has an entry for every node.
+  void BuildIndexesFromAdjacency() {
+    const int num_nodes = arcs_adjacent_to_node_.size();
     arcs_connecting_node_pair_.clear();
     for (const Arc& a : arcs_) {
       arcs_connecting_node_pair_[IntPair(a.node_a, a.node_b)].push_back(a);
       arcs_connecting_node_pair_[IntPair(a.node_b, a.node_a)].push_back(a);
     }
 
-    scopes_per_nodes_.assign(max_index + 1, std::vector<int>());
+    scopes_per_nodes_.assign(num_nodes, std::vector<int>());
     for (size_t scope = 0; scope < nodes_in_scope_.size(); ++scope) {
       for (int node : nodes_in_scope_[scope]) {
         scopes_per_nodes_[node].push_back(scope);
       }
     }
 
-    factors_of_a_node_.assign(max_index + 1, std::vector<int>());
+    factors_of_a_node_.assign(num_nodes, std::vector<int>());
+    factor_variables_.clear();
+    factor_variables_.reserve(factors_.size());
     for (size_t i = 0; i < factors_.size(); ++i) {
       for (auto var = factors_[i].begin(); var != factors_[i].end(); ++var) {
         factors_of_a_node_[*var].push_back(i);
       }
+      factor_variables_.emplace_back(factors_[i].begin(), factors_[i].end());
     }
 
+    ComputeComponents();
   }
 
-private:
   struct Arc {
     int node_a, node_b, type;
     bool operator==(const Arc& o) const {
@@ -194,6 +712,8 @@ private:
   std::vector<std::vector<int> > factors_of_a_node_;
   std::vector<Arc> arcs_;
   std::vector<Factor> factors_;
+  // The variables of each factor in a contiguous array (for hashing the factor labels).
+  std::vector<std::vector<int> > factor_variables_;
   google::dense_hash_map<IntPair, std::vector<Arc> > arcs_connecting_node_pair_;
 
   LabelSet label_set_;
@@ -201,8 +721,94 @@ private:
   std::vector<std::vector<int> > nodes_in_scope_;
   std::vector<std::vector<int> > scopes_per_nodes_;
 
+  // A connected component of the query. Nodes are connected by arcs, factors and scopes, so different
+  // components share no features or constraints and are optimized independently.
+  struct Component {
+    std::vector<int> nodes;
+    std::vector<int> arcs;  // Indices in arcs_.
+    std::vector<int> factors;  // Indices in factors_.
+  };
+  // The components with scopes come first, the first num_components_with_scopes_ components.
+  std::vector<Component> components_;
+  size_t num_components_with_scopes_;
+  std::vector<int> component_of_node_;
+  std::vector<int> index_in_component_;  // The position of a node in the nodes of its component.
+  std::vector<int> component_of_scope_;
+
+  int FindRoot(std::vector<int>* parent, int node) const {
+    while ((*parent)[node] != node) {
+      (*parent)[node] = (*parent)[(*parent)[node]];
+      node = (*parent)[node];
+    }
+    return node;
+  }
+
+  void JoinNodes(std::vector<int>* parent, int node1, int node2) const {
+    node1 = FindRoot(parent, node1);
+    node2 = FindRoot(parent, node2);
+    if (node1 != node2) (*parent)[std::max(node1, node2)] = std::min(node1, node2);
+  }
+
+  void ComputeComponents() {
+    const int num_nodes = arcs_adjacent_to_node_.size();
+    std::vector<int> parent(num_nodes);
+    for (int node = 0; node < num_nodes; ++node) {
+      parent[node] = node;
+    }
+    for (const Arc& a : arcs_) {
+      JoinNodes(&parent, a.node_a, a.node_b);
+    }
+    for (const std::vector<int>& vars : factor_variables_) {
+      for (size_t i = 1; i < vars.size(); ++i) {
+        JoinNodes(&parent, vars[0], vars[i]);
+      }
+    }
+    for (const std::vector<int>& scope : nodes_in_scope_) {
+      for (size_t i = 1; i < scope.size(); ++i) {
+        JoinNodes(&parent, scope[0], scope[i]);
+      }
+    }
+    std::vector<bool> root_has_scope(num_nodes, false);
+    for (const std::vector<int>& scope : nodes_in_scope_) {
+      root_has_scope[FindRoot(&parent, scope[0])] = true;
+    }
+
+    // Number the components with scopes first, each group in the order of their smallest node.
+    std::vector<int> component_of_root(num_nodes, -1);
+    num_components_with_scopes_ = 0;
+    for (int node = 0; node < num_nodes; ++node) {
+      if (parent[node] == node && root_has_scope[node]) component_of_root[node] = num_components_with_scopes_++;
+    }
+    int num_components = num_components_with_scopes_;
+    for (int node = 0; node < num_nodes; ++node) {
+      if (parent[node] == node && !root_has_scope[node]) component_of_root[node] = num_components++;
+    }
+
+    components_.assign(num_components, Component());
+    component_of_node_.assign(num_nodes, -1);
+    index_in_component_.assign(num_nodes, -1);
+    for (int node = 0; node < num_nodes; ++node) {
+      int component = component_of_root[FindRoot(&parent, node)];
+      component_of_node_[node] = component;
+      index_in_component_[node] = components_[component].nodes.size();
+      components_[component].nodes.push_back(node);
+    }
+    for (size_t i = 0; i < arcs_.size(); ++i) {
+      components_[component_of_node_[arcs_[i].node_a]].arcs.push_back(i);
+    }
+    for (size_t i = 0; i < factor_variables_.size(); ++i) {
+      if (factor_variables_[i].empty()) continue;
+      components_[component_of_node_[factor_variables_[i][0]]].factors.push_back(i);
+    }
+    component_of_scope_.assign(nodes_in_scope_.size(), -1);
+    for (size_t scope = 0; scope < nodes_in_scope_.size(); ++scope) {
+      component_of_scope_[scope] = component_of_node_[nodes_in_scope_[scope][0]];
+    }
+  }
+
   friend class GraphNodeAssignment;
-  friend class LoopyBPInference;
+  template <class Policy> friend class LoopyBPInference;
+  template <class Policy> friend class TreeInference;
   friend class GraphInference;
 };
 
@@ -235,69 +841,87 @@ struct GraphInferenceStats {
 class GraphNodeAssignment : public Nice2Assignment {
 public:
   GraphNodeAssignment(const GraphQuery* query, LabelSet* label_set, int unknown_label)
-    : query_(query), label_set_(label_set), unknown_label_(unknown_label) {
+    : penalty_(0), query_(query), label_set_(label_set), unknown_label_(unknown_label) {
   }
   virtual ~GraphNodeAssignment() {
   }
 
   virtual void SetUpEqualityPenalty(double penalty) override {
-    ClearPenalty();
-    for (size_t i = 0; i < assignments_.size(); ++i) {
-      if (assignments_[i].must_infer) {
-        penalties_[i].label = assignments_[i].label;
-        penalties_[i].penalty = penalty;
+    penalty_labels_.assign(labels_.size(), kNoPenaltyLabel);
+    for (size_t i = 0; i < labels_.size(); ++i) {
+      if (must_infer_[i]) {
+        penalty_labels_[i] = labels_[i];
       }
     }
+    penalty_ = penalty;
   }
 
   virtual void ClearPenalty() override {
-    penalties_.assign(assignments_.size(), LabelPenalty());
+    penalty_labels_.clear();
+    penalty_ = 0;
   }
 
   virtual void FromNodeAssignmentsProto(const NodeAssignments &assignments) override {
     size_t variables_count = query_->arcs_adjacent_to_node_.size();
-    assignments_.assign(variables_count, Assignment());
+    labels_.assign(variables_count, -1);
+    must_infer_.assign(variables_count, false);
     for (const auto& assignment : assignments) {
-      Assignment aset;
-      aset.label = label_set_->AddLabelName(assignment.label().c_str());
-      aset.must_infer = !assignment.given();
+      int label = label_set_->AddLabelName(assignment.label().c_str());
       if (assignment.node_index() < variables_count) {
-        assignments_[assignment.node_index()] = aset;
+        labels_[assignment.node_index()] = label;
+        must_infer_[assignment.node_index()] = !assignment.given();
+      }
+    }
+    RebuildScopeLabelUsage();
+    ClearPenalty();
+  }
+
+  void FromCompactQuery(const CompactQuery& query) {
+    size_t variables_count = query_->arcs_adjacent_to_node_.size();
+    labels_.assign(variables_count, -1);
+    must_infer_.assign(variables_count, false);
+    for (size_t i = 0; i < query.assignments.size(); i += 3) {
+      size_t node = query.assignments[i];
+      int label = query.assignments[i + 1];
+      if (label < 0) {
+        label = label_set_->AddLabelName(query.unknown_labels[-1 - label].c_str());
+      }
+      if (node < variables_count) {
+        labels_[node] = label;
+        must_infer_[node] = !query.assignments[i + 2];
       }
     }
+    RebuildScopeLabelUsage();
     ClearPenalty();
   }
 
   virtual void FillInferResponse(InferResponse* response) const override {
-    for (size_t i = 0; i < assignments_.size(); ++i) {
-      if (assignments_[i].label < 0) continue;
+    for (size_t i = 0; i < labels_.size(); ++i) {
+      if (labels_[i] < 0) continue;
 
       auto *assignment = response->add_node_assignments();
       assignment->set_node_index(i);
-      assignment->set_given(!assignments_[i].must_infer);
-      assignment->set_label(label_set_->GetLabelName(assignments_[i].label));
+      assignment->set_given(!must_infer_[i]);
+      assignment->set_label(label_set_->GetLabelName(labels_[i]));
     }
   }
 
+  template <class Policy>
   void GetCandidatesForNode(
-      Nice2Inference* inference, 
-      const int node, 
+      const GraphInference& graphInference,
+      const int node,
       std::vector<std::pair<int, double>>* scored_candidates) {
-    GraphInference* graphInference = static_cast<GraphInference*>(inference);
     std::vector<int> candidates;
-    GetLabelCandidates(*graphInference, node, &candidates, kMaxPerArcBeamSize);
+    GetLabelCandidates(graphInference, node, &candidates, kMaxPerArcBeamSize);
+
+    RemoveInvalidLabels(graphInference, &candidates);
+    std::vector<double> scores;
+    GetNodeScoresForCandidates<Policy>(graphInference, node, candidates, &scores);
 
     scored_candidates->clear();
-    Assignment& nodea = assignments_[node];
-    int original_label = nodea.label;
     for (size_t i = 0; i < candidates.size() ; i++) {
-      int candidate = candidates[i];
-      nodea.label = candidate;
-      if (!graphInference->label_checker_.IsLabelValid(candidate)) continue;
-      double score = GetNodeScore(*graphInference, node);
-      scored_candidates->push_back(std::pair<int, double>(candidate, score));
+      scored_candidates->push_back(std::pair<int, double>(candidates[i], scores[i]));
     }
-    nodea.label = original_label;
 
     std::sort(scored_candidates->begin(), scored_candidates->end(), [](const std::pair<int,double> &left, const std::pair<int,double> &right) {
       return right.second < left.second;
@@ -306,13 +930,24 @@ public:
  
 
   virtual void GetNBestCandidates(
-      Nice2Inference* inference,
+      const Nice2Inference* inference,
       const int n,
       nice2protos::NBestResponse* response) override {
+    const GraphInference& graphInference = *static_cast<const GraphInference*>(inference);
+    DispatchScoringPolicy(graphInference, *this, [this, &graphInference, n, response](auto policy) {
+      GetNBestCandidates<decltype(policy)>(graphInference, n, response);
+    });
+  }
+
+  template <class Policy>
+  void GetNBestCandidates(
+      const GraphInference& graphInference,
+      const int n,
+      nice2protos::NBestResponse* response) {
     std::vector<std::pair<int, double>> scored_candidates;
-    for (size_t i = 0; i < assignments_.size(); ++i) {
-      if (assignments_[i].must_infer) {
-        GetCandidatesForNode(inference, i, &scored_candidates);
+    for (size_t i = 0; i < labels_.size(); ++i) {
+      if (must_infer_[i]) {
+        GetCandidatesForNode<Policy>(graphInference, i, &scored_candidates);
         auto *distribution = response->add_candidates_distributions();
         distribution->set_node(i);
         // Take only the top-n candidates to the response
@@ -331,9 +966,9 @@ public:
   }
 
   virtual void ClearInferredAssignment() override {
-    for (size_t i = 0; i < assignments_.size(); ++i) {
-      if (assignments_[i].must_infer) {
-        assignments_[i].label = -1;
+    for (size_t i = 0; i < labels_.size(); ++i) {
+      if (must_infer_[i]) {
+        SetLabel(i, -1);
       }
     }
   }
@@ -343,13 +978,13 @@ public:
     int correct_labels = 0;
     int incorrect_labels = 0;
     int num_known_predictions = 0;
-    for (size_t i = 0; i < assignments_.size(); ++i) {
-      if (assignments_[i].must_infer) {
-        if (assignments_[i].label != unknown_label_) {
+    for (size_t i = 0; i < labels_.size(); ++i) {
+      if (must_infer_[i]) {
+        if (labels_[i] != unknown_label_) {
           ++num_known_predictions;
         }
-        if (assignments_[i].label == ref->assignments_[i].label &&
-            assignments_[i].label != unknown_label_) {
+        if (labels_[i] == ref->labels_[i] &&
+            labels_[i] != unknown_label_) {
           ++correct_labels;
         } else {
           ++incorrect_labels;
@@ -365,13 +1000,13 @@ public:
   virtual void CompareAssignmentErrors(const Nice2Assignment* reference, SingleLabelErrorStats* error_stats) const override {
     const GraphNodeAssignment* ref = static_cast<const GraphNodeAssignment*>(reference);
     std::lock_guard<std::mutex> guard(error_stats->lock);
-    for (size_t i = 0; i < assignments_.size(); ++i) {
-      if (assignments_[i].must_infer) {
-        if (assignments_[i].label != ref->assignments_[i].label) {
+    for (size_t i = 0; i < labels_.size(); ++i) {
+      if (must_infer_[i]) {
+        if (labels_[i] != ref->labels_[i]) {
           error_stats->errors_and_counts[StringPrintf(
               "%s -> %s",
-              ref->assignments_[i].label == -1 ? "[none]" : label_set_->GetLabelName(ref->assignments_[i].label),
-              assignments_[i].label == -1 ? "[keep-original]" : label_set_->GetLabelName(assignments_[i].label))]++;
+              ref->labels_[i] == -1 ? "[none]" : label_set_->GetLabelName(ref->labels_[i]),
+              labels_[i] == -1 ? "[keep-original]" : label_set_->GetLabelName(labels_[i]))]++;
         }
       }
     }
@@ -379,8 +1014,8 @@ public:
 
   std::string DebugString() const {
     std::string result;
-    for (int node = 0; node < static_cast<int>(assignments_.size()); ++node) {
-      StringAppendF(&result, "[%d:%s]%s ", node, label_set_->GetLabelName(assignments_[node].label), assignments_[node].must_infer ? "" : "*");
+    for (int node = 0; node < static_cast<int>(labels_.size()); ++node) {
+      StringAppendF(&result, "[%d:%s]%s ", node, label_set_->GetLabelName(labels_[node]), must_infer_[node] ? "" : "*");
     }
     return result;
   }
@@ -391,122 +1026,125 @@ public:
 
   // Returns the penalty associated with a node and its label (used in Max-Margin training).
   double GetNodePenalty(int node) const {
-    return (assignments_[node].label == penalties_[node].label) ? penalties_[node].penalty : 0.0;
+    return GetNodePenaltyForLabel(node, labels_[node]);
+  }
+  bool HasPenalty() const {
+    return !penalty_labels_.empty();
+  }
+  bool HasFactors() const {
+    return !query_->factors_.empty();
+  }
+  double GetNodePenaltyForLabel(int node, int label) const {
+    if (penalty_labels_.empty()) return 0.0;
+    return (label == penalty_labels_[node]) ? penalty_ : 0.0;
   }
   // Gets the score contributed by all arcs adjacent to a node.
+  template <class Policy>
   double GetNodeScore(const GraphInference& fweights, int node) const {
-    double sum = -GetNodePenalty(node);
-    const GraphInference::FeaturesMap& features = fweights.features_;
-    const GraphInference::Uint64FactorFeaturesMap& factor_features = fweights.factor_features_;
+    double sum = Policy::with_penalty ? -GetNodePenalty(node) : 0.0;
+    CachedWeights<typename Policy::Weights> weights(fweights, GetWeightCache(node));
     for (const GraphQuery::Arc& arc : query_->arcs_adjacent_to_node_[node]) {
-      GraphFeature feature(
-          assignments_[arc.node_a].label,
-          assignments_[arc.node_b].label,
-          arc.type);
-      auto feature_it = features.find(feature);
-      if (feature_it != features.end()) {
-        sum += feature_it->second.getValue();
-      }
+      sum += weights.GetFeatureWeight(GraphFeature(
+          labels_[arc.node_a],
+          labels_[arc.node_b],
+          arc.type));
     }
 
-    const std::vector<int>& factors_of_a_node = query_->factors_of_a_node_[node];
-    for (size_t i = 0; i < factors_of_a_node.size(); ++i) {
-      uint64 hash = 0;
-      const Factor& factor = query_->factors_[factors_of_a_node[i]];
-      for (auto var_it = factor.begin();
-                var_it != factor.end(); ++var_it) {
-        hash += HashInt(assignments_[*var_it].label);
-      }
-
-      auto factor_feature = factor_features.find(hash);
-      if (factor_feature != factor_features.end()) {
-        sum += factor_feature->second;
-      }
+    if (!Policy::with_factors) return sum;
+    for (int factor_id : query_->factors_of_a_node_[node]) {
+      sum += weights.GetFactorWeight(HashFactorLabels(query_->factor_variables_[factor_id], labels_));
     }
     return sum;
   }
 
-  // Gets the node score given an assignment
-  double GetNodeScoreGivenAssignmentToANode(const GraphInference& fweights, int node, int node_assigned, int node_assignment) const {
-    double sum = -GetNodePenalty(node);
-    const GraphInference::FeaturesMap& features = fweights.features_;
-    const GraphInference::Uint64FactorFeaturesMap& factor_features = fweights.factor_features_;
-    for (const GraphQuery::Arc& arc : query_->arcs_adjacent_to_node_[node]) {
-      int node_a_label;
-      int node_b_label;
-      if (arc.node_a == node_assigned) {
-        node_a_label = node_assignment;
-      } else {
-        node_a_label = assignments_[arc.node_a].label;
-      }
-      if (arc.node_b == node_assigned) {
-        node_b_label = node_assignment;
-      } else {
-        node_b_label = assignments_[arc.node_b].label;
-      }
-      GraphFeature feature(
-          node_a_label,
-          node_b_label,
-          arc.type);
-      auto feature_it = features.find(feature);
-      if (feature_it != features.end()) {
-        sum += feature_it->second.getValue();
-      }
+  // Gets the score of every candidate label of a node, i.e. the same as GetNodeScore after setting each of
+  // the candidates to the node, but in one sweep over the arcs and the factors of the node.
+  template <class Policy>
+  void GetNodeScoresForCandidates(
+      const GraphInference& fweights, int node,
+      const std::vector<int>& candidates, std::vector<double>* scores) const {
+    const size_t num_candidates = candidates.size();
+    scores->resize(num_candidates);
+    double* candidate_scores = scores->data();
+    for (size_t i = 0; i < num_candidates; ++i) {
+      candidate_scores[i] = Policy::with_penalty ? -GetNodePenaltyForLabel(node, candidates[i]) : 0.0;
     }
 
-    int node_label = assignments_[node].label;
-    if (node == node_assigned) {
-      node_label = node_assignment;
-    }
-    const std::vector<int>& factors_of_a_node = query_->factors_of_a_node_[node];
-    for (size_t i = 0; i < factors_of_a_node.size(); ++i) {
-      uint64 hash = HashInt(node_label);
-      const Factor& factor = query_->factors_[factors_of_a_node[i]];
-      for (auto var = factor.begin();
-                var != factor.end(); ++var) {
-        if (*var != node) {
-          hash += HashInt(assignments_[*var].label);
+    CachedWeights<typename Policy::Weights> weights(fweights, GetWeightCache(node));
+    for (const GraphQuery::Arc& arc : query_->arcs_adjacent_to_node_[node]) {
+      // Only the label of the node changes between the candidates, the other end of the arc is fixed.
+      const bool node_is_a = arc.node_a == node;
+      const bool node_is_b = arc.node_b == node;
+      GraphFeature feature(labels_[arc.node_a], labels_[arc.node_b], arc.type);
+      for (size_t i = 0; i < num_candidates; ++i) {
+        if (node_is_a) feature.a_ = candidates[i];
+        if (node_is_b) feature.b_ = candidates[i];
+        candidate_scores[i] += weights.GetFeatureWeight(feature);
+      }
+    }
+
+    if (!Policy::with_factors) return;
+    for (int factor_id : query_->factors_of_a_node_[node]) {
+      // The factor hash is a sum, so the part coming from the other nodes is the same for all candidates.
+      uint64 other_nodes_hash = 0;
+      uint64 node_multiplicity = 0;
+      for (int var : query_->factor_variables_[factor_id]) {
+        if (var == node) {
+          ++node_multiplicity;
+        } else {
+          other_nodes_hash += HashInt(labels_[var]);
         }
       }
-      auto factor_feature = factor_features.find(hash);
-      if (factor_feature != factor_features.end()) {
-        sum += factor_feature->second;
+      for (size_t i = 0; i < num_candidates; ++i) {
+        candidate_scores[i] += weights.GetFactorWeight(other_nodes_hash + node_multiplicity * HashInt(candidates[i]));
       }
     }
-
-    return sum;
   }
 
+  // The assigned nodes are indexed by their position in the component of the node.
+  template <class Policy>
   double GetNodeScoreOnAssignedNodes(
       const GraphInference& fweights, int node,
       const std::vector<bool>& assigned) const {
-    double sum = -GetNodePenalty(node);
-    const GraphInference::FeaturesMap& features = fweights.features_;
+    double sum = Policy::with_penalty ? -GetNodePenalty(node) : 0.0;
+    CachedWeights<typename Policy::Weights> weights(fweights, GetWeightCache(node));
+    const std::vector<int>& index_in_component = query_->index_in_component_;
     for (const GraphQuery::Arc& arc : query_->arcs_adjacent_to_node_[node]) {
-      if (arc.node_a != node && !assigned[arc.node_a]) continue;
-      if (arc.node_b != node && !assigned[arc.node_b]) continue;
-      GraphFeature feature(
-          assignments_[arc.node_a].label,
-          assignments_[arc.node_b].label,
-          arc.type);
-      auto feature_it = features.find(feature);
-      if (feature_it != features.end()) {
-        sum += feature_it->second.getValue();
-      }
+      if (arc.node_a != node && !assigned[index_in_component[arc.node_a]]) continue;
+      if (arc.node_b != node && !assigned[index_in_component[arc.node_b]]) continue;
+      sum += weights.GetFeatureWeight(GraphFeature(
+          labels_[arc.node_a],
+          labels_[arc.node_b],
+          arc.type));
     }
     return sum;
   }
 
+  // Sets the label of a node. All label changes must go through this method, because it keeps
+  // the per-scope label usage (used for the duplicate name checks) up to date.
+  void SetLabel(int node, int label) {
+    int& node_label = labels_[node];
+    if (node_label == label) return;
+    for (int scope : query_->scopes_per_nodes_[node]) {
+      RemoveScopeLabelUsage(scope, node, node_label);
+      AddScopeLabelUsage(scope, node, label);
+    }
+    node_label = label;
+  }
+
   bool HasDuplicationConflictsAtNode(int node) const {
-    int node_label = assignments_[node].label;
-    if (node_label == unknown_label_) return false;
+    return HasDuplicationConflictsForLabel(node, labels_[node]);
+  }
+
+  // Returns whether there would be a duplication conflict if the node had the given label.
+  bool HasDuplicationConflictsForLabel(int node, int label) const {
+    if (label == unknown_label_) return false;
+    // The node itself is counted in the usage of its current label.
+    int own_usage = (labels_[node] == label) ? 1 : 0;
     const std::vector<int>& scopes = query_->scopes_per_nodes_[node];
     for (int scope : scopes) {
-      const std::vector<int>& nodes_per_scope = query_->nodes_in_scope_[scope];
-      for (int other_node : nodes_per_scope) {
-        if (other_node != node && assignments_[other_node].label == node_label)
-          return true;
-      }
+      if (GetScopeLabelUsage(scope, label).count > own_usage)
+        return true;
     }
     return false;
   }
@@ -514,39 +1152,44 @@ public:
   // Returns the node with a duplication conflict to the current node. Returns -1 if there is no such node or there are multiple such nodes.
   int GetNodeWithDuplicationConflict(int node) const {
     int conflict_node = -1;
-    int node_label = assignments_[node].label;
+    int node_label = labels_[node];
     const std::vector<int>& scopes = query_->scopes_per_nodes_[node];
     for (int scope : scopes) {
-      const std::vector<int>& nodes_per_scope = query_->nodes_in_scope_[scope];
-      for (int other_node : nodes_per_scope) {
-        if (other_node != node && assignments_[other_node].label == node_label) {
-          if (conflict_node == -1) {
-            conflict_node = other_node;  // We have found a conflict node.
-          } else {
-            if (conflict_node != other_node) return -1;  // There are multiple conflict nodes.
-          }
-        }
+      const ScopeLabelUsage& usage = GetScopeLabelUsage(scope, node_label);
+      if (usage.count <= 1) continue;
+      if (usage.count > 2) return -1;  // There are multiple conflict nodes.
+      int other_node = usage.nodes_xor ^ node;
+      if (conflict_node == -1) {
+        conflict_node = other_node;  // We have found a conflict node.
+      } else {
+        if (conflict_node != other_node) return -1;  // There are multiple conflict nodes.
       }
     }
     return conflict_node;
   }
 
   // Gets the score connecting a pair of nodes.
-  double GetNodePairScore(const GraphInference& fweights, int node1, int node2, int label1, int label2) const {
+  template <class Weights>
+  double GetNodePairScore(Weights* weights, int node1, int node2, int label1, int label2) const {
     double sum = 0;
-    const GraphInference::FeaturesMap& features = fweights.features_;
     for (const GraphQuery::Arc& arc : FindWithDefault(query_->arcs_connecting_node_pair_, IntPair(node1, node2), std::vector<GraphQuery::Arc>())) {
-      auto feature_it = features.find(
+      sum += weights->GetFeatureWeight(
           arc.node_a == node1 ?
               GraphFeature(label1, label2, arc.type) :
               GraphFeature(label2, label1, arc.type));
-      if (feature_it != features.end()) {
-        sum += feature_it->second.getValue();
-      }
     }
     return sum;
   }
 
+  // The scores of the node pairs connected by the arcs of the query, in the order of the arcs.
+  template <class Weights>
+  void GetArcNodePairScores(Weights* weights, std::vector<double>* scores) const {
+    scores->clear();
+    for (const GraphQuery::Arc& arc : query_->arcs_) {
+      scores->push_back(GetNodePairScore(weights, arc.node_a, arc.node_b, labels_[arc.node_a], labels_[arc.node_b]));
+    }
+  }
+
   int GetNumAdjacentArcs(int node) const {
     return query_->arcs_adjacent_to_node_[node].size();
   }
@@ -564,20 +1207,15 @@ public:
 
   void GetLabelCandidates(const GraphInference& fweights, int node,
       std::vector<int>* candidates, size_t beam_size) const {
-    std::vector<std::pair<double, int> > empty_vec;
     for (const GraphQuery::Arc& arc : query_->arcs_adjacent_to_node_[node]) {
       if (arc.node_a == node) {
-        const std::vector<std::pair<double, int> >& v =
-            FindWithDefault(fweights.best_features_for_b_type_,
-                IntPair(assignments_[arc.node_b].label, arc.type), empty_vec);
+        CandidateSpan<LabelCandidate> v = fweights.GetBestFeaturesForBType(labels_[arc.node_b], arc.type);
         for (size_t i = 0; i < v.size() && i < beam_size; ++i) {
           candidates->push_back(v[i].second);
         }
       }
       if (arc.node_b == node) {
-        const std::vector<std::pair<double, int> >& v =
-            FindWithDefault(fweights.best_features_for_a_type_,
-                IntPair(assignments_[arc.node_a].label, arc.type), empty_vec);
+        CandidateSpan<LabelCandidate> v = fweights.GetBestFeaturesForAType(labels_[arc.node_a], arc.type);
         for (size_t i = 0; i < v.size() && i < beam_size; ++i) {
           candidates->push_back(v[i].second);
         }
@@ -591,43 +1229,62 @@ public:
     candidates->erase(std::unique(candidates->begin(), candidates->end()), candidates->end());
   }
 
+  // Removes the candidate labels that are not valid for prediction.
+  void RemoveInvalidLabels(const GraphInference& fweights, std::vector<int>* candidates) const {
+    candidates->erase(std::remove_if(candidates->begin(), candidates->end(), [&fweights](int label) {
+      return !fweights.label_checker_.IsLabelValid(label);
+    }), candidates->end());
+  }
+
   void ReplaceLabelsWithUnknown(const GraphInference& fweights) {
-    for (size_t i = 0; i < assignments_.size(); ++i) {
-      if (fweights.label_frequency_.find(assignments_[i].label) == fweights.label_frequency_.end()) {
-        assignments_[i].label = unknown_label_;
+    for (size_t i = 0; i < labels_.size(); ++i) {
+      if (!fweights.IsKnownLabel(labels_[i])) {
+        SetLabel(i, unknown_label_);
       }
     }
   }
 
-  double GetTotalScore(const GraphInference& fweights) const {
+  template <class Weights>
+  double GetTotalScore(Weights* weights) const {
     double sum = 0;
-    const GraphInference::FeaturesMap& features = fweights.features_;
     for (const GraphQuery::Arc& arc : query_->arcs_) {
       GraphFeature feature(
-          assignments_[arc.node_a].label,
-          assignments_[arc.node_b].label,
+          labels_[arc.node_a],
+          labels_[arc.node_b],
           arc.type);
-      auto feature_it = features.find(feature);
-      if (feature_it != features.end()) {
-        sum += feature_it->second.getValue();
-      }
+      double weight = weights->GetFeatureWeight(feature);
+      sum += weight;
       VLOG(3) << " " << label_set_->GetLabelName(feature.a_) << " " << label_set_->GetLabelName(feature.b_) << " " << label_set_->GetLabelName(feature.type_)
-          << " " << ((feature_it != features.end()) ? feature_it->second.getValue() : 0.0);
+          << " " << weight;
     }
-    for (size_t i = 0; i < assignments_.size(); ++i) {
+    for (size_t i = 0; i < labels_.size(); ++i) {
       sum -= GetNodePenalty(i);
     }
     VLOG(3) << "=" << sum;
     return sum;
   }
 
+  // Same as GetTotalScore, restricted to one component.
+  template <class Weights>
+  double GetComponentScore(Weights* weights, const GraphQuery::Component& component) const {
+    double sum = 0;
+    for (int arc_index : component.arcs) {
+      const GraphQuery::Arc& arc = query_->arcs_[arc_index];
+      sum += weights->GetFeatureWeight(GraphFeature(labels_[arc.node_a], labels_[arc.node_b], arc.type));
+    }
+    for (int node : component.nodes) {
+      sum -= GetNodePenalty(node);
+    }
+    return sum;
+  }
+
   void GetAffectedFeatures(
       GraphInference::SimpleFeaturesMap* affected_features,
       double gradient_weight) const {
     for (const GraphQuery::Arc& arc : query_->arcs_) {
       GraphFeature feature(
-          assignments_[arc.node_a].label,
-          assignments_[arc.node_b].label,
+          labels_[arc.node_a],
+          labels_[arc.node_b],
           arc.type);
       (*affected_features)[feature] += gradient_weight;
     }
@@ -639,7 +1296,7 @@ public:
     for (const Factor& factor : query_->factors_) {
       uint64 hash = 0;
       for (auto var = factor.begin(); var != factor.end(); ++var) {
-        hash += HashInt(assignments_[*var].label);
+        hash += HashInt(labels_[*var]);
       }
       (*affected_factor_features)[hash] += gradient_weight;
     }
@@ -653,8 +1310,8 @@ public:
       int label,
       double gradient_weight) const {
     for (const auto & arc : query_->arcs_adjacent_to_node_[node]) {
-      int label_node_a = assignments_[arc.node_a].label;
-      int label_node_b = assignments_[arc.node_b].label;
+      int label_node_a = labels_[arc.node_a];
+      int label_node_b = labels_[arc.node_b];
       if (arc.node_a == node) {
         label_node_a = label;
       }
@@ -681,24 +1338,28 @@ public:
       const Factor& f = query_->factors_[factors_of_a_node[i]];
       for (auto var = f.begin(); var != f.end(); ++var) {
         if (*var != node) {
-          hash += HashInt(assignments_[(*var)].label);
+          hash += HashInt(labels_[(*var)]);
         }
       }
       (*factor_affected_features)[hash] += gradient_weight;
     }
   }
 
-  void InitialGreedyAssignmentPass(const GraphInference& fweights) {
-    std::vector<bool> assigned(assignments_.size(), false);
-    for (size_t node = 0; node < assignments_.size(); ++node) {
-      assigned[node] = !assignments_[node].must_infer;
+  // The passes below optimize the labels of one component of the query.
+  template <class Policy>
+  void InitialGreedyAssignmentPass(const GraphInference& fweights, const GraphQuery::Component& component) {
+    // Indexed by the position of the node in the component.
+    std::vector<bool> assigned(component.nodes.size(), false);
+    for (size_t i = 0; i < component.nodes.size(); ++i) {
+      assigned[i] = !must_infer_[component.nodes[i]];
     }
+    const std::vector<int>& index_in_component = query_->index_in_component_;
     UpdatablePriorityQueue<int, int> p_queue;
-    for (size_t node = 0; node < assignments_.size(); ++node) {
-      if (assignments_[node].must_infer) {
+    for (int node : component.nodes) {
+      if (must_infer_[node]) {
         int score = 0;
         for (const GraphQuery::Arc& arc : query_->arcs_adjacent_to_node_[node]) {
-          if (assigned[arc.node_a] || assigned[arc.node_b]) ++score;
+          if (assigned[index_in_component[arc.node_a]] || assigned[index_in_component[arc.node_b]]) ++score;
         }
         p_queue.SetValue(node, -score);
       }
@@ -716,140 +1377,142 @@ public:
         }
       }
 
-      GraphNodeAssignment::Assignment& nodea = assignments_[node];
-      if (!nodea.must_infer) continue;
+      if (!must_infer_[node]) continue;
       candidates.clear();
       GetLabelCandidates(fweights, node, &candidates, kInitialAssignmentBeamSize);
       if (candidates.empty()) continue;
-      double best_score = GetNodeScoreOnAssignedNodes(fweights, node, assigned);
-      int best_label = nodea.label;
+      double best_score = GetNodeScoreOnAssignedNodes<Policy>(fweights, node, assigned);
+      int best_label = labels_[node];
       for (size_t i = 0; i < candidates.size(); ++i) {
-        nodea.label = candidates[i];
-        if (!fweights.label_checker_.IsLabelValid(assignments_[node].label)) continue;
-        if (HasDuplicationConflictsAtNode(node)) continue;
-        double score = GetNodeScoreOnAssignedNodes(fweights, node, assigned);
+        if (!fweights.label_checker_.IsLabelValid(candidates[i])) continue;
+        if (HasDuplicationConflictsForLabel(node, candidates[i])) continue;
+        SetLabel(node, candidates[i]);
+        double score = GetNodeScoreOnAssignedNodes<Policy>(fweights, node, assigned);
         if (score > best_score) {
-          best_label = nodea.label;
+          best_label = labels_[node];
           best_score = score;
         }
       }
-      nodea.label = best_label;
-      assigned[node] = true;
+      SetLabel(node, best_label);
+      assigned[index_in_component[node]] = true;
     }
 
   }
 
-  void LocalPerNodeOptimizationPass(const GraphInference& fweights, size_t beam_size) {
+  template <class Policy>
+  void LocalPerNodeOptimizationPass(
+      const GraphInference& fweights, const GraphQuery::Component& component, size_t beam_size) {
     std::vector<int> candidates;
-    for (size_t node = 0; node < assignments_.size(); ++node) {
-      GraphNodeAssignment::Assignment& nodea = assignments_[node];
-      if (!nodea.must_infer) continue;
+    std::vector<double> scores;
+    for (int node : component.nodes) {
+      if (!must_infer_[node]) continue;
       candidates.clear();
       GetLabelCandidates(fweights, node, &candidates, beam_size);
+      RemoveInvalidLabels(fweights, &candidates);
       if (candidates.empty()) continue;
-      double best_score = GetNodeScore(fweights, node);
-      int best_label = nodea.label;
+      double best_score = GetNodeScore<Policy>(fweights, node);
+      int best_label = labels_[node];
 #ifdef GRAPH_INFERENCE_STATS
       int best_position = -1;
 #endif
+      GetNodeScoresForCandidates<Policy>(fweights, node, candidates, &scores);
       for (size_t i = 0; i < candidates.size(); ++i) {
-        nodea.label = candidates[i];
-        if (!fweights.label_checker_.IsLabelValid(assignments_[node].label)) continue;
-        if (HasDuplicationConflictsAtNode(node)) continue;
-        double score = GetNodeScore(fweights, node);
-        if (score > best_score) {
-          best_label = nodea.label;
-          best_score = score;
+        if (scores[i] <= best_score) continue;
+        if (HasDuplicationConflictsForLabel(node, candidates[i])) continue;
+        best_label = candidates[i];
+        best_score = scores[i];
 #ifdef GRAPH_INFERENCE_STATS
-          best_position = i;
+        best_position = i;
 #endif
-        }
       }
 #ifdef GRAPH_INFERENCE_STATS
       stats_.position_of_best_per_node_label.AddCount(best_position + 1, 1);
 #endif
-      nodea.label = best_label;
+      SetLabel(node, best_label);
     }
   }
 
-  void LocalPerNodeOptimizationPassWithDuplicateNameResolution(const GraphInference& fweights, size_t beam_size) {
+  template <class Policy>
+  void LocalPerNodeOptimizationPassWithDuplicateNameResolution(
+      const GraphInference& fweights, const GraphQuery::Component& component, size_t beam_size) {
     std::vector<int> candidates;
-    for (size_t node = 0; node < assignments_.size(); ++node) {
-      GraphNodeAssignment::Assignment& nodea = assignments_[node];
-      if (!nodea.must_infer) continue;
+    std::vector<double> scores;
+    for (int node : component.nodes) {
+      if (!must_infer_[node]) continue;
       candidates.clear();
       GetLabelCandidates(fweights, node, &candidates, beam_size);
+      RemoveInvalidLabels(fweights, &candidates);
       if (candidates.empty()) continue;
-      double best_score = GetNodeScore(fweights, node);
-      int initial_label = nodea.label;
+      double best_score = GetNodeScore<Policy>(fweights, node);
+      int initial_label = labels_[node];
       int best_label = initial_label;
       int best_node2 = -1;
+      GetNodeScoresForCandidates<Policy>(fweights, node, candidates, &scores);
       for (size_t i = 0; i < candidates.size(); ++i) {
-        nodea.label = candidates[i];
-        if (!fweights.label_checker_.IsLabelValid(assignments_[node].label)) continue;
-        if (HasDuplicationConflictsAtNode(node)) {
+        if (HasDuplicationConflictsForLabel(node, candidates[i])) {
+          SetLabel(node, candidates[i]);
           int node2 = GetNodeWithDuplicationConflict(node);
-          if (node2 == -1 || assignments_[node2].must_infer == false) continue;
-          assignments_[node2].label = initial_label;  // Set label to node2.
-          double score = GetNodeScore(fweights, node) + GetNodeScore(fweights, node2);
+          if (node2 == -1 || must_infer_[node2] == false) continue;
+          SetLabel(node2, initial_label);  // Set label to node2.
+          double score = GetNodeScore<Policy>(fweights, node) + GetNodeScore<Policy>(fweights, node2);
           bool correct = !HasDuplicationConflictsAtNode(node2) && !HasDuplicationConflictsAtNode(node);
-          assignments_[node2].label = candidates[i];  // Revert label of node2.
+          SetLabel(node2, candidates[i]);  // Revert label of node2.
           if (correct) {
-            score -= GetNodeScore(fweights, node2);  // The score on node2 is essentially the gain of the score on node2.
+            score -= GetNodeScore<Policy>(fweights, node2);  // The score on node2 is essentially the gain of the score on node2.
             if (score > best_score) {
-              best_label = nodea.label;
+              best_label = labels_[node];
               best_score = score;
               best_node2 = node2;
             }
           }
         } else {
-          double score = GetNodeScore(fweights, node);
-          if (score > best_score) {
-            best_label = nodea.label;
-            best_score = score;
+          if (scores[i] > best_score) {
+            best_label = candidates[i];
+            best_score = scores[i];
             best_node2 = -1;
           }
         }
       }
-      nodea.label = best_label;
+      SetLabel(node, best_label);
       if (best_node2 != -1)
-        assignments_[best_node2].label = initial_label;
+        SetLabel(best_node2, initial_label);
     }
   }
 
-  void LocalPerArcOptimizationPass(const GraphInference& fweights, size_t beam_size) {
-    std::vector<std::pair<double, GraphFeature> > empty;
-    for (const GraphQuery::Arc& arc : query_->arcs_) {
+  template <class Policy>
+  void LocalPerArcOptimizationPass(
+      const GraphInference& fweights, const GraphQuery::Component& component, size_t beam_size) {
+    for (int arc_index : component.arcs) {
+      const GraphQuery::Arc& arc = query_->arcs_[arc_index];
       if (arc.node_a == arc.node_b) continue;
-      if (assignments_[arc.node_a].must_infer == false || assignments_[arc.node_b].must_infer == false) continue;
+      if (must_infer_[arc.node_a] == false || must_infer_[arc.node_b] == false) continue;
       if (static_cast<int>(query_->arcs_adjacent_to_node_[arc.node_a].size()) >
               FLAGS_skip_per_arc_optimization_for_nodes_above_degree) continue;
       if (static_cast<int>(query_->arcs_adjacent_to_node_[arc.node_b].size()) >
               FLAGS_skip_per_arc_optimization_for_nodes_above_degree) continue;
 
       // Get candidate labels for labels of node_a and node_b.
-      const std::vector<std::pair<double, GraphFeature> >& candidates =
-          FindWithDefault(fweights.best_features_for_type_, arc.type, empty);
+      CandidateSpan<FeatureCandidate> candidates = fweights.GetBestFeaturesForType(arc.type);
       if (candidates.empty()) continue;
 
       // Iterate over all candidate labels to see if some of them improves the score over the current labels.
-      int best_a = assignments_[arc.node_a].label;
-      int best_b = assignments_[arc.node_b].label;
-      double best_score = GetNodeScore(fweights, arc.node_a) + GetNodeScore(fweights, arc.node_b);
+      int best_a = labels_[arc.node_a];
+      int best_b = labels_[arc.node_b];
+      double best_score = GetNodeScore<Policy>(fweights, arc.node_a) + GetNodeScore<Policy>(fweights, arc.node_b);
 #ifdef GRAPH_INFERENCE_STATS
       int best_position = -1;
 #endif
       for (size_t i = 0; i < candidates.size() && i < beam_size; ++i) {
-        assignments_[arc.node_a].label = candidates[i].second.a_;
-        assignments_[arc.node_b].label = candidates[i].second.b_;
+        if (!fweights.label_checker_.IsLabelValid(candidates[i].second.a_)) continue;
+        if (!fweights.label_checker_.IsLabelValid(candidates[i].second.b_)) continue;
+        SetLabel(arc.node_a, candidates[i].second.a_);
+        SetLabel(arc.node_b, candidates[i].second.b_);
         if (HasDuplicationConflictsAtNode(arc.node_a) ||
             HasDuplicationConflictsAtNode(arc.node_b)) continue;
-        if (!fweights.label_checker_.IsLabelValid(assignments_[arc.node_a].label)) continue;
-        if (!fweights.label_checker_.IsLabelValid(assignments_[arc.node_b].label)) continue;
-        double score = GetNodeScore(fweights, arc.node_a) + GetNodeScore(fweights, arc.node_b);
+        double score = GetNodeScore<Policy>(fweights, arc.node_a) + GetNodeScore<Policy>(fweights, arc.node_b);
         if (score > best_score) {
-          best_a = assignments_[arc.node_a].label;
-          best_b = assignments_[arc.node_b].label;
+          best_a = labels_[arc.node_a];
+          best_b = labels_[arc.node_b];
           best_score = score;
 #ifdef GRAPH_INFERENCE_STATS
           best_position = i;
@@ -859,25 +1522,27 @@ public:
 #ifdef GRAPH_INFERENCE_STATS
       stats_.position_of_best_per_arc_label.AddCount(best_position + 1, 1);
 #endif
-      assignments_[arc.node_a].label = best_a;
-      assignments_[arc.node_b].label = best_b;
+      SetLabel(arc.node_a, best_a);
+      SetLabel(arc.node_b, best_b);
     }
   }
 
   // Perform optimization based on factor features
-  void LocalPerFactorOptimizationPass(const GraphInference& fweights, size_t beam_size) {
+  template <class Policy>
+  void LocalPerFactorOptimizationPass(
+      const GraphInference& fweights, const GraphQuery::Component& component, size_t beam_size) {
     std::vector<std::pair<double, Factor>> empty;
-    for (const Factor& factor : query_->factors_) {
+    for (int factor_index : component.factors) {
+      const Factor& factor = query_->factors_[factor_index];
       std::vector<int> inf_nodes;
       inf_nodes.reserve(factor.size());
       Factor giv_labels;
       // Separates between given and to be inferred.
       for (auto var = factor.begin(); var != factor.end(); ++var) {
-        Assignment a = assignments_[(*var)];
-        if (a.must_infer == true) {
+        if (must_infer_[*var]) {
           inf_nodes.push_back((*var));
         } else {
-          giv_labels.insert(a.label);
+          giv_labels.insert(labels_[*var]);
         }
       }
 
@@ -888,8 +1553,8 @@ public:
       // Initialize the best score and best assignments with the current assignments on the to be inferred nodes
       // of the factor.
       for (size_t j = 0; j < inf_nodes.size(); ++j) {
-        best_score += GetNodeScore(fweights, inf_nodes[j]);
-        best_assignments[j] = assignments_[inf_nodes[j]].label;
+        best_score += GetNodeScore<Policy>(fweights, inf_nodes[j]);
+        best_assignments[j] = labels_[inf_nodes[j]];
       }
       std::vector<Factor> factors_candidates;
       // Determines which of the factors match the given labels.
@@ -938,32 +1603,33 @@ public:
         size_t current_num_permutations = 0;
         if (num_permutations < 0 || num_permutations > FLAGS_permutations_beam_size) {
           while (current_num_permutations < FLAGS_permutations_beam_size) {
-            PerformPermutationOptimization(inf_nodes, fweights, candidate_inf_labels, &best_assignments, &best_score);
+            PerformPermutationOptimization<Policy>(inf_nodes, fweights, candidate_inf_labels, &best_assignments, &best_score);
             std::random_shuffle(candidate_inf_labels.begin(), candidate_inf_labels.end());
             current_num_permutations++;
           }
         } else {
           std::sort(candidate_inf_labels.begin(), candidate_inf_labels.end());
           do {
-            PerformPermutationOptimization(inf_nodes, fweights, candidate_inf_labels, &best_assignments, &best_score);
+            PerformPermutationOptimization<Policy>(inf_nodes, fweights, candidate_inf_labels, &best_assignments, &best_score);
             current_num_permutations++;
           } while(std::next_permutation(candidate_inf_labels.begin(), candidate_inf_labels.end()) &&
                   current_num_permutations < FLAGS_permutations_beam_size);
         }
       }
       for (size_t j = 0; j < inf_nodes.size(); ++j) {
-        assignments_[inf_nodes[j]].label = best_assignments[j];
+        SetLabel(inf_nodes[j], best_assignments[j]);
       }
     }
   }
 
+  template <class Policy>
   void PerformPermutationOptimization(const std::vector<int>& inf_nodes,
                                       const GraphInference& fweights,
                                       const std::vector<int>& candidate_inf_labels,
                                       std::vector<int>* best_assignments,
                                       double* best_score) {
     for (size_t z = 0; z < inf_nodes.size(); ++z) {
-      assignments_[inf_nodes[z]].label = candidate_inf_labels[z];
+      SetLabel(inf_nodes[z], candidate_inf_labels[z]);
     }
     for (size_t z = 0; z < inf_nodes.size(); ++z) {
       if (HasDuplicationConflictsAtNode(inf_nodes[z])) {
@@ -972,53 +1638,134 @@ public:
     }
     double score = 0;
     for (size_t z = 0; z < inf_nodes.size(); ++z) {
-      score += GetNodeScore(fweights, inf_nodes[z]);
+      score += GetNodeScore<Policy>(fweights, inf_nodes[z]);
     }
     if (score > *best_score) {
       for (size_t z = 0; z < inf_nodes.size(); ++z) {
-        (*best_assignments)[z] = assignments_[inf_nodes[z]].label;
+        (*best_assignments)[z] = labels_[inf_nodes[z]];
       }
       *best_score = score;
     }
   }
 
 private:
-  struct Assignment {
-    Assignment() : must_infer(false), label(-1) {}
-    bool must_infer;
-    int label;
+  // The assignment is kept as a structure of arrays: a label per node and a bit per node whether
+  // the label must be inferred (or is given).
+  std::vector<int> labels_;
+  std::vector<bool> must_infer_;
+
+  // Used in Max-Margin training only. If non-empty, keeping the label penalty_labels_[node] at a node
+  // costs penalty_. Nodes with given labels have no penalty.
+  std::vector<int> penalty_labels_;
+  double penalty_;
+
+  // How many nodes of an inequality scope have a given label. Only the XOR of the node indices is kept,
+  // which is enough to recover the other node when exactly two nodes of a scope share a label.
+  struct ScopeLabelUsage {
+    ScopeLabelUsage() : count(0), nodes_xor(0) {}
+    int count;
+    int nodes_xor;
   };
 
-  std::vector<Assignment> assignments_;
+  // Keyed by (scope, label). There is a separate map for each component with scopes, so that components
+  // can be optimized in parallel.
+  typedef google::dense_hash_map<IntPair, ScopeLabelUsage> ScopeLabelUsageMap;
+  std::vector<ScopeLabelUsageMap> scope_label_usage_;
 
-  struct LabelPenalty {
-    LabelPenalty() : label(-2), penalty(0) {}
-    int label;
-    double penalty;
-  };
+  const ScopeLabelUsage& GetScopeLabelUsage(int scope, int label) const {
+    static const ScopeLabelUsage empty_usage;
+    return FindWithDefault(scope_label_usage_[query_->component_of_scope_[scope]], IntPair(scope, label), empty_usage);
+  }
 
-  std::vector<LabelPenalty> penalties_;
+  void AddScopeLabelUsage(int scope, int node, int label) {
+    ScopeLabelUsage& usage = scope_label_usage_[query_->component_of_scope_[scope]][IntPair(scope, label)];
+    ++usage.count;
+    usage.nodes_xor ^= node;
+  }
 
-  const GraphQuery* query_;
-  LabelSet* label_set_;
-  int unknown_label_;
+  void RemoveScopeLabelUsage(int scope, int node, int label) {
+    // Entries with zero count are kept, the same labels are typically tried again at the node.
+    ScopeLabelUsage& usage = scope_label_usage_[query_->component_of_scope_[scope]].find(IntPair(scope, label))->second;
+    --usage.count;
+    usage.nodes_xor ^= node;
+  }
+
+  void RebuildScopeLabelUsage() {
+    scope_label_usage_.clear();
+    scope_label_usage_.resize(query_->num_components_with_scopes_);
+    for (ScopeLabelUsageMap& usage : scope_label_usage_) {
+      usage.set_empty_key(IntPair(-1, -1));
+      usage.set_deleted_key(IntPair(-2, -2));
+    }
+    for (size_t scope = 0; scope < query_->nodes_in_scope_.size(); ++scope) {
+      for (int node : query_->nodes_in_scope_[scope]) {
+        AddScopeLabelUsage(scope, node, labels_[node]);
+      }
+    }
+  }
+
+  // One table per component while the assignment is optimized with FLAGS_query_local_weights, empty
+  // otherwise. A component is optimized by one thread at a time.
+  QueryWeightCache* GetWeightCache(int node) const {
+    return weight_caches_.empty() ? NULL : &weight_caches_[query_->component_of_node_[node]];
+  }
+
+  const GraphQuery* query_;
+  LabelSet* label_set_;
+  int unknown_label_;
+  mutable std::vector<QueryWeightCache> weight_caches_;
 
 #ifdef GRAPH_INFERENCE_STATS
   mutable GraphInferenceStats stats_;
 #endif
 
   friend class GraphInference;
-  friend class LoopyBPInference;
+  template <class Policy> friend class LoopyBPInference;
+  template <class Policy> friend class TreeInference;
 };
 
+template <bool kWithPenalty, class Weights, class Functor>
+static void DispatchScoringPolicyWithFactors(const GraphNodeAssignment& a, const Functor& functor) {
+  if (a.HasFactors()) {
+    functor(ScoringPolicy<kWithPenalty, true, Weights>());
+  } else {
+    functor(ScoringPolicy<kWithPenalty, false, Weights>());
+  }
+}
+
+template <class Functor>
+static void DispatchScoringPolicy(const GraphInference& model, const GraphNodeAssignment& a, const Functor& functor) {
+  if (a.HasPenalty()) {
+    CHECK(!model.IsFrozen()) << "A frozen model is for inference only.";
+    DispatchScoringPolicyWithFactors<true, FullPrecisionWeights>(a, functor);
+    return;
+  }
+  switch (model.GetQuantizedWeightBits()) {
+  case 8:
+    DispatchScoringPolicyWithFactors<false, QuantizedWeightsReader<uint8_t> >(a, functor);
+    return;
+  case 16:
+    DispatchScoringPolicyWithFactors<false, QuantizedWeightsReader<uint16_t> >(a, functor);
+    return;
+  }
+  if (model.IsFrozen()) {
+    DispatchScoringPolicyWithFactors<false, FrozenWeightsReader>(a, functor);
+  } else {
+    DispatchScoringPolicyWithFactors<false, FullPrecisionWeights>(a, functor);
+  }
+}
+
 
+template <class Policy>
 class LoopyBPInference {
 public:
-  LoopyBPInference(const GraphNodeAssignment& a, const GraphInference& fweights)
-      : a_(a), fweights_(fweights) {
+  // Runs on the nodes of one component of the query.
+  LoopyBPInference(const GraphNodeAssignment& a, const GraphInference& fweights, const GraphQuery::Component& component)
+      : a_(a), fweights_(fweights), weights_(fweights, a.GetWeightCache(component.nodes[0])), component_(component),
+        index_in_component_(a.query_->index_in_component_) {
     node_label_to_score_.set_empty_key(IntPair(-1, -1));
     node_label_to_score_.set_deleted_key(IntPair(-2, -2));
-    labels_at_node_.assign(a.assignments_.size(), std::vector<int>());
+    labels_at_node_.assign(component.nodes.size(), std::vector<int>());
   }
 
   void Run(GraphNodeAssignment* a) {
@@ -1031,7 +1778,7 @@ public:
 
   void TraceBack(GraphNodeAssignment* a) {
     std::vector< std::pair<double, IntPair> > scores;
-    std::vector<bool> node_visited(a_.assignments_.size(), false);
+    std::vector<bool> node_visited(component_.nodes.size(), false);
     scores.reserve(node_label_to_score_.size());
     for (auto it = node_label_to_score_.begin(); it != node_label_to_score_.end(); ++it) {
       scores.push_back(std::pair<double, IntPair>(it->second.total_score, it->first));
@@ -1043,10 +1790,10 @@ public:
       while (!traversal_queue.empty()) {
         IntPair node_label = traversal_queue.front();
         traversal_queue.pop();
-        if (node_visited[node_label.first]) continue;
-        node_visited[node_label.first] = true;
-        if (a->assignments_[node_label.first].must_infer) {
-          a->assignments_[node_label.first].label = node_label.second;
+        if (node_visited[index_in_component_[node_label.first]]) continue;
+        node_visited[index_in_component_[node_label.first]] = true;
+        if (a->must_infer_[node_label.first]) {
+          a->SetLabel(node_label.first, node_label.second);
         }
         const BPScore& s = FindWithDefault(node_label_to_score_, node_label, empty_bp_score_);
         for (auto it = s.incoming_node_to_message.begin(); it != s.incoming_node_to_message.end(); ++it) {
@@ -1058,17 +1805,17 @@ public:
     }
   }
 
-  std::string DebugString() const {
+  std::string DebugString() {
     std::string result;
-    for (size_t node = 0; node < a_.assignments_.size(); ++node) {
-      if (!a_.assignments_[node].must_infer) continue;
-      StringAppendF(&result, "\nNode %d:\n", static_cast<int>(node));
-      for (int label : labels_at_node_[node]) {
+    for (int node : component_.nodes) {
+      if (!a_.must_infer_[node]) continue;
+      StringAppendF(&result, "\nNode %d:\n", node);
+      for (int label : labels_at_node_[index_in_component_[node]]) {
         const BPScore& score = FindWithDefault(node_label_to_score_, IntPair(node, label), empty_bp_score_);
         StringAppendF(&result, "  Label %s  -- %f:\n", a_.label_set_->GetLabelName(label), score.total_score);
         for (auto it = score.incoming_node_to_message.begin(); it != score.incoming_node_to_message.end(); ++it) {
           StringAppendF(&result, "    From %d: %s -- %f [ arc %f ]\n", it->first, a_.label_set_->GetLabelName(it->second.label), it->second.score,
-               a_.GetNodePairScore(fweights_, it->first, node, it->second.label, label));
+               a_.GetNodePairScore(&weights_, it->first, node, it->second.label, label));
         }
       }
     }
@@ -1092,22 +1839,25 @@ private:
 
   const GraphNodeAssignment& a_;
   const GraphInference& fweights_;
+  CachedWeights<typename Policy::Weights> weights_;
+  const GraphQuery::Component& component_;
+  const std::vector<int>& index_in_component_;
 
   google::dense_hash_map<IntPair, BPScore> node_label_to_score_;
-  std::vector<std::vector<int> > labels_at_node_;
+  std::vector<std::vector<int> > labels_at_node_;  // Indexed by the position of the node in the component.
 
   IncomingMessage GetBestMessageFromNode(int from_node, int to_node, int to_label) {
-    if (!a_.assignments_[from_node].must_infer) {
-      int from_label = a_.assignments_[from_node].label;
-      return IncomingMessage(from_label, a_.GetNodePairScore(fweights_, from_node, to_node, from_label, to_label));
+    if (!a_.must_infer_[from_node]) {
+      int from_label = a_.labels_[from_node];
+      return IncomingMessage(from_label, a_.GetNodePairScore(&weights_, from_node, to_node, from_label, to_label));
     }
     double best_score = 0.0;
     int best_label = -1;
-    for (int from_label : labels_at_node_[from_node]) {
+    for (int from_label : labels_at_node_[index_in_component_[from_node]]) {
       auto it = node_label_to_score_.find(IntPair(from_node, from_label));
       if (it == node_label_to_score_.end()) continue;
       double node_score = it->second.total_score - it->second.incoming_node_to_message[to_node].score;
-      double current_score = node_score + a_.GetNodePairScore(fweights_, from_node, to_node, from_label, to_label);
+      double current_score = node_score + a_.GetNodePairScore(&weights_, from_node, to_node, from_label, to_label);
       if (current_score > best_score) {
         best_score = current_score;
         best_label = from_label;
@@ -1117,8 +1867,8 @@ private:
   }
 
   void PullMessagesFromAdjacentNodes() {
-    for (int node = 0; node < static_cast<int>(a_.assignments_.size()); ++node) {
-      for (int label : labels_at_node_[node]) {
+    for (int node : component_.nodes) {
+      for (int label : labels_at_node_[index_in_component_[node]]) {
       //for (auto it = node_label_to_score_.begin(); it != node_label_to_score_.end(); ++it) {
         auto it = node_label_to_score_.find(IntPair(node, label));
         if (it == node_label_to_score_.end()) continue;
@@ -1138,21 +1888,18 @@ private:
   }
 
   void PutPossibleLabelsAtAdjacentNodes(int node, int label, size_t beam_size) {
-    std::vector<std::pair<double, int> > empty_vec;
     for (const GraphQuery::Arc& arc : a_.query_->arcs_adjacent_to_node_[node]) {
       if (arc.node_a == node) {
-        if (a_.assignments_[arc.node_b].must_infer) {
-          const std::vector<std::pair<double, int> >& v =
-              FindWithDefault(fweights_.best_features_for_a_type_, IntPair(label, arc.type), empty_vec);
+        if (a_.must_infer_[arc.node_b]) {
+          CandidateSpan<LabelCandidate> v = fweights_.GetBestFeaturesForAType(label, arc.type);
           for (size_t i = 0; i < v.size() && i < beam_size; ++i) {
             PutPossibleLabelAtNode(arc.node_b, v[i].second);
           }
         }
       }
       if (arc.node_b == node) {
-        if (a_.assignments_[arc.node_a].must_infer) {
-          const std::vector<std::pair<double, int> >& v =
-              FindWithDefault(fweights_.best_features_for_b_type_, IntPair(label, arc.type), empty_vec);
+        if (a_.must_infer_[arc.node_a]) {
+          CandidateSpan<LabelCandidate> v = fweights_.GetBestFeaturesForBType(label, arc.type);
           for (size_t i = 0; i < v.size() && i < beam_size; ++i) {
             PutPossibleLabelAtNode(arc.node_a, v[i].second);
           }
@@ -1164,10 +1911,8 @@ private:
   void PutPossibleLabelAtNode(int node, int label) {
     auto ins = node_label_to_score_.insert(std::pair<IntPair, BPScore>(IntPair(node, label), empty_bp_score_));
     if (ins.second) {
-      labels_at_node_[node].push_back(label);
-      if (label == a_.penalties_[node].label) {
-        ins.first->second.total_score = -a_.penalties_[node].penalty;
-      }
+      labels_at_node_[index_in_component_[node]].push_back(label);
+      ins.first->second.total_score = Policy::with_penalty ? -a_.GetNodePenaltyForLabel(node, label) : 0.0;
       for (const GraphQuery::Arc& arc : a_.query_->arcs_adjacent_to_node_[node]) {
         if (arc.node_a == node) {
           ins.first->second.incoming_node_to_message[arc.node_b] = IncomingMessage();
@@ -1180,10 +1925,210 @@ private:
   }
 
   void InitPossibleLabels() {
-    for (size_t i = 0; i < labels_at_node_.size(); ++i) {
-      if (a_.assignments_[i].must_infer) {
-        PutPossibleLabelAtNode(i, a_.assignments_[i].label);
-        PutPossibleLabelsAtAdjacentNodes(i, a_.assignments_[i].label, kLoopyBPBeamSize);
+    for (int node : component_.nodes) {
+      if (a_.must_infer_[node]) {
+        PutPossibleLabelAtNode(node, a_.labels_[node]);
+        PutPossibleLabelsAtAdjacentNodes(node, a_.labels_[node], kLoopyBPBeamSize);
+      }
+    }
+  }
+};
+
+// Exact max-sum dynamic programming for the components in which the nodes to infer form a forest. Arcs to
+// nodes with given labels only contribute to the score of a single node, so such components are trees even
+// if they have many given nodes. The labels of a node are restricted to a beam of candidates and the result
+// is optimal over these candidates. Factors and scopes are not part of the dynamic program: it is only used
+// on components without factors, and its result is rejected if two nodes in a scope get the same label.
+template <class Policy>
+class TreeInference {
+public:
+  TreeInference(const GraphNodeAssignment& a, const GraphInference& fweights, const GraphQuery::Component& component)
+      : a_(a), fweights_(fweights), weights_(fweights, a.GetWeightCache(component.nodes[0])), component_(component),
+        index_in_component_(a.query_->index_in_component_) {
+  }
+
+  // Returns false and leaves the assignment unchanged if the component is not a tree or its best labeling
+  // violates a scope.
+  bool Run(GraphNodeAssignment* a) {
+    if (!ComputeTraversalOrder()) return false;
+    ComputeCandidateLabels();
+    ComputeMessages();
+
+    std::vector<int> old_labels;
+    old_labels.reserve(order_.size());
+    for (int node : order_) {
+      old_labels.push_back(a->labels_[node]);
+    }
+    // Choose the best label at the roots and follow the best labels of the children down the trees.
+    std::vector<int> chosen(component_.nodes.size(), -1);
+    for (int node : order_) {
+      int index = index_in_component_[node];
+      int parent = parent_[index];
+      if (parent == -1) {
+        const std::vector<double>& scores = subtree_score_[index];
+        chosen[index] = std::max_element(scores.begin(), scores.end()) - scores.begin();
+      } else {
+        chosen[index] = best_label_for_parent_label_[index][chosen[index_in_component_[parent]]];
+      }
+      a->SetLabel(node, labels_[index][chosen[index]]);
+    }
+    for (int node : order_) {
+      if (a->HasDuplicationConflictsAtNode(node)) {
+        for (size_t i = 0; i < order_.size(); ++i) {
+          a->SetLabel(order_[i], old_labels[i]);
+        }
+        return false;
+      }
+    }
+    return true;
+  }
+
+private:
+  const GraphNodeAssignment& a_;
+  const GraphInference& fweights_;
+  CachedWeights<typename Policy::Weights> weights_;
+  const GraphQuery::Component& component_;
+  const std::vector<int>& index_in_component_;
+
+  // The nodes to infer, each tree in breadth-first order from its root. The vectors below are indexed by the
+  // position of the node in the component.
+  std::vector<int> order_;
+  std::vector<int> parent_;  // -1 for the roots.
+  std::vector<std::vector<int> > labels_;  // Candidate labels.
+  std::vector<std::vector<double> > subtree_score_;  // Best score of the subtree for each candidate label.
+  std::vector<std::vector<int> > best_label_for_parent_label_;
+
+  int OtherNode(const GraphQuery::Arc& arc, int node) const {
+    return arc.node_a == node ? arc.node_b : arc.node_a;
+  }
+
+  double GetFeatureWeight(int label_a, int label_b, int type) {
+    return weights_.GetFeatureWeight(GraphFeature(label_a, label_b, type));
+  }
+
+  bool ComputeTraversalOrder() {
+    parent_.assign(component_.nodes.size(), -1);
+    std::vector<bool> visited(component_.nodes.size(), false);
+    std::vector<int> neighbors;
+    for (int root : component_.nodes) {
+      if (!a_.must_infer_[root] || visited[index_in_component_[root]]) continue;
+      visited[index_in_component_[root]] = true;
+      size_t next = order_.size();
+      order_.push_back(root);
+      while (next < order_.size()) {
+        int node = order_[next++];
+        neighbors.clear();
+        for (const GraphQuery::Arc& arc : a_.query_->arcs_adjacent_to_node_[node]) {
+          int other = OtherNode(arc, node);
+          if (other != node && a_.must_infer_[other]) neighbors.push_back(other);
+        }
+        std::sort(neighbors.begin(), neighbors.end());
+        neighbors.erase(std::unique(neighbors.begin(), neighbors.end()), neighbors.end());
+        for (int other : neighbors) {
+          if (other == parent_[index_in_component_[node]]) continue;
+          if (visited[index_in_component_[other]]) return false;  // A cycle.
+          visited[index_in_component_[other]] = true;
+          parent_[index_in_component_[other]] = node;
+          order_.push_back(other);
+        }
+      }
+    }
+    return !order_.empty();
+  }
+
+  void ComputeCandidateLabels() {
+    labels_.assign(component_.nodes.size(), std::vector<int>());
+    subtree_score_.assign(component_.nodes.size(), std::vector<double>());
+    std::vector<int> candidates;
+    std::vector<std::pair<double, int> > scored_candidates;
+    for (int node : order_) {
+      candidates.clear();
+      a_.GetLabelCandidates(fweights_, node, &candidates, kTreeInferenceBeamSize);
+      for (const GraphQuery::Arc& arc : a_.query_->arcs_adjacent_to_node_[node]) {
+        int other = OtherNode(arc, node);
+        if (other == node || !a_.must_infer_[other]) continue;
+        CandidateSpan<FeatureCandidate> best_features = fweights_.GetBestFeaturesForType(arc.type);
+        for (size_t i = 0; i < best_features.size() && i < kTreeInferenceBeamSize; ++i) {
+          candidates.push_back(arc.node_a == node ? best_features[i].second.a_ : best_features[i].second.b_);
+        }
+      }
+      std::sort(candidates.begin(), candidates.end());
+      candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
+      a_.RemoveInvalidLabels(fweights_, &candidates);
+
+      // The current label goes first, so that it is kept on ties. Keep the candidates with the best score
+      // on the given neighbors of the node.
+      int current_label = a_.labels_[node];
+      scored_candidates.clear();
+      scored_candidates.push_back(std::pair<double, int>(GetNodeScoreOnGivenNodes(node, current_label), current_label));
+      for (int label : candidates) {
+        if (label == current_label) continue;
+        scored_candidates.push_back(std::pair<double, int>(GetNodeScoreOnGivenNodes(node, label), label));
+      }
+      if (scored_candidates.size() > kMaxTreeInferenceLabels) {
+        std::stable_sort(scored_candidates.begin() + 1, scored_candidates.end(),
+            [](const std::pair<double, int>& x, const std::pair<double, int>& y) { return x.first > y.first; });
+        scored_candidates.resize(kMaxTreeInferenceLabels);
+      }
+      int index = index_in_component_[node];
+      for (const std::pair<double, int>& candidate : scored_candidates) {
+        subtree_score_[index].push_back(candidate.first);
+        labels_[index].push_back(candidate.second);
+      }
+    }
+  }
+
+  // The penalty and the arcs of a node to nodes that are not inferred (or to itself).
+  double GetNodeScoreOnGivenNodes(int node, int label) {
+    double sum = Policy::with_penalty ? -a_.GetNodePenaltyForLabel(node, label) : 0.0;
+    for (const GraphQuery::Arc& arc : a_.query_->arcs_adjacent_to_node_[node]) {
+      int other = OtherNode(arc, node);
+      if (other == node) {
+        sum += GetFeatureWeight(label, label, arc.type);
+      } else if (!a_.must_infer_[other]) {
+        sum += (arc.node_a == node) ?
+            GetFeatureWeight(label, a_.labels_[other], arc.type) :
+            GetFeatureWeight(a_.labels_[other], label, arc.type);
+      }
+    }
+    return sum;
+  }
+
+  // Passes the best subtree scores from the leaves up to the roots.
+  void ComputeMessages() {
+    best_label_for_parent_label_.assign(component_.nodes.size(), std::vector<int>());
+    std::vector<GraphQuery::Arc> parent_arcs;
+    for (size_t i = order_.size(); i-- > 0;) {
+      int node = order_[i];
+      int index = index_in_component_[node];
+      int parent = parent_[index];
+      if (parent == -1) continue;
+      parent_arcs.clear();
+      for (const GraphQuery::Arc& arc : a_.query_->arcs_adjacent_to_node_[node]) {
+        if (OtherNode(arc, node) == parent) parent_arcs.push_back(arc);
+      }
+      const std::vector<int>& labels = labels_[index];
+      const std::vector<double>& scores = subtree_score_[index];
+      int parent_index = index_in_component_[parent];
+      const std::vector<int>& parent_labels = labels_[parent_index];
+      std::vector<double>& parent_scores = subtree_score_[parent_index];
+      std::vector<int>& best_labels = best_label_for_parent_label_[index];
+      best_labels.assign(parent_labels.size(), 0);
+      for (size_t j = 0; j < parent_labels.size(); ++j) {
+        double best_score = 0;
+        for (size_t k = 0; k < labels.size(); ++k) {
+          double score = scores[k];
+          for (const GraphQuery::Arc& arc : parent_arcs) {
+            score += (arc.node_a == node) ?
+                GetFeatureWeight(labels[k], parent_labels[j], arc.type) :
+                GetFeatureWeight(parent_labels[j], labels[k], arc.type);
+          }
+          if (k == 0 || score > best_score) {
+            best_score = score;
+            best_labels[j] = k;
+          }
+        }
+        parent_scores[j] += best_score;
       }
     }
   }
@@ -1192,35 +2137,216 @@ private:
 
 
 
-GraphInference::GraphInference() : unknown_label_(-1), regularizer_(1.0), svm_margin_(1e-9), beam_size_(0), num_svm_training_samples_(0) {
+HugePageRegion& FeatureTableRegion::Get() {
+  static HugePageRegion* region = new HugePageRegion("feature table");
+  return *region;
+}
+
+HugePageRegion& ServingWeightsRegion::Get() {
+  static HugePageRegion* region = new HugePageRegion("serving weights");
+  return *region;
+}
+
+HugePageRegion& CandidateListRegion::Get() {
+  static HugePageRegion* region = new HugePageRegion("candidate lists");
+  return *region;
+}
+
+GraphInference::GraphInference() : unknown_label_(-1), regularizer_(1.0), svm_margin_(1e-9), beam_size_(0), num_svm_training_samples_(0),
+    candidate_list_bound_(0), candidate_list_threads_(1), training_(false), feature_tables_generation_(0) {
   // Initialize dense_hash_map.
   features_.set_empty_key(GraphFeature(-1, -1, -1));
   features_.set_deleted_key(GraphFeature(-2, -2, -2));
-  best_features_for_type_.set_empty_key(-1);
-  best_features_for_type_.set_deleted_key(-2);
+  factor_features_.set_empty_key(kEmptyFactorHash);
+  factor_features_.set_deleted_key(kDeletedFactorHash);
   best_factor_features_first_level_.set_empty_key(-1);
   best_factor_features_first_level_.set_deleted_key(-2);
-  label_frequency_.set_empty_key(-1);
-  label_frequency_.set_deleted_key(-2);
 }
 
 GraphInference::~GraphInference() {
 }
 
+CandidateSpan<FeatureCandidate> GraphInference::GetBestFeaturesForType(int type) const {
+  if (lazy_segments_ != NULL) {
+    const FeatureCandidates& candidates = GetRelationSegment(type).candidates;
+    return CandidateSpan<FeatureCandidate>(candidates.data(), candidates.data() + candidates.size());
+  }
+  int id = strings_.denseId(type);
+  if (id < 0 || static_cast<size_t>(id) >= type_candidate_ranges_.size()) return CandidateSpan<FeatureCandidate>();
+  const CandidateRange& range = type_candidate_ranges_[id];
+  const FeatureCandidate* base = best_features_for_type_.data();
+  return CandidateSpan<FeatureCandidate>(base + range.begin, base + range.end);
+}
+
+CandidateSpan<LabelCandidate> GraphInference::GetBestFeaturesForAType(int label, int type) const {
+  if (lazy_segments_ != NULL) return GetRelationSegment(type).best_features_for_a.Get(IntPair(label, type));
+  return best_features_for_a_type_.Get(IntPair(label, type));
+}
+
+CandidateSpan<LabelCandidate> GraphInference::GetBestFeaturesForBType(int label, int type) const {
+  if (lazy_segments_ != NULL) return GetRelationSegment(type).best_features_for_b.Get(IntPair(label, type));
+  return best_features_for_b_type_.Get(IntPair(label, type));
+}
+
+bool GraphInference::IsKnownLabel(int label) const {
+  int id = strings_.denseId(label);
+  return id >= 0 && static_cast<size_t>(id) < label_frequency_.size() && label_frequency_[id] > 0;
+}
+
 void GraphInference::LoadModel(const std::string& file_prefix) {
+  ReadModelFiles(file_prefix, true);
+  PrepareForInference();
+}
+
+void GraphInference::LoadModelWithLazySegments(const std::string& file_prefix) {
+  FILE* segfile = fopen(StringPrintf("%s_segments", file_prefix.c_str()).c_str(), "rb");
+  FILE* hfile = fopen(StringPrintf("%s_hashed_weights", file_prefix.c_str()).c_str(), "rb");
+  if (hfile != NULL) {
+    // The hashed weights are one table, the segments would only have the candidate lists.
+    fclose(hfile);
+    if (segfile != NULL) fclose(segfile);
+    segfile = NULL;
+  }
+  if (segfile == NULL) {
+    LOG(WARNING) << "Model " << file_prefix << " has no segment index or has hashed weights, loading all features.";
+    LoadModel(file_prefix);
+    Freeze();
+    return;
+  }
+  ReadModelFiles(file_prefix, false);
+
+  std::shared_ptr<LazyRelationSegments> segments(new LazyRelationSegments());
+  segments->features_file = StringPrintf("%s_features", file_prefix.c_str());
+  segments->segment_of_type.assign(strings_.numEntries(), -1);
+  int num_segments = 0;
+  CHECK_EQ(1, fread(&num_segments, sizeof(int), 1, segfile));
+  segments->offsets.assign(num_segments, -1);
+  segments->num_features.assign(num_segments, 0);
+  segments->segments.reset(new std::atomic<const RelationSegment*>[num_segments]());
+  segments->mutexes.reset(new std::mutex[num_segments]);
+  for (int i = 0; i < num_segments; ++i) {
+    int type, num_features;
+    int64 offset;
+    CHECK_EQ(1, fread(&type, sizeof(int), 1, segfile));
+    CHECK_EQ(1, fread(&num_features, sizeof(int), 1, segfile));
+    CHECK_EQ(1, fread(&offset, sizeof(int64), 1, segfile));
+    int id = strings_.denseId(type);
+    CHECK_GE(id, 0) << "Relation type " << type << " is not in the strings of the model.";
+    segments->segment_of_type[id] = i;
+    segments->offsets[i] = offset;
+    segments->num_features[i] = num_features;
+  }
+  fclose(segfile);
+  lazy_segments_ = segments;
+  LOG(INFO) << "Read the index of " << num_segments << " relation segments, their features are loaded on first use.";
+
+  PrepareForInference();
+  Freeze();
+}
+
+LazyRelationSegments::~LazyRelationSegments() {
+  for (size_t index = 0; index < offsets.size(); ++index) {
+    delete segments[index].load();
+  }
+}
+
+const RelationSegment& GraphInference::GetRelationSegment(int type) const {
+  static const RelationSegment empty;
+  LazyRelationSegments& segments = *lazy_segments_;
+  int id = strings_.denseId(type);
+  if (id < 0 || static_cast<size_t>(id) >= segments.segment_of_type.size()) return empty;
+  int index = segments.segment_of_type[id];
+  if (index < 0) return empty;
+  const RelationSegment* segment = segments.segments[index].load(std::memory_order_acquire);
+  if (segment != NULL) return *segment;
+  std::lock_guard<std::mutex> lock(segments.mutexes[index]);
+  segment = segments.segments[index].load(std::memory_order_relaxed);
+  if (segment == NULL) {
+    segment = ReadRelationSegment(type, index);
+    segments.segments[index].store(segment, std::memory_order_release);
+  }
+  return *segment;
+}
+
+// Reads the features of a relation type and builds their candidate lists as PrepareForInference does.
+const RelationSegment* GraphInference::ReadRelationSegment(int type, int segment_index) const {
+  LazyRelationSegments& segments = *lazy_segments_;
+  RelationSegment* segment = new RelationSegment();
+  FILE* ffile = fopen(segments.features_file.c_str(), "rb");
+  CHECK(ffile != NULL) << "Cannot open " << segments.features_file;
+  CHECK_EQ(0, fseek(ffile, segments.offsets[segment_index], SEEK_SET));
+  for (int i = 0; i < segments.num_features[segment_index]; ++i) {
+    GraphFeature f(0, 0, 0);
+    double score;
+    CHECK_EQ(1, fread(&f, sizeof(GraphFeature), 1, ffile));
+    CHECK_EQ(1, fread(&score, sizeof(double), 1, ffile));
+    CHECK_EQ(f.type_, type) << "Bad segment index for " << segments.features_file;
+    ReplaceRareLabels(&f);
+    segment->features[f] += score;
+  }
+  fclose(ffile);
+
+  segment->candidates.reserve(segment->features.size());
+  for (auto it = segment->features.begin(); it != segment->features.end(); ++it) {
+    const GraphFeature& f = it->first;
+    segment->candidates.push_back(FeatureCandidate(it->second, f));
+    segment->best_features_for_a.Count(IntPair(f.a_, type));
+    segment->best_features_for_b.Count(IntPair(f.b_, type));
+  }
+  segment->best_features_for_a.Allocate();
+  segment->best_features_for_b.Allocate();
+  for (auto it = segment->features.begin(); it != segment->features.end(); ++it) {
+    const GraphFeature& f = it->first;
+    segment->best_features_for_a.Add(IntPair(f.a_, type), LabelCandidate(it->second, f.b_));
+    segment->best_features_for_b.Add(IntPair(f.b_, type), LabelCandidate(it->second, f.a_));
+  }
+  // The segment is read by an inference thread, which sorts it by itself.
+  size_t max_size = GetCandidateListBound();
+  FeatureCandidate* candidates = segment->candidates.data();
+  segment->candidates.resize(SortCandidateList(max_size, candidates, candidates + segment->candidates.size()));
+  segment->best_features_for_a.Sort(max_size, 1);
+  segment->best_features_for_b.Sort(max_size, 1);
+  segments.num_loaded.fetch_add(1);
+  segments.num_loaded_features.fetch_add(segment->features.size());
+  VLOG(1) << "Loaded " << segment->features.size() << " features of relation " << strings_.getString(type);
+  return segment;
+}
+
+void GraphInference::LogLazySegmentStats() const {
+  if (lazy_segments_ == NULL) return;
+  const LazyRelationSegments& segments = *lazy_segments_;
+  LOG(INFO) << "Loaded " << segments.num_loaded.load() << " out of " << segments.offsets.size() << " relation segments ("
+      << segments.num_loaded_features.load() << " features).";
+}
+
+// Reads the model files. Without features, the features file is only read for the factor features.
+void GraphInference::ReadModelFiles(const std::string& file_prefix, bool with_features) {
   LOG(INFO) << "Loading model " << file_prefix << "...";
+  ++feature_tables_generation_;
   features_.clear();
+  factor_features_.clear();
+  factors_set_.clear();
+  frozen_weights_.reset();
+  quantized_weights_8_.reset();
+  quantized_weights_16_.reset();
+  lazy_segments_.reset();
+  hashed_weights_ = HashedFeatureWeights();
+  std::vector<GraphFeature>().swap(hashed_features_);
 
   FILE* ffile = fopen(StringPrintf("%s_features", file_prefix.c_str()).c_str(), "rb");
   int num_features = 0;
   int num_factor_features = 0;
   CHECK_EQ(1, fread(&num_features, sizeof(int), 1, ffile));
-  for (int i = 0; i < num_features; ++i) {
-    GraphFeature f(0, 0, 0);
-    double score;
-    CHECK_EQ(1, fread(&f, sizeof(GraphFeature), 1, ffile));
-    CHECK_EQ(1, fread(&score, sizeof(double), 1, ffile));
-    features_[f].setValue(score);
+  if (with_features) {
+    for (int i = 0; i < num_features; ++i) {
+      GraphFeature f(0, 0, 0);
+      double score;
+      CHECK_EQ(1, fread(&f, sizeof(GraphFeature), 1, ffile));
+      CHECK_EQ(1, fread(&score, sizeof(double), 1, ffile));
+      features_[f].setValue(score);
+    }
+  } else {
+    CHECK_EQ(0, fseek(ffile, static_cast<long>(num_features) * (sizeof(GraphFeature) + sizeof(double)), SEEK_CUR));
   }
 
   int ret = fread(&num_factor_features, sizeof(int), 1, ffile);
@@ -1238,11 +2364,34 @@ void GraphInference::LoadModel(const std::string& file_prefix) {
       }
       double score;
       CHECK_EQ(1, fread(&score, sizeof(double), 1, ffile));
-      factor_features_[hash] = score;
+      factors_set_.insert(f);
+      factor_features_[hash].setValue(score);
     }
   }
   fclose(ffile);
-  CHECK_EQ(features_.size(), num_features);
+  if (with_features) {
+    CHECK_EQ(features_.size(), num_features);
+  }
+
+  FILE* hfile = fopen(StringPrintf("%s_hashed_weights", file_prefix.c_str()).c_str(), "rb");
+  if (hfile != NULL) {
+    int bits, sign_hash;
+    CHECK_EQ(1, fread(&bits, sizeof(int), 1, hfile));
+    CHECK_EQ(1, fread(&sign_hash, sizeof(int), 1, hfile));
+    hashed_weights_ = HashedFeatureWeights(bits, sign_hash != 0);
+    std::vector<double> entries(hashed_weights_.size());
+    CHECK_EQ(entries.size(), fread(entries.data(), sizeof(double), entries.size(), hfile));
+    for (size_t i = 0; i < entries.size(); ++i) {
+      hashed_weights_.SetEntry(i, entries[i]);
+    }
+    int num_hashed_features = 0;
+    CHECK_EQ(1, fread(&num_hashed_features, sizeof(int), 1, hfile));
+    hashed_features_.resize(num_hashed_features);
+    CHECK_EQ(hashed_features_.size(),
+             fread(hashed_features_.data(), sizeof(GraphFeature), hashed_features_.size(), hfile));
+    fclose(hfile);
+    LOG(INFO) << "Loaded hashed feature weights with " << bits << " bits for " << num_hashed_features << " features.";
+  }
 
   FILE* sfile = fopen(StringPrintf("%s_strings", file_prefix.c_str()).c_str(), "rb");
   strings_.loadFromFile(sfile);
@@ -1250,33 +2399,64 @@ void GraphInference::LoadModel(const std::string& file_prefix) {
 
   if (!FLAGS_unknown_label.empty()) {
     int a, b, size;
-    label_frequency_.clear();
+    label_frequency_.assign(strings_.numEntries(), 0);
     FILE* lffile = fopen(StringPrintf("%s_lfreq", file_prefix.c_str()).c_str(), "rb");
     CHECK_EQ(1, fread(&size, sizeof(int), 1, lffile));
     for (int i = 0; i < size; ++i) {
       CHECK_EQ(1, fread(&a, sizeof(int), 1, lffile));
       CHECK_EQ(1, fread(&b, sizeof(int), 1, lffile));
-      label_frequency_[a] = b;
+      int id = strings_.denseId(a);
+      CHECK_GE(id, 0) << "Label " << a << " is not in the strings of the model.";
+      label_frequency_[id] = b;
     }
-    CHECK_EQ(static_cast<int>(label_frequency_.size()), size);
     fclose(lffile);
   }
 
   LOG(INFO) << "Loading model done";
-
-  PrepareForInference();
 }
 
 void GraphInference::SaveModel(const std::string& file_prefix) {
+  CHECK(!IsFrozen()) << "A frozen model cannot be saved.";
   LOG(INFO) << "Saving model " << file_prefix << "...";
   FILE* ffile = fopen(StringPrintf("%s_features", file_prefix.c_str()).c_str(), "wb");
   int num_features = features_.size();
   int num_factor_features = factors_set_.size();
-  fwrite(&num_features, sizeof(int), 1, ffile);
+  // The features are grouped by relation type and the _segments file has the position of each group, so that
+  // LoadModelWithLazySegments can read the features of one relation type.
+  std::vector<std::pair<GraphFeature, double> > sorted_features;
+  sorted_features.reserve(num_features);
   for (auto it = features_.begin(); it != features_.end(); ++it) {
-    fwrite(&it->first, sizeof(GraphFeature), 1, ffile);
-    double value = it->second.getValue();
-    fwrite(&value, sizeof(double), 1, ffile);
+    sorted_features.push_back(std::pair<GraphFeature, double>(it->first, it->second.getValue()));
+  }
+  std::sort(sorted_features.begin(), sorted_features.end(),
+      [](const std::pair<GraphFeature, double>& x, const std::pair<GraphFeature, double>& y) {
+        return x.first.type_ < y.first.type_;
+      });
+  fwrite(&num_features, sizeof(int), 1, ffile);
+  for (const auto& feature : sorted_features) {
+    fwrite(&feature.first, sizeof(GraphFeature), 1, ffile);
+    fwrite(&feature.second, sizeof(double), 1, ffile);
+  }
+  {
+    std::vector<int> segment_starts;
+    for (int i = 0; i < num_features; ++i) {
+      if (i == 0 || sorted_features[i].first.type_ != sorted_features[i - 1].first.type_) {
+        segment_starts.push_back(i);
+      }
+    }
+    segment_starts.push_back(num_features);
+    FILE* segfile = fopen(StringPrintf("%s_segments", file_prefix.c_str()).c_str(), "wb");
+    int num_segments = segment_starts.size() - 1;
+    fwrite(&num_segments, sizeof(int), 1, segfile);
+    for (int i = 0; i < num_segments; ++i) {
+      int type = sorted_features[segment_starts[i]].first.type_;
+      int segment_size = segment_starts[i + 1] - segment_starts[i];
+      int64 offset = sizeof(int) + static_cast<int64>(segment_starts[i]) * (sizeof(GraphFeature) + sizeof(double));
+      fwrite(&type, sizeof(int), 1, segfile);
+      fwrite(&segment_size, sizeof(int), 1, segfile);
+      fwrite(&offset, sizeof(int64), 1, segfile);
+    }
+    fclose(segfile);
   }
 
   fwrite(&num_factor_features, sizeof(int), 1, ffile);
@@ -1289,11 +2469,33 @@ void GraphInference::SaveModel(const std::string& file_prefix) {
       hash += HashInt(var_val);
       fwrite(&var_val, sizeof(int), 1, ffile);
     }
-    double value = factor_features_[hash];
+    double value = FindWithDefault(factor_features_, hash, LockFreeWeights()).getValue();
     fwrite(&value, sizeof(double), 1, ffile);
   }
   fclose(ffile);
 
+  std::string hashed_weights_file = StringPrintf("%s_hashed_weights", file_prefix.c_str());
+  if (hashed_weights_.IsEnabled()) {
+    FILE* hfile = fopen(hashed_weights_file.c_str(), "wb");
+    int bits = hashed_weights_.bits();
+    int sign_hash = hashed_weights_.sign_hash() ? 1 : 0;
+    fwrite(&bits, sizeof(int), 1, hfile);
+    fwrite(&sign_hash, sizeof(int), 1, hfile);
+    std::vector<double> entries(hashed_weights_.size());
+    for (size_t i = 0; i < entries.size(); ++i) {
+      entries[i] = hashed_weights_.GetEntry(i);
+    }
+    fwrite(entries.data(), sizeof(double), entries.size(), hfile);
+    // Only the keys, the features file has no features then.
+    int num_hashed_features = hashed_features_.size();
+    fwrite(&num_hashed_features, sizeof(int), 1, hfile);
+    fwrite(hashed_features_.data(), sizeof(GraphFeature), hashed_features_.size(), hfile);
+    fclose(hfile);
+  } else {
+    // A model saved before under the same prefix may have had hashed weights.
+    remove(hashed_weights_file.c_str());
+  }
+
   FILE* sfile = fopen(StringPrintf("%s_strings", file_prefix.c_str()).c_str(), "wb");
   strings_.saveToFile(sfile);
   fclose(sfile);
@@ -1301,12 +2503,16 @@ void GraphInference::SaveModel(const std::string& file_prefix) {
   if (!FLAGS_unknown_label.empty()) {
     int x;
     FILE* lffile = fopen(StringPrintf("%s_lfreq", file_prefix.c_str()).c_str(), "wb");
-    x = label_frequency_.size();
+    // The file keeps the string index of the label (not the dense id).
+    std::vector<int> labels;
+    strings_.getAllStrings(&labels);
+    x = label_frequency_.size() - std::count(label_frequency_.begin(), label_frequency_.end(), 0);
     fwrite(&x, sizeof(int), 1, lffile);
-    for (auto it = label_frequency_.begin(); it != label_frequency_.end(); ++it) {
-      x = it->first;
+    for (size_t id = 0; id < label_frequency_.size(); ++id) {
+      if (label_frequency_[id] == 0) continue;
+      x = labels[id];
       fwrite(&x, sizeof(int), 1, lffile);
-      x = it->second;
+      x = label_frequency_[id];
       fwrite(&x, sizeof(int), 1, lffile);
     }
     fclose(lffile);
@@ -1322,16 +2528,98 @@ Nice2Assignment* GraphInference::CreateAssignment(Nice2Query* query) const {
   GraphQuery* q = static_cast<GraphQuery*>(query);
   return new GraphNodeAssignment(q, &q->label_set_, unknown_label_);
 }
+void GraphInference::ToCompactQuery(const nice2protos::Query& query, CompactQuery* compact) const {
+  GraphQuery q(&strings_, &label_checker_);
+  q.FromFeaturesQueryProto(query.features());
+  q.ToCompactQuery(compact);
+  compact->assignments.clear();
+  compact->unknown_labels.clear();
+  for (const auto& assignment : query.node_assignments()) {
+    int label = strings_.findString(assignment.label().c_str());
+    if (label < 0) {
+      // The label gets a query-local id when the query is built.
+      compact->unknown_labels.push_back(assignment.label());
+      label = -static_cast<int>(compact->unknown_labels.size());
+    }
+    compact->assignments.insert(compact->assignments.end(),
+        {static_cast<int>(assignment.node_index()), label, assignment.given() ? 1 : 0});
+  }
+}
+
+Nice2Query* GraphInference::CreateQuery(const CompactQuery& compact) const {
+  GraphQuery* q = new GraphQuery(&strings_, &label_checker_);
+  q->FromCompactQuery(compact);
+  return q;
+}
+
+Nice2Assignment* GraphInference::CreateAssignment(Nice2Query* query, const CompactQuery& compact) const {
+  GraphQuery* q = static_cast<GraphQuery*>(query);
+  GraphNodeAssignment* a = new GraphNodeAssignment(q, &q->label_set_, unknown_label_);
+  a->FromCompactQuery(compact);
+  return a;
+}
+
 void GraphInference::PerformAssignmentOptimization(GraphNodeAssignment* a) const {
   if (unknown_label_ >= 0) {
     a->ReplaceLabelsWithUnknown(*this);
   }
-  double score = a->GetTotalScore(*this);
-  VLOG(1) << "Start score " << score;
+  if (FLAGS_query_local_weights) {
+    // The weights change between the optimizations during training, so the tables only live for one.
+    a->weight_caches_.assign(a->query_->components_.size(), QueryWeightCache());
+  }
+  // The scoring configuration is fixed for the whole optimization of the assignment.
+  DispatchScoringPolicy(*this, *a, [this, a](auto policy) {
+    RunOptimizationPasses<decltype(policy)>(a);
+  });
+  std::vector<QueryWeightCache>().swap(a->weight_caches_);
+#ifdef GRAPH_INFERENCE_STATS
+  VLOG(2) << a->stats_.ToString();
+#endif
+}
+
+// The workers that optimize components in parallel. Started on the first parallel inference with
+// --graph_inference_threads threads (the calling thread is one of them) and shared by all models.
+static ThreadPool* GetInferenceThreadPool() {
+  static ThreadPool* pool = new ThreadPool(std::max(FLAGS_graph_inference_threads - 1, 1));
+  return pool;
+}
+
+template <class Policy>
+void GraphInference::RunOptimizationPasses(GraphNodeAssignment* a) const {
+  const std::vector<GraphQuery::Component>& components = a->query_->components_;
+  int64 start_time = GetCurrentTimeMicros();
+  int num_threads = std::min<int>(FLAGS_graph_inference_threads, components.size());
+  if (num_threads <= 1 || static_cast<int>(a->labels_.size()) < FLAGS_min_nodes_for_parallel_inference) {
+    for (size_t c = 0; c < components.size(); ++c) {
+      OptimizeComponent<Policy>(a, c);
+    }
+  } else {
+    // The components share no labels, scopes or features, so they can be optimized concurrently.
+    GetInferenceThreadPool()->ParallelFor(components.size(), num_threads - 1, [this, a](size_t c) {
+      OptimizeComponent<Policy>(a, c);
+    });
+  }
+  int64 end_time = GetCurrentTimeMicros();
+  VLOG(2) << "Optimized " << components.size() << " components in " << (end_time - start_time)/1000 << "ms.";
+}
+
+template <class Policy>
+void GraphInference::OptimizeComponent(GraphNodeAssignment* a, int component_index) const {
+  const GraphQuery::Component& component = a->query_->components_[component_index];
+  CachedWeights<typename Policy::Weights> weights(*this, a->GetWeightCache(component.nodes[0]));
+  double score = a->GetComponentScore(&weights, component);
+  VLOG(3) << "Start score " << score;
   if (FLAGS_initial_greedy_assignment_pass) {
-    a->InitialGreedyAssignmentPass(*this);
-    score = a->GetTotalScore(*this);
-    VLOG(1) << "Past greedy pass score " << score;
+    a->InitialGreedyAssignmentPass<Policy>(*this, component);
+    score = a->GetComponentScore(&weights, component);
+    VLOG(3) << "Past greedy pass score " << score;
+  }
+  if (FLAGS_graph_tree_inference && component.factors.empty()) {
+    TreeInference<Policy> tree(*a, *this, component);
+    if (tree.Run(a)) {
+      VLOG(3) << "Tree score " << a->GetComponentScore(&weights, component);
+      return;
+    }
   }
 
   int passes = std::max(FLAGS_graph_per_node_passes, std::max(FLAGS_graph_loopy_bp_passes, FLAGS_graph_per_arc_passes));
@@ -1339,50 +2627,33 @@ void GraphInference::PerformAssignmentOptimization(GraphNodeAssignment* a) const
   size_t per_arc_beam_size = kStartPerArcBeamSize;
   for (int pass = 0; pass < passes; ++pass) {
     if (pass < FLAGS_graph_loopy_bp_passes) {
-      VLOG(1) << "prescore  " << score;
-      int64 start_time = GetCurrentTimeMicros();
-      LoopyBPInference bp(*a, *this);
+      LoopyBPInference<Policy> bp(*a, *this, component);
       bp.Run(a);
-      int64 end_time = GetCurrentTimeMicros();
-      VLOG(2) << "LoopyBP pass " << (end_time - start_time)/1000 << "ms.";
-      VLOG(1) << "BP score  " << a->GetTotalScore(*this);
+      VLOG(3) << "BP score  " << a->GetComponentScore(&weights, component);
     }
     if (pass < FLAGS_graph_per_node_passes) {
-      int64 start_time = GetCurrentTimeMicros();
       if (FLAGS_duplicate_name_resolution) {
-        a->LocalPerNodeOptimizationPassWithDuplicateNameResolution(*this, per_node_beam_size);
+        a->LocalPerNodeOptimizationPassWithDuplicateNameResolution<Policy>(*this, component, per_node_beam_size);
       } else {
-        a->LocalPerNodeOptimizationPass(*this, per_node_beam_size);
+        a->LocalPerNodeOptimizationPass<Policy>(*this, component, per_node_beam_size);
       }
-      int64 end_time = GetCurrentTimeMicros();
-      VLOG(2) << "Per node pass " << (end_time - start_time)/1000 << "ms.";
-
       per_node_beam_size = std::min( per_node_beam_size * 2, kMaxPerNodeBeamSize);
     }
     if (pass < FLAGS_graph_per_arc_passes) {
-      int64 start_time = GetCurrentTimeMicros();
-      a->LocalPerArcOptimizationPass(*this, per_arc_beam_size);
-      int64 end_time = GetCurrentTimeMicros();
-      VLOG(2) << "Per arc pass " << (end_time - start_time)/1000 << "ms.";
-
+      a->LocalPerArcOptimizationPass<Policy>(*this, component, per_arc_beam_size);
       per_arc_beam_size = std::min(per_arc_beam_size * 2, kMaxPerArcBeamSize);
     }
     if (pass < FLAGS_graph_per_factor_passes) {
-      int64 start_time = GetCurrentTimeMicros();
-      a->LocalPerFactorOptimizationPass(*this, FLAGS_factors_limit);
-      int64 end_time = GetCurrentTimeMicros();
-      VLOG(2) << "Per factor pass " << (end_time - start_time)/1000 << "ms.";
+      a->LocalPerFactorOptimizationPass<Policy>(*this, component, FLAGS_factors_limit);
     }
 
-    double updated_score = a->GetTotalScore(*this);
-    VLOG(2) << "Got to score " << updated_score;
+    // Each component stops when its own score converges.
+    double updated_score = a->GetComponentScore(&weights, component);
+    VLOG(3) << "Got to score " << updated_score;
     if (updated_score == score) break;
     score = updated_score;
   }
-  VLOG(1) << "End score   " << score;
-#ifdef GRAPH_INFERENCE_STATS
-  VLOG(2) << a->stats_.ToString();
-#endif
+  VLOG(3) << "End score   " << score;
 }
 
 void GraphInference::MapInference(
@@ -1394,7 +2665,12 @@ void GraphInference::MapInference(
 
 double GraphInference::GetAssignmentScore(const Nice2Assignment* assignment) const {
   const GraphNodeAssignment* a = static_cast<const GraphNodeAssignment*>(assignment);
-  return a->GetTotalScore(*this);
+  double score = 0;
+  DispatchScoringPolicy(*this, *a, [this, a, &score](auto policy) {
+    typename decltype(policy)::Weights weights(*this);
+    score = a->GetTotalScore(&weights);
+  });
+  return score;
 }
 
 void GraphInference::UpdateStats(
@@ -1404,13 +2680,13 @@ void GraphInference::UpdateStats(
     const double margin) {
 
   int correct_labels = 0, incorrect_labels = 0, num_known_predictions = 0;
-  for (size_t i = 0; i < new_assignment.assignments_.size(); ++i) {
-    if (new_assignment.assignments_[i].must_infer) {
-      if (new_assignment.assignments_[i].label != unknown_label_) {
+  for (size_t i = 0; i < new_assignment.labels_.size(); ++i) {
+    if (new_assignment.must_infer_[i]) {
+      if (new_assignment.labels_[i] != unknown_label_) {
         ++num_known_predictions;
       }
-      if (new_assignment.assignments_[i].label == assignment.assignments_[i].label &&
-          new_assignment.assignments_[i].label != unknown_label_) {
+      if (new_assignment.labels_[i] == assignment.labels_[i] &&
+          new_assignment.labels_[i] != unknown_label_) {
         ++correct_labels;
       } else {
         ++incorrect_labels;
@@ -1437,8 +2713,11 @@ void GraphInference::InitializeFeatureWeights(double regularization) {
   for (auto it = features_.begin(); it != features_.end(); ++it) {
     it->second.setValue(regularizer_ * 0.5);
   }
+  for (const GraphFeature& feature : hashed_features_) {
+    hashed_weights_.Set(HashFeatureForTable(feature), regularizer_ * 0.5);
+  }
   for (auto it = factor_features_.begin(); it != factor_features_.end(); ++it) {
-    it->second = regularizer_ * 0.5;
+    it->second.setValue(regularizer_ * 0.5);
   }
 }
 
@@ -1448,6 +2727,10 @@ void GraphInference::SSVMInit(double margin) {
 
 void GraphInference::PLInit(int beam_size) {
   beam_size_ = beam_size;
+  if (candidate_list_bound_ > 0 && candidate_list_bound_ < static_cast<size_t>(beam_size_)) {
+    // The lists were cut shorter than the new beam.
+    BuildCandidateLists();
+  }
 }
 
 void GraphInference::SSVMLearn(
@@ -1455,6 +2738,7 @@ void GraphInference::SSVMLearn(
     const Nice2Assignment* assignment,
     double learning_rate,
     PrecisionStats* stats) {
+  CHECK(!IsFrozen()) << "A frozen model cannot be trained.";
   const GraphNodeAssignment* a = static_cast<const GraphNodeAssignment*>(assignment);
 
   GraphNodeAssignment new_assignment(*a);
@@ -1464,36 +2748,27 @@ void GraphInference::SSVMLearn(
   UpdateStats((*a), new_assignment, stats, svm_margin_);
 
   // Perform gradient descent.
-  SimpleFeaturesMap affected_features;  // Gradient for each affected feature.
-  Uint64FactorFeaturesMap factor_affected_features;
-  affected_features.set_empty_key(GraphFeature(-1, -1, -1));
-  affected_features.set_deleted_key(GraphFeature(-2, -2, -2));
-  a->GetAffectedFeatures(&affected_features, learning_rate);
-  a->GetAffectedFactorFeatures(&factor_affected_features, learning_rate);
-  new_assignment.GetAffectedFeatures(&affected_features, -learning_rate);
-  new_assignment.GetAffectedFactorFeatures(&factor_affected_features, -learning_rate);
-  for (auto it = affected_features.begin(); it != affected_features.end(); ++it) {
-    if (it->second < -1e-9 || it->second > 1e-9) {
-      VLOG(3) << a->GetLabelName(it->first.a_) << " " << a->GetLabelName(it->first.b_) << " " << a->GetLabelName(it->first.type_) << " " << it->second;
-      auto features_it = features_.find(it->first);
-      if (features_it != features_.end()) {
-        features_it->second.atomicAddRegularized(it->second, 0, regularizer_);
-      }
-    }
-  }
-
-  for (auto f_feature = factor_affected_features.begin(); f_feature != factor_affected_features.end(); ++f_feature) {
-    if (f_feature->second < -1e-9 || f_feature->second > 1e-9) {
-
-      auto factor_feature = factor_features_.find(f_feature->first);
-      if (factor_feature != factor_features_.end()) {
-        factor_feature->second += f_feature->second;
-        // L_inf regularize the new value.
-        if (factor_feature->second < 0) factor_feature->second = 0;
-        if (factor_feature->second > regularizer_) factor_feature->second = regularizer_;
-      }
-    }
-  }
+  // Gradient for each affected feature, in the buffer of the thread when the gradients are merged.
+  std::unique_ptr<GradientBuffer> sample_gradients;
+  GradientBuffer* gradients;
+  if (FLAGS_gradient_merge_samples > 1) {
+    gradients = gradient_buffers_.GetForCurrentThread();
+  } else {
+    sample_gradients.reset(new GradientBuffer());
+    gradients = sample_gradients.get();
+  }
+  a->GetAffectedFeatures(&gradients->features, learning_rate);
+  a->GetAffectedFactorFeatures(&gradients->factor_features, learning_rate);
+  new_assignment.GetAffectedFeatures(&gradients->features, -learning_rate);
+  new_assignment.GetAffectedFactorFeatures(&gradients->factor_features, -learning_rate);
+  if (VLOG_IS_ON(3)) {
+    for (auto it = gradients->features.begin(); it != gradients->features.end(); ++it) {
+      if (it->second < -1e-9 || it->second > 1e-9) {
+        VLOG(3) << a->GetLabelName(it->first.a_) << " " << a->GetLabelName(it->first.b_) << " " << a->GetLabelName(it->first.type_) << " " << it->second;
+      }
+    }
+  }
+  AddSampleGradients(gradients);
 }
 
 void GraphInference::PLLearn(
@@ -1501,56 +2776,194 @@ void GraphInference::PLLearn(
     const Nice2Assignment* assignment,
     double learning_rate) {
   CHECK_GT(beam_size_, 0) << "PLInit not called or beam size was set to an invalid value.";
+  CHECK(!IsFrozen()) << "A frozen model cannot be trained.";
   const GraphNodeAssignment* a = static_cast<const GraphNodeAssignment*>(assignment);
 
   // Perform gradient descent
-  SimpleFeaturesMap affected_features;  // Gradient for each affected feature.
-  affected_features.set_empty_key(GraphFeature(-1, -1, -1));
-  affected_features.set_deleted_key(GraphFeature(-2, -2, -2));
-
-  Uint64FactorFeaturesMap factor_affected_features;
-
-  for (size_t i = 0; i < a->assignments_.size(); ++i) {
-    if (a->assignments_[i].must_infer) {
-      std::vector<int> candidates;
-      a->GetLabelCandidates(*this, i, &candidates, beam_size_);
-
-      // Compute estimated normalisation constant
-      double normalization_constant = -a->GetNodePenalty(i);
-      candidates.push_back(a->assignments_[i].label);
-      for (const int label : candidates) {
-        normalization_constant += exp(a->GetNodeScoreGivenAssignmentToANode(*this, i, i, label));
-      }
-      for (int label : candidates) {
-        double marginal_probability = exp(a->GetNodeScoreGivenAssignmentToANode(*this, i, i, label)) / normalization_constant;
-        a->GetNeighboringAffectedFeatures(&affected_features, i, label, -learning_rate * marginal_probability);
-        a->GetFactorAffectedFeaturesOfNode(&factor_affected_features, i, label, -learning_rate * marginal_probability);
+  // Gradient for each affected feature, in the buffer of the thread when the gradients are merged.
+  std::unique_ptr<GradientBuffer> sample_gradients;
+  GradientBuffer* gradients;
+  if (FLAGS_gradient_merge_samples > 1) {
+    gradients = gradient_buffers_.GetForCurrentThread();
+  } else {
+    sample_gradients.reset(new GradientBuffer());
+    gradients = sample_gradients.get();
+  }
+  SimpleFeaturesMap& affected_features = gradients->features;
+  Uint64FactorFeaturesMap& factor_affected_features = gradients->factor_features;
+
+  DispatchScoringPolicy(*this, *a, [&](auto policy) {
+    std::vector<double> scores;
+    for (size_t i = 0; i < a->labels_.size(); ++i) {
+      if (a->must_infer_[i]) {
+        std::vector<int> candidates;
+        a->GetLabelCandidates(*this, i, &candidates, beam_size_);
+
+        // Compute estimated normalisation constant
+        double normalization_constant = -a->GetNodePenalty(i);
+        candidates.push_back(a->labels_[i]);
+        a->template GetNodeScoresForCandidates<decltype(policy)>(*this, i, candidates, &scores);
+        for (size_t j = 0; j < candidates.size(); ++j) {
+          scores[j] = exp(scores[j]);
+          normalization_constant += scores[j];
+        }
+        for (size_t j = 0; j < candidates.size(); ++j) {
+          double marginal_probability = scores[j] / normalization_constant;
+          a->GetNeighboringAffectedFeatures(&affected_features, i, candidates[j], -learning_rate * marginal_probability);
+          a->GetFactorAffectedFeaturesOfNode(&factor_affected_features, i, candidates[j], -learning_rate * marginal_probability);
+        }
       }
     }
-  }
+  });
 
   a->GetAffectedFeatures(&affected_features, beam_size_ * learning_rate);
   a->GetAffectedFactorFeatures(&factor_affected_features, beam_size_ * learning_rate);
-  for (auto it = affected_features.begin(); it != affected_features.end(); ++it) {
+  AddSampleGradients(gradients);
+}
+
+static std::atomic<uint64> next_gradient_buffers_id(1);
+
+// The buffer of the current thread and the id of the GradientBuffers it belongs to.
+static thread_local uint64 thread_gradient_buffers_id = 0;
+static thread_local GradientBuffer* thread_gradient_buffer = NULL;
+
+GradientBuffers::GradientBuffers() : id_(next_gradient_buffers_id++) {
+}
+
+GradientBuffer* GradientBuffers::GetForCurrentThread() {
+  if (thread_gradient_buffers_id == id_) return thread_gradient_buffer;
+  std::lock_guard<std::mutex> lock(mutex_);
+  buffers_.emplace_back(new GradientBuffer());
+  thread_gradient_buffers_id = id_;
+  thread_gradient_buffer = buffers_.back().get();
+  return thread_gradient_buffer;
+}
+
+void GradientBuffers::TakeAll(std::vector<std::unique_ptr<GradientBuffer> >* buffers) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  buffers->swap(buffers_);
+  buffers_.clear();
+  // The buffers the threads still point to are not theirs anymore.
+  id_ = next_gradient_buffers_id++;
+}
+
+// Applies the gradients once the buffer has those of --gradient_merge_samples samples or is full.
+void GraphInference::AddSampleGradients(GradientBuffer* gradients) {
+  ++gradients->num_samples;
+  if (gradients->num_samples < FLAGS_gradient_merge_samples &&
+      gradients->features.size() + gradients->factor_features.size() < kMaxBufferedGradients) {
+    return;
+  }
+  ApplyGradients(gradients);
+}
+
+void GraphInference::ApplyGradients(GradientBuffer* gradients) {
+  for (auto it = gradients->features.begin(); it != gradients->features.end(); ++it) {
     if (it->second < -1e-9 || it->second > 1e-9) {
-      auto features_it = features_.find(it->first);
-      if (features_it != features_.end()) {
-        features_it->second.atomicAddRegularized(it->second, 0, regularizer_);
-      }
+      AddToFeatureWeight(it->first, it->second);
     }
   }
-
-  for (auto f_feature = factor_affected_features.begin(); f_feature != factor_affected_features.end(); ++f_feature) {
+  for (auto f_feature = gradients->factor_features.begin(); f_feature != gradients->factor_features.end(); ++f_feature) {
     if (f_feature->second < -1e-9 || f_feature->second > 1e-9) {
-      auto factor_feature = factor_features_.find(f_feature->first);
-      if (factor_feature != factor_features_.end()) {
-        factor_feature->second += f_feature->second;
-        // L_inf regularize the new value.
-        if (factor_feature->second < 0) factor_feature->second = 0;
-        if (factor_feature->second > regularizer_) factor_feature->second = regularizer_;
-      }
+      AddToFactorWeight(f_feature->first, f_feature->second);
     }
   }
+  // Keeps the buckets, so that the buffer of a thread does not grow again after each merge.
+  gradients->features.clear_no_resize();
+  gradients->factor_features.clear();
+  gradients->num_samples = 0;
+}
+
+void GraphInference::SaveWeightSnapshot(WeightSnapshot* snapshot) const {
+  snapshot->generation = feature_tables_generation_;
+  snapshot->features.resize(features_.size());
+  std::vector<double>::iterator out = snapshot->features.begin();
+  for (auto it = features_.begin(); it != features_.end(); ++it) {
+    *out++ = it->second.getValue();
+  }
+  snapshot->factor_features.resize(factor_features_.size());
+  out = snapshot->factor_features.begin();
+  for (auto it = factor_features_.begin(); it != factor_features_.end(); ++it) {
+    *out++ = it->second.getValue();
+  }
+  snapshot->hashed_features.resize(hashed_weights_.size());
+  for (size_t i = 0; i < hashed_weights_.size(); ++i) {
+    snapshot->hashed_features[i] = hashed_weights_.GetEntry(i);
+  }
+}
+
+void GraphInference::RestoreWeightSnapshot(const WeightSnapshot& snapshot) {
+  CHECK_EQ(snapshot.generation, feature_tables_generation_) << "The feature tables were rebuilt since the snapshot.";
+  CHECK_EQ(snapshot.features.size(), features_.size()) << "The features changed since the snapshot.";
+  CHECK_EQ(snapshot.factor_features.size(), factor_features_.size()) << "The factors changed since the snapshot.";
+  CHECK_EQ(snapshot.hashed_features.size(), hashed_weights_.size());
+  std::vector<double>::const_iterator in = snapshot.features.begin();
+  for (auto it = features_.begin(); it != features_.end(); ++it) {
+    it->second.setValue(*in++);
+  }
+  in = snapshot.factor_features.begin();
+  for (auto it = factor_features_.begin(); it != factor_features_.end(); ++it) {
+    it->second.setValue(*in++);
+  }
+  for (size_t i = 0; i < hashed_weights_.size(); ++i) {
+    hashed_weights_.SetEntry(i, snapshot.hashed_features[i]);
+  }
+}
+
+void GraphInference::MergeGradientBuffers() {
+  std::vector<std::unique_ptr<GradientBuffer> > buffers;
+  gradient_buffers_.TakeAll(&buffers);
+  for (const auto& buffer : buffers) {
+    ApplyGradients(buffer.get());
+  }
+}
+
+// Without hashed weights, only the features seen in the training data are learned. Hashed weights have no
+// per-feature lookup, so every feature updates its entry of the table.
+void GraphInference::AddToFeatureWeight(const GraphFeature& feature, double gradient) {
+  if (hashed_weights_.IsEnabled()) {
+    hashed_weights_.AddRegularized(HashFeatureForTable(feature), gradient, regularizer_);
+    return;
+  }
+  auto features_it = features_.find(feature);
+  if (features_it != features_.end()) {
+    features_it->second.atomicAddRegularized(gradient, 0, regularizer_);
+  }
+}
+
+void GraphInference::AddToFactorWeight(uint64 hash, double gradient) {
+  auto factor_feature = factor_features_.find(hash);
+  if (factor_feature != factor_features_.end()) {
+    factor_feature->second.atomicAddRegularized(gradient, 0, regularizer_);
+  }
+}
+
+void GraphInference::HashFeatureWeights(int bits, bool sign_hash) {
+  CHECK(!IsFrozen()) << "The weights of a frozen model cannot be hashed.";
+  CHECK(bits >= 1 && bits <= 32) << "Unsupported number of bits for hashed weights: " << bits;
+  CHECK(!hashed_weights_.IsEnabled()) << "The feature weights are already hashed.";
+  ++feature_tables_generation_;
+  hashed_weights_ = HashedFeatureWeights(bits, sign_hash);
+  hashed_features_.reserve(features_.size());
+  for (auto it = features_.begin(); it != features_.end(); ++it) {
+    hashed_weights_.Add(HashFeatureForTable(it->first), it->second.getValue());
+    hashed_features_.push_back(it->first);
+  }
+  std::sort(hashed_features_.begin(), hashed_features_.end());
+  FeaturesMap empty_features;
+  empty_features.set_empty_key(features_.empty_key());
+  empty_features.set_deleted_key(features_.deleted_key());
+  features_.swap(empty_features);
+}
+
+template <class Callback>
+void GraphInference::ForEachFeatureWeight(const Callback& callback) const {
+  for (auto it = features_.begin(); it != features_.end(); ++it) {
+    callback(it->first, it->second.getValue());
+  }
+  for (const GraphFeature& feature : hashed_features_) {
+    callback(feature, hashed_weights_.Get(HashFeatureForTable(feature)));
+  }
 }
 
 void GraphInference::FillGraphProto(
@@ -1558,26 +2971,32 @@ void GraphInference::FillGraphProto(
     const Nice2Assignment* assignment,
     nice2protos::ShowGraphResponse* graph) const {
   const GraphNodeAssignment* a = static_cast<const GraphNodeAssignment*>(assignment);
-  for (size_t i = 0; i < a->assignments_.size(); ++i) {
-    if (a->assignments_[i].must_infer ||
+  std::vector<double> arc_scores;
+  DispatchScoringPolicy(*this, *a, [this, a, &arc_scores](auto policy) {
+    typename decltype(policy)::Weights weights(*this);
+    a->GetArcNodePairScores(&weights, &arc_scores);
+  });
+  for (size_t i = 0; i < a->labels_.size(); ++i) {
+    if (a->must_infer_[i] ||
         !a->query_->arcs_adjacent_to_node_[i].empty()) {
       // Include the node.
       auto *node = graph->add_nodes();
       node->set_id(i);
-      int label = a->assignments_[i].label;
+      int label = a->labels_[i];
       node->set_label(label < 0 ? StringPrintf("%d", label).c_str() : a->GetLabelName(label));
-      node->set_color(a->assignments_[i].must_infer ? "#6c9ba4" : "#96816a");
+      node->set_color(a->must_infer_[i] ? "#6c9ba4" : "#96816a");
     }
   }
   std::unordered_map<IntPair, std::string> dedup_arcs;
-  for (const GraphQuery::Arc& arc : a->query_->arcs_) {
+  for (size_t i = 0; i < a->query_->arcs_.size(); ++i) {
+    const GraphQuery::Arc& arc = a->query_->arcs_[i];
     std::string& s = dedup_arcs[IntPair(std::min(arc.node_a, arc.node_b),std::max(arc.node_a, arc.node_b))];
     if (!s.empty()) {
       s.append(", ");
     }
     StringAppendF(&s, "%s - %.2f",
                   a->GetLabelName(arc.type),
-                  a->GetNodePairScore(*this, arc.node_a, arc.node_b, a->assignments_[arc.node_a].label, a->assignments_[arc.node_b].label));
+                  arc_scores[i]);
   }
 
   int edge_id = 0;
@@ -1591,26 +3010,65 @@ void GraphInference::FillGraphProto(
   }
 }
 
-void GraphInference::AddQueryToModel(const nice2protos::Query &query) {
+void ModelCounts::MergeFrom(const ModelCounts& other) {
+  for (auto it = other.features.begin(); it != other.features.end(); ++it) {
+    features[it->first] += it->second;
+  }
+  for (auto it = other.label_frequency.begin(); it != other.label_frequency.end(); ++it) {
+    label_frequency[it->first] += it->second;
+  }
+  factors.insert(other.factors.begin(), other.factors.end());
+  for (auto it = other.factor_features.begin(); it != other.factor_features.end(); ++it) {
+    factor_features[it->first] += it->second;
+  }
+  num_queries += other.num_queries;
+}
+
+static std::atomic<uint64> next_thread_model_counts_id(1);
+
+// The counts of the current thread and the id of the ThreadModelCounts they belong to.
+static thread_local uint64 thread_model_counts_id = 0;
+static thread_local ModelCounts* thread_model_counts = NULL;
+
+ThreadModelCounts::ThreadModelCounts() : id_(next_thread_model_counts_id++) {
+}
+
+ModelCounts* ThreadModelCounts::GetForCurrentThread() {
+  if (thread_model_counts_id == id_) return thread_model_counts;
+  std::lock_guard<std::mutex> lock(mutex_);
+  counts_.emplace_back(new ModelCounts());
+  thread_model_counts_id = id_;
+  thread_model_counts = counts_.back().get();
+  return thread_model_counts;
+}
+
+void ThreadModelCounts::TakeAll(std::vector<std::unique_ptr<ModelCounts> >* counts) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  counts->swap(counts_);
+  counts_.clear();
+  id_ = next_thread_model_counts_id++;
+}
+
+// Counts the features of a query with the ids given to its strings by intern.
+template <class InternFn>
+static void CountFeatures(const nice2protos::Query& query, InternFn intern, ModelCounts* counts) {
   std::unordered_map<int, int> values;
   std::set<int> unique_values;
   for (const auto& a : query.node_assignments()) {
-    int value = strings_.addString(a.label().c_str());
+    int value = intern(a.label());
     values[a.node_index()] = value;
     unique_values.insert(value);
   }
   for (int value : unique_values) {
-    ++label_frequency_[value];
+    ++counts->label_frequency[value];
   }
 
   for (const auto& f : query.features()) {
     if (f.has_binary_relation()) {
-      GraphFeature feature(
-          FindWithDefault(values, f.binary_relation().first_node(), -1),
-          FindWithDefault(values, f.binary_relation().second_node(), -1),
-          strings_.addString(f.binary_relation().relation().c_str()));
-      if (feature.a_ != -1 && feature.b_ != -1) {
-        features_[feature].nonAtomicAdd(1);
+      int a = FindWithDefault(values, f.binary_relation().first_node(), -1);
+      int b = FindWithDefault(values, f.binary_relation().second_node(), -1);
+      if (a != -1 && b != -1) {
+        ++counts->features[GraphFeature(a, b, intern(f.binary_relation().relation()))];
       }
     }
 
@@ -1627,16 +3085,75 @@ void GraphInference::AddQueryToModel(const nice2protos::Query &query) {
         factor_vars.insert(value);
         hash += HashInt(value);
       }
-      if (factor_vars.empty()) {
+      if (factor_vars.empty() || hash == kEmptyFactorHash || hash == kDeletedFactorHash) {
         continue;
       }
-      factors_set_.insert(factor_vars);
-      factor_features_[hash] += 1;
+      counts->factors.insert(factor_vars);
+      ++counts->factor_features[hash];
     }
   }
+  ++counts->num_queries;
+}
+
+void GraphInference::AddQueryToModel(const nice2protos::Query &query) {
+  std::vector<std::unique_ptr<ModelCounts> > counts;
+  counts.emplace_back(new ModelCounts());
+  CountFeatures(query, [this](const std::string& s) { return strings_.addString(s.c_str()); }, counts.back().get());
+  AddModelCounts(&counts);
+}
+
+void GraphInference::StartCountingQueries() {
+  counting_strings_.reset(new ConcurrentStringSet());
+  counting_strings_->Reset(strings_);
+}
+
+void GraphInference::CountQueryFeatures(const nice2protos::Query& query, ModelCounts* counts) {
+  CHECK(counting_strings_ != NULL) << "StartCountingQueries was not called.";
+  ConcurrentStringSet* strings = counting_strings_.get();
+  CountFeatures(query, [strings](const std::string& s) { return strings->Add(s); }, counts);
+}
+
+void GraphInference::AddModelCounts(std::vector<std::unique_ptr<ModelCounts> >* counts) {
+  if (counting_strings_ != NULL) {
+    LOG(INFO) << "Adding " << counting_strings_->NumNewStrings() << " new labels and relations.";
+    counting_strings_->AddNewStringsTo(&strings_);
+    counting_strings_.reset();
+  }
+  if (counts->empty()) return;
+  ++feature_tables_generation_;
+  CHECK(!hashed_weights_.IsEnabled()) << "Queries cannot be added to a model with hashed weights.";
+  if (feature_filter_.SizeBytes() != 0 || factor_filter_.SizeBytes() != 0) {
+    // The filters would reject the new features until the next PrepareForInference.
+    feature_filter_ = BlockedBloomFilter();
+    factor_filter_ = BlockedBloomFilter();
+  }
+  // Merges the counts pairwise, halving their number in each round.
+  for (size_t num_counts = counts->size(); num_counts > 1; num_counts = (num_counts + 1) / 2) {
+    size_t half = num_counts / 2;
+    GetModelBuildingThreadPool()->ParallelFor(half, half - 1, [counts, num_counts](size_t i) {
+      (*counts)[i]->MergeFrom(*(*counts)[num_counts - 1 - i]);
+    });
+    counts->resize(num_counts - half);
+  }
+
+  const ModelCounts& merged = *counts->front();
+  label_frequency_.resize(strings_.numEntries(), 0);
+  for (auto it = merged.label_frequency.begin(); it != merged.label_frequency.end(); ++it) {
+    label_frequency_[strings_.denseId(it->first)] += it->second;
+  }
+  features_.resize(features_.size() + merged.features.size());
+  for (auto it = merged.features.begin(); it != merged.features.end(); ++it) {
+    features_[it->first].nonAtomicAdd(it->second);
+  }
+  factors_set_.insert(merged.factors.begin(), merged.factors.end());
+  for (auto it = merged.factor_features.begin(); it != merged.factor_features.end(); ++it) {
+    factor_features_[it->first].nonAtomicAdd(it->second);
+  }
+  counts->clear();
 }
 
 void GraphInference::PrepareForInference() {
+  CHECK(!IsFrozen()) << "A frozen model is already prepared for inference.";
   if (!FLAGS_unknown_label.empty()) {
     unknown_label_ = strings_.addString(FLAGS_unknown_label.c_str());
   }
@@ -1647,18 +3164,19 @@ void GraphInference::PrepareForInference() {
   }
   if (unknown_label_ >= 0 && FLAGS_min_freq_known_label > 0) {
     LOG(INFO) << "Replacing rare labels with unknown label " << FLAGS_unknown_label << " ...";
+    ++feature_tables_generation_;
     {
-      google::dense_hash_map<int, int> updated_freq;
-      updated_freq.set_empty_key(label_frequency_.empty_key());
-      updated_freq.set_deleted_key(label_frequency_.deleted_key());
-      for (auto it = label_frequency_.begin(); it != label_frequency_.end(); ++it) {
-        if (it->second >= FLAGS_min_freq_known_label) {
-          updated_freq[it->first] = it->second;
+      int num_labels = 0, num_removed_labels = 0;
+      for (int& frequency : label_frequency_) {
+        if (frequency == 0) continue;
+        ++num_labels;
+        if (frequency < FLAGS_min_freq_known_label) {
+          frequency = 0;
+          ++num_removed_labels;
         }
       }
-      LOG(INFO) << "Removed " << (label_frequency_.size() - updated_freq.size())
-                  << " low frequency labels out of " << label_frequency_.size() << " labels.";
-      label_frequency_.swap(updated_freq);
+      LOG(INFO) << "Removed " << num_removed_labels
+                  << " low frequency labels out of " << num_labels << " labels.";
     }
     {
       FeaturesMap updated_map;
@@ -1667,75 +3185,386 @@ void GraphInference::PrepareForInference() {
       for (auto it = features_.begin(); it != features_.end(); ++it) {
         GraphFeature f = it->first;
         double feature_weight = it->second.getValue();
-        if (label_frequency_.find(f.a_) == label_frequency_.end()) {
-          f.a_ = unknown_label_;
-        }
-        if (label_frequency_.find(f.b_) == label_frequency_.end()) {
-          f.b_ = unknown_label_;
-        }
+        ReplaceRareLabels(&f);
         updated_map[f].nonAtomicAdd(feature_weight);
       }
       LOG(INFO) << "Removed " << (features_.size() - updated_map.size())
                   << " out of " << features_.size() << " features.";
       features_.swap(updated_map);
     }
+    if (hashed_weights_.IsEnabled()) {
+      // As above, the features of removed labels are merged into features of the unknown label.
+      SimpleFeaturesMap unknown_label_weights;
+      unknown_label_weights.set_empty_key(GraphFeature(-1, -1, -1));
+      for (GraphFeature& f : hashed_features_) {
+        double feature_weight = hashed_weights_.Get(HashFeatureForTable(f));
+        ReplaceRareLabels(&f);
+        if (f.a_ == unknown_label_ || f.b_ == unknown_label_) {
+          unknown_label_weights[f] += feature_weight;
+        }
+      }
+      for (auto it = unknown_label_weights.begin(); it != unknown_label_weights.end(); ++it) {
+        hashed_weights_.Set(HashFeatureForTable(it->first), it->second);
+      }
+      size_t num_features = hashed_features_.size();
+      std::sort(hashed_features_.begin(), hashed_features_.end());
+      hashed_features_.erase(std::unique(hashed_features_.begin(), hashed_features_.end()), hashed_features_.end());
+      LOG(INFO) << "Removed " << (num_features - hashed_features_.size())
+                  << " out of " << num_features << " hashed features.";
+    }
   }
   num_svm_training_samples_ = 0;
 
 
-  best_features_for_type_.clear();
-  best_features_for_a_type_.clear();
-  best_features_for_b_type_.clear();
+  BuildCandidateLists();
+  BuildWeightFilters();
+  LOG(INFO) << "GraphInference prepared for MAP inference.";
+}
+
+void GraphInference::SetCandidateListThreads(int num_threads) {
+  CHECK_GE(num_threads, 1);
+  candidate_list_threads_ = num_threads;
+}
+
+void GraphInference::SetTraining(bool training) {
+  training_ = training;
+}
+
+size_t GraphInference::GetCandidateListBound() const {
+  if (FLAGS_candidate_list_size == 0 || (FLAGS_candidate_list_size < 0 && !training_)) return 0;
+  // No inference pass reads further than its beam.
+  return std::max<size_t>({static_cast<size_t>(std::max(FLAGS_candidate_list_size, 0)), kMaxPerArcBeamSize, kMaxPerNodeBeamSize,
+                           kLoopyBPBeamSize, kTreeInferenceBeamSize, static_cast<size_t>(std::max(beam_size_, 0))});
+}
+
+void GraphInference::BuildCandidateLists() {
+  FeatureCandidates().swap(best_features_for_type_);
+  type_candidate_ranges_.assign(strings_.numEntries(), CandidateRange());
+  best_features_for_a_type_.Clear();
+  best_features_for_b_type_.Clear();
   best_factor_features_first_level_.clear();
 
-  for (auto it = features_.begin(); it != features_.end(); ++it) {
-    const GraphFeature& f = it->first;
-    double feature_weight = it->second.getValue();
-    best_features_for_type_[f.type_].push_back(std::pair<double, GraphFeature>(feature_weight, f));
-    best_features_for_a_type_[IntPair(f.a_, f.type_)].push_back(std::pair<double, int>(feature_weight, f.b_));
-    best_features_for_b_type_[IntPair(f.b_, f.type_)].push_back(std::pair<double, int>(feature_weight, f.a_));
-  }
+  // The lists are laid out by counting their candidates first.
+  ForEachFeatureWeight([this](const GraphFeature& f, double) {
+    ++type_candidate_ranges_[strings_.denseId(f.type_)].end;
+    best_features_for_a_type_.Count(IntPair(f.a_, f.type_));
+    best_features_for_b_type_.Count(IntPair(f.b_, f.type_));
+  });
+  CHECK_LE(features_.size() + hashed_features_.size(), std::numeric_limits<uint32_t>::max())
+      << "Too many features for the candidate lists.";
+  uint32_t num_candidates = 0;
+  for (CandidateRange& range : type_candidate_ranges_) {
+    uint32_t size = range.end;
+    range.begin = range.end = num_candidates;
+    num_candidates += size;
+  }
+  best_features_for_type_.resize(num_candidates);
+  best_features_for_a_type_.Allocate();
+  best_features_for_b_type_.Allocate();
+  ForEachFeatureWeight([this](const GraphFeature& f, double feature_weight) {
+    best_features_for_type_[type_candidate_ranges_[strings_.denseId(f.type_)].end++] = FeatureCandidate(feature_weight, f);
+    best_features_for_a_type_.Add(IntPair(f.a_, f.type_), LabelCandidate(feature_weight, f.b_));
+    best_features_for_b_type_.Add(IntPair(f.b_, f.type_), LabelCandidate(feature_weight, f.a_));
+  });
   for (auto factor_feature = factors_set_.begin(); factor_feature != factors_set_.end(); ++factor_feature) {
     Factor f = *factor_feature;
     uint64 hash = 0;
     for (auto current_var = f.begin(); current_var != f.end(); ++current_var) {
       hash += HashInt(*current_var);
     }
-    double feature_weight = factor_features_[hash];
+    double feature_weight = FindWithDefault(factor_features_, hash, LockFreeWeights()).getValue();
     Factor visited_labels;
     std::shared_ptr<std::pair<double, Factor>> factor_feature_shared_pointer = std::make_shared<std::pair<double, Factor>>(feature_weight, f);
     best_factor_features_first_level_[f.size()].InsertFactorFeature(factor_feature_shared_pointer, f, 0, FLAGS_maximum_depth, -1, visited_labels, kFactorsLimitBeforeGoingDepperMultiLevelMap);
   }
 
   LOG(INFO) << "Preparing GraphInference for MAP inference...";
-  for (auto it = best_features_for_type_.begin(); it != best_features_for_type_.end(); ++it) {
-    std::sort(it->second.begin(), it->second.end(), std::greater<std::pair<double, GraphFeature> >());
+  candidate_list_bound_ = GetCandidateListBound();
+  int num_threads = candidate_list_threads_;
+  std::vector<CandidateRange*> type_ranges;
+  for (CandidateRange& range : type_candidate_ranges_) {
+    type_ranges.push_back(&range);
+  }
+  // There are few relation types, but their lists are long.
+  SortCandidateLists(type_ranges, candidate_list_bound_, 1, num_threads, &best_features_for_type_);
+  best_features_for_a_type_.Sort(candidate_list_bound_, num_threads);
+  best_features_for_b_type_.Sort(candidate_list_bound_, num_threads);
+  for (auto it = best_factor_features_first_level_.begin(); it != best_factor_features_first_level_.end(); ++it) {
+    it->second.SortFactorFeatures();
   }
-  for (auto it = best_features_for_a_type_.begin(); it != best_features_for_a_type_.end(); ++it) {
-    std::sort(it->second.begin(), it->second.end(), std::greater<std::pair<double, int> >());
+}
+
+void GraphInference::ReplaceRareLabels(GraphFeature* feature) const {
+  if (unknown_label_ < 0 || FLAGS_min_freq_known_label <= 0) return;
+  if (!IsKnownLabel(feature->a_)) {
+    feature->a_ = unknown_label_;
   }
-  for (auto it = best_features_for_b_type_.begin(); it != best_features_for_b_type_.end(); ++it) {
-    std::sort(it->second.begin(), it->second.end(), std::greater<std::pair<double, int> >());
+  if (!IsKnownLabel(feature->b_)) {
+    feature->b_ = unknown_label_;
   }
-  for (auto it = best_factor_features_first_level_.begin(); it != best_factor_features_first_level_.end(); ++it) {
-    it->second.SortFactorFeatures();
+}
+
+void GraphInference::BuildWeightFilters() {
+  size_t max_bytes = static_cast<size_t>(FLAGS_max_weight_filter_kb) * 1024;
+  // With lazy segments, the features are not known yet and each segment is a small table anyway. With hashed
+  // weights, every feature has a weight.
+  bool filter_features = lazy_segments_ == NULL && !hashed_weights_.IsEnabled() &&
+      features_.size() >= static_cast<size_t>(FLAGS_min_keys_for_weight_filter);
+  feature_filter_.Reset(features_.size(), filter_features ? FLAGS_weight_filter_bits_per_key : 0, max_bytes);
+  if (filter_features) {
+    for (auto it = features_.begin(); it != features_.end(); ++it) {
+      feature_filter_.Add(HashGraphFeature(it->first));
+    }
   }
-  LOG(INFO) << "GraphInference prepared for MAP inference.";
+  bool filter_factors = factor_features_.size() >= static_cast<size_t>(FLAGS_min_keys_for_weight_filter);
+  factor_filter_.Reset(factor_features_.size(), filter_factors ? FLAGS_weight_filter_bits_per_key : 0, max_bytes);
+  if (filter_factors) {
+    for (auto it = factor_features_.begin(); it != factor_features_.end(); ++it) {
+      factor_filter_.Add(it->first);
+    }
+  }
+  LOG(INFO) << "Weight Bloom filters use " << feature_filter_.SizeBytes() / 1024 << "KB for "
+      << features_.size() << " features and " << factor_filter_.SizeBytes() / 1024 << "KB for "
+      << factor_features_.size() << " factor features.";
+}
+
+void GraphInference::LogWeightFilterStats() const {
+  if (!FLAGS_weight_filter_stats) {
+    LOG(INFO) << "Weight lookups are not counted without --weight_filter_stats.";
+    return;
+  }
+  const WeightFilterStats& stats = weight_filter_stats_;
+  int64 probes = stats.probes.load();
+  int64 passed = probes - stats.filtered.load();
+  LOG(INFO) << "Weight lookups: " << probes << " probes, "
+      << StringPrintf("%.1f%%", probes == 0 ? 0.0 : 100.0 * stats.filtered.load() / probes)
+      << " rejected by the Bloom filters, "
+      << StringPrintf("%.1f%%", passed == 0 ? 0.0 : 100.0 * stats.false_positives.load() / passed)
+      << " of the remaining probes missed (false positives).";
+}
+
+// Quantizes the weights with a linear quantizer over their range. Zero weights are dropped, as for missing
+// features. The candidate lists built by PrepareForInference keep their own (full precision) copy.
+template <class Code>
+void GraphInference::FillQuantizedWeights(QuantizedWeights<Code>* weights) const {
+  const FeaturesMap& features = features_;
+  const FactorWeightsMap& factor_features = factor_features_;
+  double min_weight = 0, max_weight = 0;
+  for (auto it = features.begin(); it != features.end(); ++it) {
+    min_weight = std::min(min_weight, it->second.getValue());
+    max_weight = std::max(max_weight, it->second.getValue());
+  }
+  weights->feature_quantizer.SetRange(min_weight, max_weight);
+  size_t num_nonzero = 0;
+  for (auto it = features.begin(); it != features.end(); ++it) {
+    if (it->second.getValue() != 0) ++num_nonzero;
+  }
+  weights->features.Reset(num_nonzero);
+  for (auto it = features.begin(); it != features.end(); ++it) {
+    if (it->second.getValue() == 0) continue;
+    weights->features.Insert(it->first, HashFeatureForTable(it->first),
+        weights->feature_quantizer.Quantize(it->second.getValue()));
+  }
+
+  min_weight = 0;
+  max_weight = 0;
+  for (auto it = factor_features.begin(); it != factor_features.end(); ++it) {
+    min_weight = std::min(min_weight, it->second.getValue());
+    max_weight = std::max(max_weight, it->second.getValue());
+  }
+  weights->factor_quantizer.SetRange(min_weight, max_weight);
+  num_nonzero = 0;
+  for (auto it = factor_features.begin(); it != factor_features.end(); ++it) {
+    if (it->second.getValue() != 0) ++num_nonzero;
+  }
+  weights->factor_features.Reset(num_nonzero);
+  for (auto it = factor_features.begin(); it != factor_features.end(); ++it) {
+    if (it->second.getValue() == 0) continue;
+    weights->factor_features.Insert(it->first, HashFactorForTable(it->first),
+        weights->factor_quantizer.Quantize(it->second.getValue()));
+  }
+  LOG(INFO) << "Quantized " << weights->features.size() << " features (max error "
+      << weights->feature_quantizer.MaxError() << ") and " << weights->factor_features.size()
+      << " factor features (max error " << weights->factor_quantizer.MaxError() << ").";
+}
+
+void GraphInference::QuantizeWeights(int bits) {
+  CHECK(!IsFrozen()) << "The weights are already frozen or quantized.";
+  CHECK(!hashed_weights_.IsEnabled()) << "Hashed weights cannot be quantized.";
+  if (bits == 8) {
+    quantized_weights_8_.reset(new QuantizedWeights<uint8_t>());
+    FillQuantizedWeights(quantized_weights_8_.get());
+  } else if (bits == 16) {
+    quantized_weights_16_.reset(new QuantizedWeights<uint16_t>());
+    FillQuantizedWeights(quantized_weights_16_.get());
+  } else {
+    LOG(FATAL) << "Unsupported number of bits for quantized weights: " << bits;
+  }
+  ReleaseTrainingWeights();
+}
+
+void GraphInference::Freeze() {
+  if (IsFrozen()) return;
+  frozen_weights_.reset(new FrozenWeights());
+  // Hashed weights stay in their table.
+  if (!hashed_weights_.IsEnabled()) {
+    frozen_weights_->features.resize(features_.size());
+    for (auto it = features_.begin(); it != features_.end(); ++it) {
+      frozen_weights_->features[it->first] = it->second.getValue();
+    }
+  }
+  for (auto it = factor_features_.begin(); it != factor_features_.end(); ++it) {
+    frozen_weights_->factor_features[it->first] = it->second.getValue();
+  }
+  ReleaseTrainingWeights();
+}
+
+bool GraphInference::IsFrozen() const {
+  return frozen_weights_ != NULL || GetQuantizedWeightBits() != 0;
+}
+
+void GraphInference::ReleaseTrainingWeights() {
+  ++feature_tables_generation_;
+  FeaturesMap empty_features;
+  empty_features.set_empty_key(features_.empty_key());
+  empty_features.set_deleted_key(features_.deleted_key());
+  features_.swap(empty_features);
+  std::vector<GraphFeature>().swap(hashed_features_);
+  FactorWeightsMap empty_factor_features;
+  empty_factor_features.set_empty_key(kEmptyFactorHash);
+  empty_factor_features.set_deleted_key(kDeletedFactorHash);
+  factor_features_.swap(empty_factor_features);
+  // The factors are only needed to save the model and to build the candidate lists in PrepareForInference.
+  std::set<Factor>().swap(factors_set_);
+}
+
+void GraphInference::AddFeatureCounts(
+    const Nice2Query* query, const Nice2Assignment* assignment, FeatureCounts* counts) const {
+  const GraphNodeAssignment* a = static_cast<const GraphNodeAssignment*>(assignment);
+  for (const GraphQuery::Arc& arc : a->query_->arcs_) {
+    GraphFeature feature(a->labels_[arc.node_a], a->labels_[arc.node_b], arc.type);
+    if (features_.find(feature) != features_.end()) {
+      ++(*counts)[feature];
+    }
+  }
+}
+
+void GraphInference::PruneModel(const ModelPruningOptions& options, const FeatureCounts* counts) {
+  CHECK(!IsFrozen()) << "A frozen model cannot be pruned.";
+  CHECK(!hashed_weights_.IsEnabled()) << "A model with hashed weights has a fixed size.";
+  CHECK(options.min_feature_count <= 0 || counts != NULL) << "Pruning by frequency needs feature counts.";
+  ++feature_tables_generation_;
+
+  // The smallest absolute weight of a feature kept for each (label, relation).
+  std::unordered_map<IntPair, double> min_weight_per_label_relation;
+  if (options.max_features_per_label_relation > 0) {
+    std::unordered_map<IntPair, std::vector<double> > weights_per_label_relation;
+    for (auto it = features_.begin(); it != features_.end(); ++it) {
+      double weight = fabs(it->second.getValue());
+      weights_per_label_relation[IntPair(it->first.a_, it->first.type_)].push_back(weight);
+      weights_per_label_relation[IntPair(it->first.b_, it->first.type_)].push_back(weight);
+    }
+    size_t k = options.max_features_per_label_relation;
+    for (auto it = weights_per_label_relation.begin(); it != weights_per_label_relation.end(); ++it) {
+      std::vector<double>& weights = it->second;
+      if (weights.size() <= k) continue;
+      std::nth_element(weights.begin(), weights.begin() + (k - 1), weights.end(), std::greater<double>());
+      min_weight_per_label_relation[it->first] = weights[k - 1];
+    }
+  }
+
+  FeaturesMap pruned_features;
+  pruned_features.set_empty_key(features_.empty_key());
+  pruned_features.set_deleted_key(features_.deleted_key());
+  for (auto it = features_.begin(); it != features_.end(); ++it) {
+    const GraphFeature& f = it->first;
+    double weight = fabs(it->second.getValue());
+    if (weight < options.min_abs_weight) continue;
+    if (options.min_feature_count > 0 && FindWithDefault(*counts, f, 0) < options.min_feature_count) continue;
+    if (options.max_features_per_label_relation > 0 &&
+        weight < FindWithDefault(min_weight_per_label_relation, IntPair(f.a_, f.type_), 0.0) &&
+        weight < FindWithDefault(min_weight_per_label_relation, IntPair(f.b_, f.type_), 0.0)) continue;
+    pruned_features[f].setValue(it->second.getValue());
+  }
+  LOG(INFO) << "Pruned " << (features_.size() - pruned_features.size()) << " out of "
+      << features_.size() << " features.";
+  features_.swap(pruned_features);
+
+  size_t num_factor_features = factors_set_.size();
+  for (auto f = factors_set_.begin(); f != factors_set_.end(); ) {
+    uint64 hash = 0;
+    for (auto var = f->begin(); var != f->end(); ++var) {
+      hash += HashInt(*var);
+    }
+    auto factor_feature = factor_features_.find(hash);
+    if (factor_feature == factor_features_.end() ||
+        fabs(factor_feature->second.getValue()) < options.min_abs_weight) {
+      if (factor_feature != factor_features_.end()) factor_features_.erase(factor_feature);
+      f = factors_set_.erase(f);
+    } else {
+      ++f;
+    }
+  }
+  LOG(INFO) << "Pruned " << (num_factor_features - factors_set_.size()) << " out of "
+      << num_factor_features << " factor features.";
+
+  PrepareForInference();
+}
+
+int GraphInference::GetQuantizedWeightBits() const {
+  if (quantized_weights_8_ != NULL) return 8;
+  if (quantized_weights_16_ != NULL) return 16;
+  return 0;
+}
+
+
+template <class Key, class Value, class Hash, class Equal, class Alloc>
+static size_t GetHashMapMemoryBytes(const google::dense_hash_map<Key, Value, Hash, Equal, Alloc>& map) {
+  return map.bucket_count() * sizeof(typename google::dense_hash_map<Key, Value, Hash, Equal, Alloc>::value_type);
+}
+
+template <class Key, class Value>
+static size_t GetHashMapMemoryBytes(const std::unordered_map<Key, Value>& map) {
+  // One node with a next pointer per entry and one pointer per bucket.
+  return map.size() * (sizeof(typename std::unordered_map<Key, Value>::value_type) + sizeof(void*)) +
+      map.bucket_count() * sizeof(void*);
+}
+
+size_t GraphInference::GetWeightsMemoryBytes() const {
+  if (quantized_weights_8_ != NULL) {
+    return quantized_weights_8_->features.MemoryBytes() + quantized_weights_8_->factor_features.MemoryBytes();
+  }
+  if (quantized_weights_16_ != NULL) {
+    return quantized_weights_16_->features.MemoryBytes() + quantized_weights_16_->factor_features.MemoryBytes();
+  }
+  size_t hashed_bytes = hashed_weights_.size() * sizeof(LockFreeWeights) +
+      hashed_features_.capacity() * sizeof(GraphFeature);
+  if (frozen_weights_ != NULL) {
+    size_t bytes = hashed_bytes + GetHashMapMemoryBytes(frozen_weights_->features) +
+        GetHashMapMemoryBytes(frozen_weights_->factor_features);
+    if (lazy_segments_ != NULL) {
+      for (size_t index = 0; index < lazy_segments_->offsets.size(); ++index) {
+        const RelationSegment* segment = lazy_segments_->segments[index].load(std::memory_order_acquire);
+        if (segment != NULL) bytes += GetHashMapMemoryBytes(segment->features);
+      }
+    }
+    return bytes;
+  }
+  return hashed_bytes + GetHashMapMemoryBytes(features_) + GetHashMapMemoryBytes(factor_features_);
 }
 
 void GraphInference::PrintDebugInfo() {
   NBest<int, double> best_connected_labels;
   std::unordered_map<int, NBest<int, double> > best_connections_per_label;
   std::unordered_map<IntPair, NBest<int, double> > best_connections_per_label_type;
-  for (auto it = features_.begin(); it != features_.end(); ++it) {
-    double score = it->second.getValue();
-    best_connected_labels.AddScoreToItem(it->first.a_, score);
-    best_connected_labels.AddScoreToItem(it->first.b_, score);
-    best_connections_per_label[it->first.a_].AddScoreToItem(it->first.type_, score);
-    best_connections_per_label[it->first.b_].AddScoreToItem(it->first.type_, score);
-    best_connections_per_label_type[IntPair(it->first.a_, it->first.type_)].AddScoreToItem(it->first.b_, score);
-    best_connections_per_label_type[IntPair(it->first.b_, it->first.type_)].AddScoreToItem(it->first.a_, score);
-  }
+  ForEachFeatureWeight([&](const GraphFeature& f, double score) {
+    best_connected_labels.AddScoreToItem(f.a_, score);
+    best_connected_labels.AddScoreToItem(f.b_, score);
+    best_connections_per_label[f.a_].AddScoreToItem(f.type_, score);
+    best_connections_per_label[f.b_].AddScoreToItem(f.type_, score);
+    best_connections_per_label_type[IntPair(f.a_, f.type_)].AddScoreToItem(f.b_, score);
+    best_connections_per_label_type[IntPair(f.b_, f.type_)].AddScoreToItem(f.a_, score);
+  });
 
   printf("Best connected labels\n");
   for (auto v : best_connected_labels.produce_nbest(96)) {
@@ -1761,7 +3590,7 @@ void GraphInference::PrintConfusionStatistics(
   std::map<std::vector<GraphQuery::Arc>, std::vector<int> > nodes_per_confusion;
 
   for (int node_id = 0; node_id < static_cast<int>(q->arcs_adjacent_to_node_.size()); ++node_id) {
-    if (!a->assignments_[node_id].must_infer) continue;
+    if (!a->must_infer_[node_id]) continue;
     std::vector<GraphQuery::Arc> arcs(q->arcs_adjacent_to_node_[node_id]);
     for (size_t i = 0; i < arcs.size(); ++i) {
       if (arcs[i].node_a == node_id) arcs[i].node_a = -1;
@@ -1786,15 +3615,15 @@ void GraphInference::PrintConfusionStatistics(
 
     std::string labels;
     for (size_t i = 0; i < nodes.size(); ++i) {
-      int label = a->assignments_[nodes[i]].label;
+      int label = a->labels_[nodes[i]];
       if (!labels.empty()) labels.append(" ");
       labels.append(a->GetLabelName(label));
     }
     std::string predicted_by;
     for (size_t i = 0; i < arcs.size(); ++i) {
       if (!predicted_by.empty()) predicted_by.append(", ");
-      const char* label_a = (arcs[i].node_a == -1) ? ("<X>") : a->GetLabelName(a->assignments_[arcs[i].node_a].label);
-      const char* label_b = (arcs[i].node_b == -1) ? ("<X>") : a->GetLabelName(a->assignments_[arcs[i].node_b].label);
+      const char* label_a = (arcs[i].node_a == -1) ? ("<X>") : a->GetLabelName(a->labels_[arcs[i].node_a]);
+      const char* label_b = (arcs[i].node_b == -1) ? ("<X>") : a->GetLabelName(a->labels_[arcs[i].node_b]);
       const char* arc = a->label_set_->ss()->getString(arcs[i].type);
       StringAppendF(&predicted_by, "%s[%s %s]", arc, label_a, label_b);
     }
@@ -17,18 +17,27 @@
 #ifndef N2_INFERENCE_GRAPH_INFERENCE_H_
 #define N2_INFERENCE_GRAPH_INFERENCE_H_
 
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <stdint.h>
 #include <unordered_map>
 #include <google/dense_hash_map>
 #include <string.h>
 #include <iterator>
 
 #include "base/base.h"
+#include "base/bloom_filter.h"
+#include "base/concurrent_stringset.h"
+#include "base/huge_pages.h"
 #include "base/maputil.h"
 #include "base/stringset.h"
 
+#include "hashed_feature_weights.h"
 #include "inference.h"
 #include "label_checker.h"
 #include "lock_free_weight.h"
+#include "weight_quantizer.h"
 
 typedef std::multiset<int> Factor;
 
@@ -154,6 +163,267 @@ namespace std {
   };
 }
 
+// The regions the large model tables are allocated in (on huge pages when available, see base/huge_pages.h).
+struct FeatureTableRegion {
+  static HugePageRegion& Get();
+};
+struct ServingWeightsRegion {
+  static HugePageRegion& Get();
+};
+struct CandidateListRegion {
+  static HugePageRegion& Get();
+};
+
+// A dense_hash_map from features allocated in the HugePageRegion Region::Get().
+template <class Value, class Region>
+struct HugePageFeaturesMap {
+  typedef google::dense_hash_map<GraphFeature, Value, std::hash<GraphFeature>, std::equal_to<GraphFeature>,
+      HugePageAllocator<std::pair<const GraphFeature, Value>, Region> > Type;
+};
+
+// A feature with its weight, and a label with the weight of the feature it comes from.
+typedef std::pair<double, GraphFeature> FeatureCandidate;
+typedef std::pair<double, int> LabelCandidate;
+
+// Candidate lists are stored one after the other in one array per kind, so that they share the (huge) pages
+// of one allocation.
+typedef std::vector<FeatureCandidate, HugePageAllocator<FeatureCandidate, CandidateListRegion> > FeatureCandidates;
+typedef std::vector<LabelCandidate, HugePageAllocator<LabelCandidate, CandidateListRegion> > LabelCandidates;
+
+// The position of one candidate list in its array.
+struct CandidateRange {
+  CandidateRange() : begin(0), end(0) {}
+
+  uint32_t begin;
+  uint32_t end;
+};
+
+// A read-only view of a candidate list, best first. Valid until the lists are rebuilt.
+template <class T>
+class CandidateSpan {
+public:
+  CandidateSpan() : begin_(NULL), end_(NULL) {}
+  CandidateSpan(const T* begin, const T* end) : begin_(begin), end_(end) {}
+
+  const T* begin() const { return begin_; }
+  const T* end() const { return end_; }
+  size_t size() const { return end_ - begin_; }
+  bool empty() const { return begin_ == end_; }
+  const T& operator[](size_t i) const { return begin_[i]; }
+
+private:
+  const T* begin_;
+  const T* end_;
+};
+
+// Lists of candidate labels keyed by (label, relation type), stored in one array. They are built in three
+// steps: Count each candidate, then Allocate, then Add each counted candidate. Sort then orders the lists.
+class LabelCandidateLists {
+public:
+  LabelCandidateLists();
+
+  void Clear();
+  void Count(const IntPair& key);
+  void Allocate();
+  void Add(const IntPair& key, const LabelCandidate& candidate);
+  // Sorts the lists best first with up to num_threads threads. With a positive max_size, only the max_size best
+  // candidates of each list are kept and the lists are moved together.
+  void Sort(size_t max_size, int num_threads);
+
+  CandidateSpan<LabelCandidate> Get(const IntPair& key) const;
+  size_t MemoryBytes() const;
+
+private:
+  LabelCandidates candidates_;
+  google::dense_hash_map<IntPair, CandidateRange> ranges_;
+  // The keys in the order of their lists in candidates_.
+  std::vector<IntPair> keys_;
+};
+
+// Read-only weights for serving, quantized to integer codes of type Code. The tables are probed with
+// HashFeatureForTable and HashFactorForTable (see graph_inference.cpp).
+template <class Code>
+struct QuantizedWeights {
+  // No feature or factor of a model has the empty keys (see kEmptyFactorHash).
+  QuantizedWeights() : features(GraphFeature(-1, -1, -1)), factor_features(~0ULL) {}
+
+  WeightQuantizer<Code> feature_quantizer;
+  WeightQuantizer<Code> factor_quantizer;
+  // Features with a zero weight are not stored.
+  QuantizedWeightTable<GraphFeature, Code, HugePageAllocator<char, ServingWeightsRegion> > features;
+  QuantizedWeightTable<uint64, Code, HugePageAllocator<char, ServingWeightsRegion> > factor_features;
+};
+
+// Which features PruneModel removes. The default options keep all features.
+struct ModelPruningOptions {
+  ModelPruningOptions() : min_abs_weight(0), min_feature_count(0), max_features_per_label_relation(0) {}
+
+  // Features and factor features with a smaller absolute weight are removed.
+  double min_abs_weight;
+  // Features seen fewer times in the counted data are removed. Does not apply to factor features, which are
+  // not counted.
+  int min_feature_count;
+  // If positive, a feature is kept only if it is among the features with the largest absolute weight for the
+  // (label, relation) at one of its ends. Does not apply to factor features, which have no relation.
+  int max_features_per_label_relation;
+};
+
+// Read-only full precision weights of a frozen model.
+struct FrozenWeights {
+  FrozenWeights() {
+    features.set_empty_key(GraphFeature(-1, -1, -1));
+    features.set_deleted_key(GraphFeature(-2, -2, -2));
+  }
+
+  typedef HugePageFeaturesMap<double, ServingWeightsRegion>::Type FeaturesMap;
+  FeaturesMap features;
+  std::unordered_map<uint64, double> factor_features;
+};
+
+// Outcome of the weight lookups: probes rejected by the Bloom filters and probes of missing weights that
+// passed them.
+struct WeightFilterStats {
+  WeightFilterStats() : probes(0), filtered(0), false_positives(0) {}
+
+  std::atomic<int64> probes;
+  std::atomic<int64> filtered;
+  std::atomic<int64> false_positives;
+};
+
+// The features of one relation type of a model loaded with lazy segments, with the candidate lists
+// PrepareForInference builds for them.
+struct RelationSegment {
+  RelationSegment() {
+    features.set_empty_key(GraphFeature(-1, -1, -1));
+    features.set_deleted_key(GraphFeature(-2, -2, -2));
+  }
+
+  FrozenWeights::FeaturesMap features;
+  FeatureCandidates candidates;
+  // For a label at end a (resp. b) of the features, the labels at the other end, best first.
+  LabelCandidateLists best_features_for_a, best_features_for_b;
+};
+
+// Where the features of each relation type are in the features file of a model, and the segments read from it
+// so far. Each segment is read once, on first use, and never changes afterwards.
+struct LazyRelationSegments {
+  LazyRelationSegments() : num_loaded(0), num_loaded_features(0) {}
+  ~LazyRelationSegments();
+
+  std::string features_file;
+  // The segment of each relation type, indexed by the dense id of the type. -1 for types without features.
+  std::vector<int> segment_of_type;
+  // The following are indexed by segment.
+  std::vector<int64> offsets;
+  std::vector<int> num_features;
+  std::unique_ptr<std::atomic<const RelationSegment*>[]> segments;
+  // Held while the segment is read, so that threads that need different segments read them concurrently.
+  std::unique_ptr<std::mutex[]> mutexes;
+  std::atomic<int> num_loaded;
+  std::atomic<int64> num_loaded_features;
+};
+
+// The weights of a model in the iteration order of its tables, to revert a training pass without copying the
+// model.
+struct WeightSnapshot {
+  WeightSnapshot() : generation(-1) {}
+  // The generation of the feature tables the weights were taken from.
+  int64 generation;
+  std::vector<double> features;
+  std::vector<double> factor_features;
+  std::vector<double> hashed_features;
+};
+
+// The gradients of the samples a training thread has processed since they were last applied to the weights
+// (see --gradient_merge_samples).
+struct GradientBuffer {
+  GradientBuffer() : num_samples(0) {
+    features.set_empty_key(GraphFeature(-1, -1, -1));
+    features.set_deleted_key(GraphFeature(-2, -2, -2));
+  }
+
+  // The buffers of different threads are separate allocations; the padding keeps the fields their threads
+  // write off the cache lines of neighbouring allocations.
+  char padding_before[64];
+  google::dense_hash_map<GraphFeature, double> features;
+  std::unordered_map<uint64, double> factor_features;
+  int num_samples;
+  char padding_after[64];
+};
+
+// The gradient buffers of the training threads of a model, one per thread.
+class GradientBuffers {
+public:
+  GradientBuffers();
+
+  // The buffer of the calling thread, created on first use.
+  GradientBuffer* GetForCurrentThread();
+  // Moves out all buffers. Threads that call GetForCurrentThread afterwards get a new buffer.
+  void TakeAll(std::vector<std::unique_ptr<GradientBuffer> >* buffers);
+
+private:
+  std::atomic<uint64> id_;
+  std::mutex mutex_;
+  std::vector<std::unique_ptr<GradientBuffer> > buffers_;
+
+  GradientBuffers(const GradientBuffers&) = delete;
+  GradientBuffers& operator=(const GradientBuffers&) = delete;
+};
+
+// The features, factors and label frequencies of training queries before they are added to a model. Each
+// thread that builds a model counts its queries separately (see GraphInference::CountQueryFeatures).
+struct ModelCounts {
+  ModelCounts() : num_queries(0) {
+    features.set_empty_key(GraphFeature(-1, -1, -1));
+  }
+  void MergeFrom(const ModelCounts& other);
+
+  google::dense_hash_map<GraphFeature, int> features;
+  // The number of queries with a label, keyed by the index of the label in the strings of the model.
+  std::unordered_map<int, int> label_frequency;
+  std::set<Factor> factors;
+  std::unordered_map<uint64, int> factor_features;
+  int num_queries;
+};
+
+// The counts of the threads that count queries for a model, like GradientBuffers for gradients.
+class ThreadModelCounts {
+public:
+  ThreadModelCounts();
+
+  // The counts of the calling thread, created on first use.
+  ModelCounts* GetForCurrentThread();
+  // Moves out all counts. Threads that call GetForCurrentThread afterwards get new counts.
+  void TakeAll(std::vector<std::unique_ptr<ModelCounts> >* counts);
+
+private:
+  std::atomic<uint64> id_;
+  std::mutex mutex_;
+  std::vector<std::unique_ptr<ModelCounts> > counts_;
+
+  ThreadModelCounts(const ThreadModelCounts&) = delete;
+  ThreadModelCounts& operator=(const ThreadModelCounts&) = delete;
+};
+
+// A training query with its labels and relations replaced by their ids in a model and its features in flat
+// arrays, to build the query and its assignment again without parsing or string lookups.
+struct CompactQuery {
+  int num_nodes;
+  // The node_a, node_b and type of each arc, sorted.
+  std::vector<int> arcs;
+  // The nodes of scope i are scope_nodes[scope_offsets[i]] to scope_nodes[scope_offsets[i + 1] - 1], the same
+  // for factors.
+  std::vector<int> scope_offsets, scope_nodes;
+  std::vector<int> factor_offsets, factor_nodes;
+  // The arcs adjacent to node i, as indices in arcs, are adjacent_arcs[adjacent_offsets[i]] to
+  // adjacent_arcs[adjacent_offsets[i + 1] - 1], so that the queries are built without sorting them again.
+  std::vector<int> adjacent_offsets, adjacent_arcs;
+  // The node, label and whether the label is given of each assignment. A label -1 - i is unknown_labels[i],
+  // a label that is not in the model.
+  std::vector<int> assignments;
+  std::vector<std::string> unknown_labels;
+};
+
 class GraphNodeAssignment;
 
 class GraphInference : public Nice2Inference {
@@ -163,9 +433,18 @@ public:
 
   virtual void LoadModel(const std::string& file_prefix) override;
   virtual void SaveModel(const std::string& file_prefix) override;
+  // Loads a model for inference only, without the features of any relation type. The features of a relation
+  // type are read from the model files on first use. The model is frozen. Falls back to LoadModel for models
+  // saved without a segment index.
+  void LoadModelWithLazySegments(const std::string& file_prefix);
 
   virtual Nice2Query* CreateQuery() const override;
   virtual Nice2Assignment* CreateAssignment(Nice2Query* query) const override;
+  // Converts a training query for the CreateQuery and CreateAssignment below. The ids in the CompactQuery are
+  // valid as long as no strings of the model are removed, i.e. until the next LoadModel.
+  void ToCompactQuery(const nice2protos::Query& query, CompactQuery* compact) const;
+  Nice2Query* CreateQuery(const CompactQuery& compact) const;
+  Nice2Assignment* CreateAssignment(Nice2Query* query, const CompactQuery& compact) const;
 
   virtual void MapInference(
       const Nice2Query* query,
@@ -193,6 +472,16 @@ public:
       double learning_rate,
       PrecisionStats* stats) override;
 
+  // Copies the weights to a snapshot. The snapshot is in the iteration order of the feature tables, so it can
+  // only be restored while they are not rebuilt, i.e. with no AddQueryToModel, AddModelCounts,
+  // PrepareForInference, HashFeatureWeights, PruneModel or model load in between. Restoring checks this.
+  void SaveWeightSnapshot(WeightSnapshot* snapshot) const;
+  void RestoreWeightSnapshot(const WeightSnapshot& snapshot);
+
+  // Applies the gradients buffered by the training threads with --gradient_merge_samples. Must be called
+  // when no thread is training, e.g. at the end of each pass.
+  void MergeGradientBuffers();
+
   // This method executes a training based on the optimization of the pseudolikelihood
   virtual void PLLearn(
       const Nice2Query* query,
@@ -200,7 +489,18 @@ public:
       double learning_rate) override;
 
   virtual void AddQueryToModel(const nice2protos::Query &query) override;
+  // Counts the features of a training query without adding them to the model. Threads can count different
+  // queries concurrently, each into its own counts, after StartCountingQueries.
+  void StartCountingQueries();
+  void CountQueryFeatures(const nice2protos::Query& query, ModelCounts* counts);
+  // Merges the counts of the threads in parallel and adds them to the model. Clears counts.
+  void AddModelCounts(std::vector<std::unique_ptr<ModelCounts> >* counts);
   virtual void PrepareForInference() override;
+  // The number of threads PrepareForInference sorts the candidate lists with (1 by default).
+  void SetCandidateListThreads(int num_threads);
+  // Whether the model is being trained. Training rebuilds the candidate lists after each pass, so they are then
+  // bounded by default (see --candidate_list_size).
+  void SetTraining(bool training);
 
   virtual void FillGraphProto(
       const Nice2Query* query,
@@ -209,6 +509,39 @@ public:
 
   void PrintDebugInfo();
 
+  // Replaces the feature and factor weights by weights quantized to 8 or 16 bits, which the inference runs on
+  // directly. This is for serving only: the model cannot be trained or saved afterwards.
+  void QuantizeWeights(int bits);
+  // Returns 0 if the weights are not quantized.
+  int GetQuantizedWeightBits() const;
+  // Keeps the feature weights in a table of 2^bits entries indexed by a hash of the feature instead of one
+  // weight per feature (the current weights are added to the table). Only the keys of the features seen in
+  // the training data are kept, to build the candidate lists. Hashed weights are saved with the model.
+  void HashFeatureWeights(int bits, bool sign_hash);
+  // Returns 0 if the feature weights are not hashed.
+  int GetFeatureHashBits() const {
+    return hashed_weights_.bits();
+  }
+  const WeightFilterStats& GetWeightFilterStats() const {
+    return weight_filter_stats_;
+  }
+  // Logs the size and the hit rates of the weight Bloom filters.
+  void LogWeightFilterStats() const;
+  // Moves the weights to plain read-only structures and releases the state only needed for training.
+  // Quantized models are frozen by QuantizeWeights.
+  void Freeze();
+  bool IsFrozen() const;
+  // The approximate memory used by the feature and factor weights.
+  size_t GetWeightsMemoryBytes() const;
+  // Logs how many relation types were loaded by a model with lazy segments.
+  void LogLazySegmentStats() const;
+
+  typedef std::unordered_map<GraphFeature, int> FeatureCounts;
+  // Counts the features of the model that occur in the query with the labels of the assignment.
+  void AddFeatureCounts(const Nice2Query* query, const Nice2Assignment* assignment, FeatureCounts* counts) const;
+  // Removes features of a trained model. The counts are only needed for options.min_feature_count.
+  void PruneModel(const ModelPruningOptions& options, const FeatureCounts* counts);
+
   void PrintConfusionStatistics(
       const Nice2Query* query,
       const Nice2Assignment* assignment,
@@ -218,32 +551,104 @@ public:
 
 private:
   friend class GraphNodeAssignment;
-  friend class LoopyBPInference;
+  template <class Policy> friend class LoopyBPInference;
+  template <class Policy> friend class TreeInference;
+  friend class FullPrecisionWeights;
+  template <class Code> friend class QuantizedWeightsReader;
+  friend class FrozenWeightsReader;
+  friend class FilteredWeightProbes;
 
   void PerformAssignmentOptimization(GraphNodeAssignment* a) const;
-
-  typedef google::dense_hash_map<GraphFeature, LockFreeWeights> FeaturesMap;
+  // Runs the optimization passes with the scoring kernels specialized for a ScoringPolicy, one connected
+  // component of the query at a time.
+  template <class Policy>
+  void RunOptimizationPasses(GraphNodeAssignment* a) const;
+  template <class Policy>
+  void OptimizeComponent(GraphNodeAssignment* a, int component_index) const;
+
+  typedef HugePageFeaturesMap<LockFreeWeights, FeatureTableRegion>::Type FeaturesMap;
   typedef google::dense_hash_map<GraphFeature, double> SimpleFeaturesMap;
   typedef std::unordered_map<uint64, double> Uint64FactorFeaturesMap;
+  // Keyed by the hash of the labels of a factor. All keys are added before training, so the concurrent updates
+  // of the training threads only change the (atomic) weights and never rehash the table.
+  typedef google::dense_hash_map<uint64, LockFreeWeights> FactorWeightsMap;
   // std::unordered_map<GraphFeature, double> features_;
   FeaturesMap features_;
   std::set<Factor> factors_set_;
-  Uint64FactorFeaturesMap factor_features_;
-
-  //google::dense_hash_map<IntPair, std::vector<std::pair<double, int> > > best_features_for_a_type_, best_features_for_b_type_;
-  std::unordered_map<IntPair, std::vector<std::pair<double, int> > > best_features_for_a_type_, best_features_for_b_type_;
+  FactorWeightsMap factor_features_;
+  void AddToFactorWeight(uint64 hash, double gradient);
+  GradientBuffers gradient_buffers_;
+  void AddSampleGradients(GradientBuffer* gradients);
+  void ApplyGradients(GradientBuffer* gradients);
+  // Set by HashFeatureWeights. features_ is empty then and hashed_features_ has its keys, sorted.
+  HashedFeatureWeights hashed_weights_;
+  std::vector<GraphFeature> hashed_features_;
+  void AddToFeatureWeight(const GraphFeature& feature, double gradient);
+  // Calls callback(feature, weight) for each feature of the model, hashed or not.
+  template <class Callback>
+  void ForEachFeatureWeight(const Callback& callback) const;
+
+  // Set after Freeze or QuantizeWeights, features_ and factor_features_ are empty then. Shared by the copies
+  // of the model.
+  std::shared_ptr<FrozenWeights> frozen_weights_;
+  std::shared_ptr<QuantizedWeights<uint8_t> > quantized_weights_8_;
+  std::shared_ptr<QuantizedWeights<uint16_t> > quantized_weights_16_;
+  void ReleaseTrainingWeights();
+
+  // Built by PrepareForInference from the keys of features_ and factor_features_, and consulted before every
+  // weight lookup.
+  BlockedBloomFilter feature_filter_;
+  BlockedBloomFilter factor_filter_;
+  mutable WeightFilterStats weight_filter_stats_;
+  void BuildWeightFilters();
+  // Set by LoadModelWithLazySegments. Shared by the copies of the model.
+  std::shared_ptr<LazyRelationSegments> lazy_segments_;
+  const RelationSegment& GetRelationSegment(int type) const;
+  const RelationSegment* ReadRelationSegment(int type, int segment_index) const;
+  void ReadModelFiles(const std::string& file_prefix, bool with_features);
+  template <class Code>
+  void FillQuantizedWeights(QuantizedWeights<Code>* weights) const;
+
+  LabelCandidateLists best_features_for_a_type_, best_features_for_b_type_;
 
   google::dense_hash_map<int, FactorFeaturesLevel> best_factor_features_first_level_;
 
-  google::dense_hash_map<int, std::vector<std::pair<double, GraphFeature> > > best_features_for_type_;
-  google::dense_hash_map<int, int> label_frequency_;
+  // Per-label and per-relation tables are flat arrays indexed by the dense id of the string in strings_.
+  // The candidates of all relation types, by type, and the range of each type.
+  FeatureCandidates best_features_for_type_;
+  std::vector<CandidateRange> type_candidate_ranges_;
+  std::vector<int> label_frequency_;  // Zero for labels that are not known.
+  CandidateSpan<FeatureCandidate> GetBestFeaturesForType(int type) const;
+  // The labels at the other end of the features with the given label at end a (resp. b) and type, best first.
+  CandidateSpan<LabelCandidate> GetBestFeaturesForAType(int label, int type) const;
+  CandidateSpan<LabelCandidate> GetBestFeaturesForBType(int label, int type) const;
+  // Builds the candidate lists above and the factor candidates from the current weights.
+  void BuildCandidateLists();
+  // The number of candidates kept per list, zero if the lists are kept whole (see --candidate_list_size).
+  size_t GetCandidateListBound() const;
+  // Replaces the labels removed by PrepareForInference with the unknown label.
+  void ReplaceRareLabels(GraphFeature* feature) const;
+  bool IsKnownLabel(int label) const;
   int unknown_label_;
   StringSet strings_;
+  // The labels and relations of the queries counted since StartCountingQueries, added to strings_ by
+  // AddModelCounts.
+  std::shared_ptr<ConcurrentStringSet> counting_strings_;
   LabelChecker label_checker_;
   double regularizer_;
   double svm_margin_;
   int beam_size_;
   int num_svm_training_samples_;
+  // The bound of the candidate lists when they were last built.
+  size_t candidate_list_bound_;
+  int candidate_list_threads_;
+  bool training_;
+  // Incremented whenever the feature tables are rebuilt, which invalidates the weight snapshots.
+  int64 feature_tables_generation_;
+
+  // The label checker refers to strings_, and the training state is per model.
+  GraphInference(const GraphInference&) = delete;
+  GraphInference& operator=(const GraphInference&) = delete;
 };
 
 
@@ -0,0 +1,98 @@
+/*
+   Copyright 2014 Software Reliability Lab, ETH Zurich
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ */
+
+#ifndef INFERENCE_HASHED_FEATURE_WEIGHTS_H_
+#define INFERENCE_HASHED_FEATURE_WEIGHTS_H_
+
+#include <stddef.h>
+#include <vector>
+
+#include "base/base.h"
+#include "lock_free_weight.h"
+
+// Feature weights in a table of 2^bits entries indexed by a hash of the feature (the hashing trick), so that
+// the memory of the weights does not grow with the number of features. Features with the same index share
+// a weight. With a sign hash, half of the features use the negated weight, so collisions cancel out on
+// average instead of adding up.
+class HashedFeatureWeights {
+public:
+  // A disabled table.
+  HashedFeatureWeights() : bits_(0), sign_mask_(0) {}
+  HashedFeatureWeights(int bits, bool sign_hash)
+      : bits_(bits), sign_mask_(sign_hash ? 1 : 0), weights_(static_cast<size_t>(1) << bits) {
+  }
+  HashedFeatureWeights(const HashedFeatureWeights& o) = default;
+  HashedFeatureWeights& operator=(const HashedFeatureWeights& o) {
+    HashedFeatureWeights copy(o);
+    bits_ = copy.bits_;
+    sign_mask_ = copy.sign_mask_;
+    weights_.swap(copy.weights_);
+    return *this;
+  }
+
+  bool IsEnabled() const {
+    return bits_ != 0;
+  }
+  int bits() const {
+    return bits_;
+  }
+  bool sign_hash() const {
+    return sign_mask_ != 0;
+  }
+  size_t size() const {
+    return weights_.size();
+  }
+
+  // The hashes must be well mixed: the index uses their upper bits and the sign their lowest bit.
+  double Get(uint64 hash) const {
+    return Sign(hash) * weights_[Index(hash)].getValue();
+  }
+  void Set(uint64 hash, double value) {
+    weights_[Index(hash)].setValue(Sign(hash) * value);
+  }
+  void Add(uint64 hash, double value) {
+    weights_[Index(hash)].atomicAdd(Sign(hash) * value);
+  }
+  // Adds to the weight of a feature and clamps it to [0, max] like the weights of the feature maps (a negated
+  // entry is clamped to [-max, 0]).
+  void AddRegularized(uint64 hash, double value, double max) {
+    double sign = Sign(hash);
+    weights_[Index(hash)].atomicAddRegularized(sign * value, sign > 0 ? 0 : -max, sign > 0 ? max : 0);
+  }
+
+  // The stored entries, to save and load the table.
+  double GetEntry(size_t index) const {
+    return weights_[index].getValue();
+  }
+  void SetEntry(size_t index, double value) {
+    weights_[index].setValue(value);
+  }
+
+private:
+  size_t Index(uint64 hash) const {
+    return static_cast<size_t>(hash >> (64 - bits_));
+  }
+  double Sign(uint64 hash) const {
+    return 1.0 - 2.0 * static_cast<double>(hash & sign_mask_);
+  }
+
+  int bits_;
+  uint64 sign_mask_;
+  std::vector<LockFreeWeights> weights_;
+};
+
+
+#endif /* INFERENCE_HASHED_FEATURE_WEIGHTS_H_ */
@@ -74,7 +74,7 @@ public:
   virtual void FillInferResponse(nice2protos::InferResponse* response) const = 0;
 
   virtual void GetNBestCandidates(
-      Nice2Inference* inference,
+      const Nice2Inference* inference,
       const int n,
       nice2protos::NBestResponse* response) = 0;
 
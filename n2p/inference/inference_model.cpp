@@ -0,0 +1,47 @@
+/*
+   Copyright 2014 Software Reliability Lab, ETH Zurich
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ */
+
+#include "inference_model.h"
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+
+DEFINE_bool(lazy_model_segments, false,
+    "Whether to load the features of each relation type of the model on first use instead of at startup.");
+DECLARE_bool(huge_pages);
+
+InferenceModel::InferenceModel(std::unique_ptr<GraphInference> inference) {
+  CHECK(inference != NULL);
+  inference->Freeze();
+  inference_.reset(inference.release());
+}
+
+std::unique_ptr<InferenceModel> InferenceModel::Load(const std::string& file_prefix, int weight_bits) {
+  SetHugePagesEnabled(FLAGS_huge_pages);
+  std::unique_ptr<GraphInference> inference(new GraphInference());
+  if (FLAGS_lazy_model_segments && weight_bits == 0) {
+    inference->LoadModelWithLazySegments(file_prefix);
+  } else {
+    LOG_IF(WARNING, FLAGS_lazy_model_segments) << "Quantized weights need all features, loading the whole model.";
+    inference->LoadModel(file_prefix);
+    if (weight_bits != 0) {
+      inference->QuantizeWeights(weight_bits);
+    }
+  }
+  std::unique_ptr<InferenceModel> model(new InferenceModel(std::move(inference)));
+  LOG(INFO) << "Model memory by page backing:\n" << HugePageRegion::AllRegionsToString();
+  return model;
+}
@@ -0,0 +1,80 @@
+/*
+   Copyright 2014 Software Reliability Lab, ETH Zurich
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ */
+
+#ifndef N2_INFERENCE_INFERENCE_MODEL_H_
+#define N2_INFERENCE_INFERENCE_MODEL_H_
+
+#include <memory>
+#include <string>
+
+#include "graph_inference.h"
+
+// A trained model for serving. It only has const methods, so it can be used by any number of threads at once.
+// The weights are plain (or quantized) values in read-only structures, without the state used for training.
+class InferenceModel {
+public:
+  // Freezes a trained model.
+  explicit InferenceModel(std::unique_ptr<GraphInference> inference);
+
+  // Loads a model saved by GraphInference::SaveModel. If weight_bits is 8 or 16, the weights are quantized
+  // to this many bits. Otherwise, with --lazy_model_segments, the features of each relation type are loaded
+  // on first use.
+  static std::unique_ptr<InferenceModel> Load(const std::string& file_prefix, int weight_bits = 0);
+
+  Nice2Query* CreateQuery() const {
+    return inference_->CreateQuery();
+  }
+  Nice2Assignment* CreateAssignment(Nice2Query* query) const {
+    return inference_->CreateAssignment(query);
+  }
+
+  void MapInference(const Nice2Query* query, Nice2Assignment* assignment) const {
+    inference_->MapInference(query, assignment);
+  }
+
+  double GetAssignmentScore(const Nice2Assignment* assignment) const {
+    return inference_->GetAssignmentScore(assignment);
+  }
+
+  void GetNBestCandidates(Nice2Assignment* assignment, int n, nice2protos::NBestResponse* response) const {
+    assignment->GetNBestCandidates(inference_.get(), n, response);
+  }
+
+  void FillGraphProto(
+      const Nice2Query* query,
+      const Nice2Assignment* assignment,
+      nice2protos::ShowGraphResponse* graph) const {
+    inference_->FillGraphProto(query, assignment, graph);
+  }
+
+  int GetQuantizedWeightBits() const {
+    return inference_->GetQuantizedWeightBits();
+  }
+  size_t GetWeightsMemoryBytes() const {
+    return inference_->GetWeightsMemoryBytes();
+  }
+  void LogWeightFilterStats() const {
+    inference_->LogWeightFilterStats();
+  }
+  void LogLazySegmentStats() const {
+    inference_->LogLazySegmentStats();
+  }
+
+private:
+  std::unique_ptr<const GraphInference> inference_;
+};
+
+#endif /* N2_INFERENCE_INFERENCE_MODEL_H_ */
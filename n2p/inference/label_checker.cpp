@@ -9,14 +9,13 @@
 #include "label_checker.h"
 
 #include <stdlib.h>
+#include <string.h>
 #include <regex>
 #include <fstream>
 
 #include <glog/logging.h>
 
-LabelChecker::LabelChecker() : is_loaded_(false) {
-  valid_labels_.set_empty_key(-1);
-  valid_labels_.set_deleted_key(-2);
+LabelChecker::LabelChecker() : ss_(NULL), is_loaded_(false) {
 }
 
 LabelChecker::~LabelChecker() {
@@ -59,6 +58,8 @@ void LabelChecker::LoadRules(const std::string& filename) {
 void LabelChecker::ApplyRulesOnAllValuesInSS(const StringSet* ss) {
   std::vector<int> strings;
   ss->getAllStrings(&strings);
+  ss_ = ss;
+  valid_labels_.assign(ss->numEntries(), false);
 
   for (const CheckingRule& rule : rules_) {
     if (IsRegEx(rule.re_str_.c_str())) {
@@ -67,14 +68,14 @@ void LabelChecker::ApplyRulesOnAllValuesInSS(const StringSet* ss) {
         const char* strbegin = ss->getString(label);
         const char* strend = strbegin + strlen(strbegin);
         if (std::regex_match(strbegin, strend, rule.re_)) {
-          valid_labels_[label] = rule.valid_;
+          valid_labels_[ss->denseId(label)] = rule.valid_;
         }
       }
     } else {
       // Process as a single label.
       int label = ss->findString(rule.re_str_.c_str());
       if (label >= 0) {
-        valid_labels_[label] = rule.valid_;
+        valid_labels_[ss->denseId(label)] = rule.valid_;
       }
     }
   }
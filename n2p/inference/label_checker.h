@@ -9,8 +9,7 @@
 #define INFERENCE_LABEL_CHECKER_H_
 
 #include <regex>
-
-#include "google/dense_hash_map"
+#include <vector>
 
 #include "base/stringset.h"
 #include "base/maputil.h"
@@ -30,7 +29,9 @@ public:
 
   // Returns if a label is valid.
   bool IsLabelValid(int label) const {
-    return FindWithDefault(valid_labels_, label, false);
+    if (ss_ == NULL) return false;
+    int id = ss_->denseId(label);
+    return id >= 0 && static_cast<size_t>(id) < valid_labels_.size() && valid_labels_[id];
   }
 
   bool IsStringLabelValid(const char* s) const;
@@ -50,7 +51,9 @@ private:
 
   std::vector<CheckingRule> rules_;
 
-  google::dense_hash_map<int, bool> valid_labels_;
+  // Indexed by the dense id of the label in ss_.
+  std::vector<bool> valid_labels_;
+  const StringSet* ss_;
   bool is_loaded_;
 };
 
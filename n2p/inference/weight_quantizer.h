@@ -0,0 +1,110 @@
+/*
+   Copyright 2014 Software Reliability Lab, ETH Zurich
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ */
+
+#ifndef INFERENCE_WEIGHT_QUANTIZER_H_
+#define INFERENCE_WEIGHT_QUANTIZER_H_
+
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <limits>
+#include <memory>
+#include <vector>
+
+// Maps weights in a range [min, max] linearly to integer codes of type Code (e.g. uint8_t or uint16_t).
+template <class Code>
+class WeightQuantizer {
+public:
+  WeightQuantizer() : min_(0), scale_(0) {}
+
+  void SetRange(double min, double max) {
+    min_ = min;
+    scale_ = (max > min) ? (max - min) / std::numeric_limits<Code>::max() : 0;
+  }
+
+  Code Quantize(double value) const {
+    if (scale_ == 0) return 0;
+    double code = floor((value - min_) / scale_ + 0.5);
+    if (code < 0) return 0;
+    if (code > std::numeric_limits<Code>::max()) return std::numeric_limits<Code>::max();
+    return static_cast<Code>(code);
+  }
+
+  double Dequantize(Code code) const {
+    return min_ + code * scale_;
+  }
+
+  // The largest difference between a weight in the range and its dequantized value.
+  double MaxError() const {
+    return scale_ / 2;
+  }
+
+private:
+  double min_;
+  double scale_;
+};
+
+// A read-only open addressing table from keys to quantized codes. The codes are kept in an array of their own,
+// indexed by the slot of the key, so that an entry takes sizeof(Key) + sizeof(Code) bytes instead of a padded
+// pair. Callers pass a well mixed hash of each key, its low bits select the first slot of the linear probing.
+template <class Key, class Code, class Alloc = std::allocator<char> >
+class QuantizedWeightTable {
+public:
+  explicit QuantizedWeightTable(const Key& empty_key) : empty_key_(empty_key), mask_(0), size_(0) {}
+
+  // Clears the table and sizes it for up to num_keys inserts, at a load of at most 3/4.
+  void Reset(size_t num_keys) {
+    size_t num_slots = 1;
+    while (num_slots * 3 < num_keys * 4 + 1) num_slots *= 2;
+    KeyVector(num_slots, empty_key_).swap(keys_);
+    CodeVector(num_slots, 0).swap(codes_);
+    mask_ = num_slots - 1;
+    size_ = 0;
+  }
+
+  // The key must not be in the table and must differ from the empty key.
+  void Insert(const Key& key, uint64_t hash, Code code) {
+    size_t slot = hash & mask_;
+    while (!(keys_[slot] == empty_key_)) slot = (slot + 1) & mask_;
+    keys_[slot] = key;
+    codes_[slot] = code;
+    ++size_;
+  }
+
+  // Returns NULL if the key is not in the table.
+  const Code* Find(const Key& key, uint64_t hash) const {
+    if (keys_.empty()) return NULL;
+    for (size_t slot = hash & mask_;; slot = (slot + 1) & mask_) {
+      if (keys_[slot] == key) return &codes_[slot];
+      if (keys_[slot] == empty_key_) return NULL;
+    }
+  }
+
+  size_t size() const { return size_; }
+  size_t MemoryBytes() const { return keys_.size() * (sizeof(Key) + sizeof(Code)); }
+
+private:
+  typedef std::vector<Key, typename Alloc::template rebind<Key>::other> KeyVector;
+  typedef std::vector<Code, typename Alloc::template rebind<Code>::other> CodeVector;
+
+  Key empty_key_;
+  KeyVector keys_;
+  CodeVector codes_;
+  size_t mask_;
+  size_t size_;
+};
+
+#endif /* INFERENCE_WEIGHT_QUANTIZER_H_ */
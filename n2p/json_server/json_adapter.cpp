@@ -66,21 +66,24 @@ int JsonValueNumberer::size() const {
 
 Query JsonAdapter::JsonToQuery(const Json::Value &json_query) {
   Query query;
+  JsonToQuery(json_query, &query);
+  return query;
+}
+
+void JsonAdapter::JsonToQuery(const Json::Value &json_query, Query* query) {
+  query->Clear();
   CHECK(json_query["query"].isArray());
   for (const Json::Value& arc : json_query["query"]) {
     if (arc.isMember("f2")) {
       // A factor connecting two facts (an arc).
-      auto *feature = query.add_features();
-      auto *bin_relation = new Feature::BinaryRelation;
+      auto *bin_relation = query->add_features()->mutable_binary_relation();
       bin_relation->set_first_node(numberer_.ValueToNumber(arc["a"]));
       bin_relation->set_second_node(numberer_.ValueToNumber(arc["b"]));
       bin_relation->set_relation(arc["f2"].asCString());
-      feature->set_allocated_binary_relation(bin_relation);
     }
     if (arc.isMember("cn")) {
       // A scope that lists names that cannot be assigned to the same value.
-      auto *feature = query.add_features();
-      auto *constraint = new Feature::InequalityConstraint;
+      auto *constraint = query->add_features()->mutable_constraint();
       const Json::Value& v = arc["n"];
       if (v.isArray()) {
         std::vector<int> scope_vars;
@@ -94,23 +97,20 @@ Query JsonAdapter::JsonToQuery(const Json::Value &json_query) {
           constraint->add_nodes(scope_var);
         }
       }
-      feature->set_allocated_constraint(constraint);
     }
     if (arc.isMember("group")) {
       const Json::Value& v = arc["group"];
       if (v.isArray()) {
-        auto *feature = query.add_features();
-        auto *factor_var = new Feature::FactorVariable;
+        auto *factor_var = query->add_features()->mutable_factor_variables();
         for (const Json::Value &item : v) {
           factor_var->add_nodes(numberer_.ValueToNumber(item));
         }
-        feature->set_allocated_factor_variables(factor_var);
       }
     }
   }
 
   for (const Json::Value& a : json_query["assign"]) {
-    auto *assignment = query.add_node_assignments();
+    auto *assignment = query->add_node_assignments();
     if (a.isMember("inf")) {
       assignment->set_label(a["inf"].asCString());
       assignment->set_given(false);
@@ -124,7 +124,6 @@ Query JsonAdapter::JsonToQuery(const Json::Value &json_query) {
       assignment->set_node_index(static_cast<uint32_t>(number));
     }
   }
-  return query;
 }
 
 Json::Value JsonAdapter::InferResponseToJson(const InferResponse &response) {
@@ -146,7 +145,7 @@ NBestQuery JsonAdapter::JsonToNBestQuery(const Json::Value &json_query) {
   NBestQuery query;
   query.set_n(json_query["n"].asInt());
   query.set_should_infer(json_query.isMember("infer") && json_query["infer"].asBool());
-  query.set_allocated_query(new Query(JsonToQuery(json_query)));
+  JsonToQuery(json_query, query.mutable_query());
   return query;
   }
 
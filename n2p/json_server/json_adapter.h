@@ -29,6 +29,8 @@ class JsonValueNumberer {
 class JsonAdapter {
  public:
   nice2protos::Query JsonToQuery(const Json::Value &json_query);
+  // Same as above, but fills query, reusing its memory.
+  void JsonToQuery(const Json::Value &json_query, nice2protos::Query* query);
   Json::Value InferResponseToJson(const nice2protos::InferResponse &response);
 
   nice2protos::NBestQuery JsonToNBestQuery(const Json::Value &json_query);
@@ -7,7 +7,7 @@
 #include <gflags/gflags.h>
 #include <glog/logging.h>
 
-#include "n2p/inference/graph_inference.h"
+#include "n2p/inference/inference_model.h"
 
 #include "nice2service_internal.h"
 
@@ -20,48 +20,49 @@ using nice2protos::InferResponse;
 using nice2protos::NBestResponse;
 using nice2protos::ShowGraphResponse;
 
+DEFINE_int32(serving_weight_bits, 0, "If set to 8 or 16, serves the model with weights quantized to this many bits.");
 
 // Logic and data behind the server's behavior.
 Nice2ServiceInternal::Nice2ServiceInternal(const string &model_path, const string &logfile_prefix) {
-  inference_.LoadModel(model_path);
+  model_ = InferenceModel::Load(model_path, FLAGS_serving_weight_bits);
   if (!logfile_prefix.empty()) {
     logging_.reset(new Nice2ServerLog(logfile_prefix));
   }
 }
 
 InferResponse Nice2ServiceInternal::Infer(const Query &request) {
-  std::unique_ptr<Nice2Query> query(inference_.CreateQuery());
+  std::unique_ptr<Nice2Query> query(model_->CreateQuery());
   query->FromFeaturesQueryProto(request.features());
-  std::unique_ptr<Nice2Assignment> assignment(inference_.CreateAssignment(query.get()));
+  std::unique_ptr<Nice2Assignment> assignment(model_->CreateAssignment(query.get()));
   assignment->FromNodeAssignmentsProto(request.node_assignments());
-  inference_.MapInference(query.get(), assignment.get());
+  model_->MapInference(query.get(), assignment.get());
   InferResponse response;
   assignment->FillInferResponse(&response);
   return response;
 }
 
 nice2protos::NBestResponse Nice2ServiceInternal::NBest(const nice2protos::NBestQuery &request) {
-  std::unique_ptr<Nice2Query> query(inference_.CreateQuery());
+  std::unique_ptr<Nice2Query> query(model_->CreateQuery());
   query->FromFeaturesQueryProto(request.query().features());
-  std::unique_ptr<Nice2Assignment> assignment(inference_.CreateAssignment(query.get()));
+  std::unique_ptr<Nice2Assignment> assignment(model_->CreateAssignment(query.get()));
   assignment->FromNodeAssignmentsProto(request.query().node_assignments());
   if (request.should_infer()) {
-    inference_.MapInference(query.get(), assignment.get());
+    model_->MapInference(query.get(), assignment.get());
   }
   NBestResponse response;
-  assignment->GetNBestCandidates(&inference_, request.n(), &response);
+  model_->GetNBestCandidates(assignment.get(), request.n(), &response);
   return response;
 }
 
 nice2protos::ShowGraphResponse Nice2ServiceInternal::ShowGraph(const nice2protos::ShowGraphQuery &request) {
-  std::unique_ptr<Nice2Query> query(inference_.CreateQuery());
+  std::unique_ptr<Nice2Query> query(model_->CreateQuery());
   query->FromFeaturesQueryProto(request.query().features());
-  std::unique_ptr<Nice2Assignment> assignment(inference_.CreateAssignment(query.get()));
+  std::unique_ptr<Nice2Assignment> assignment(model_->CreateAssignment(query.get()));
   assignment->FromNodeAssignmentsProto(request.query().node_assignments());
   if (request.should_infer()) {
-    inference_.MapInference(query.get(), assignment.get());
+    model_->MapInference(query.get(), assignment.get());
   }
   ShowGraphResponse response;
-  inference_.FillGraphProto(query.get(), assignment.get(), &response);
+  model_->FillGraphProto(query.get(), assignment.get(), &response);
   return response;
 }
@@ -5,7 +5,7 @@
 #ifndef NICE2PREDICT_NICE2SERVICEINTERNAL_H
 #define NICE2PREDICT_NICE2SERVICEINTERNAL_H
 
-#include "n2p/inference/graph_inference.h"
+#include "n2p/inference/inference_model.h"
 #include "n2p/protos/service.pb.h"
 
 #include "server_log.h"
@@ -22,7 +22,7 @@ class Nice2ServiceInternal {
   nice2protos::ShowGraphResponse ShowGraph(const nice2protos::ShowGraphQuery &request);
 
  private:
-  GraphInference inference_;
+  std::unique_ptr<InferenceModel> model_;
   std::unique_ptr<Nice2ServerLog> logging_;
 };
 
@@ -14,135 +14,21 @@
    limitations under the License.
  */
 
-#include <string>
-#include <fstream>
-#include <functional>
-#include <mutex>
-#include <thread>
-
 #include <gflags/gflags.h>
 #include <glog/logging.h>
 
-#include "json/json.h"
-
-#include "base/base.h"
-#include "base/readerutil.h"
-#include "base/stringprintf.h"
-#include "n2p/inference/graph_inference.h"
-#include "n2p/json_server/json_adapter.h"
-
-using nice2protos::Query;
+#include "eval_internal.h"
 
 DEFINE_string(model, "model", "File prefix for model to evaluate.");
-DEFINE_int32(num_threads, 8, "Number of threads to use.");
-
 DEFINE_string(single_input, "", "A file with single JSON input to evaluate.");
-DEFINE_string(input, "testdata", "Input file with JSON objects used for evaluation.");
 DEFINE_bool(debug_stats, false, "If specifies, only outputs debug stats of a trained model.");
-DEFINE_string(output_errors, "", "If set, will output the label errors done by the system.");
-
-typedef std::function<void(const Query& query)> InputProcessor;
-
-void ProcessLinesParallel(InputRecordReader<std::string>* reader, InputProcessor proc, JsonAdapter &adapter) {
-  std::string line;
-  Json::Reader jsonreader;
-  while (!reader->ReachedEnd()) {
-    std::string line;
-    reader->Read(&line);
-    if (line.empty()) continue;
-    Json::Value v;
-    if (!jsonreader.parse(line, v, false)) {
-      LOG(ERROR) << "Could not parse input: " << jsonreader.getFormattedErrorMessages() << "\n" << line;
-    } else {
-      proc(adapter.JsonToQuery(v));
-    }
-  }
-}
-void ParallelForeachInput(RecordInput<std::string>* input, InputProcessor proc, JsonAdapter &adapter) {
-  // Do parallel ForEach
-  std::unique_ptr<InputRecordReader<std::string>> reader(input->CreateReader());
-  std::vector<std::thread> threads;
-  for (int i = 0; i < FLAGS_num_threads; ++i) {
-    threads.push_back(std::thread(std::bind(&ProcessLinesParallel, reader.get(), proc, adapter)));
-  }
-  for (auto& thread : threads){
-    thread.join();
-  }
-}
-
-void PrintLabelErrorStatsSummary(const SingleLabelErrorStats* stats) {
-  if (stats == nullptr) return;
-  LOG(INFO) << "Counting classification errors...";
-  std::vector<std::pair<int, std::string> > best_stats;
-  for (auto it = stats->errors_and_counts.begin(); it != stats->errors_and_counts.end(); ++it) {
-    best_stats.push_back(std::pair<int, std::string>(it->second, it->first));
-  }
-  std::sort(best_stats.begin(), best_stats.end(), std::greater<std::pair<int, std::string> >());
-
-  std::string summary = "Top classification errors done by label (expected -> predicted):";
-  for (size_t i = 0; i < 32 && i < best_stats.size(); ++i) {
-    StringAppendF(&summary, "\n%8d : %s", best_stats[i].first, best_stats[i].second.c_str());
-  }
-  LOG(INFO) << summary;
-}
-
-SingleLabelErrorStats* CreateLabelErrorStats() {
-  if (FLAGS_output_errors.empty()) return nullptr;
-  if (FLAGS_output_errors == "-")
-    LOG(INFO) << "Will perform label error evaluation that will LOG the top errors.";
-  else
-    LOG(INFO) << "Will perform evaluation that will output to " << FLAGS_output_errors;
-  return new SingleLabelErrorStats();
-}
-
-void OutputLabelErrorStats(const SingleLabelErrorStats* stats) {
-  if (stats == nullptr) return;
-  if (FLAGS_output_errors == "-") return;
-  LOG(INFO) << "Outputting error stats to " << FLAGS_output_errors << "...";
-
-  std::vector<std::pair<int, std::string> > best_stats;
-  for (auto it = stats->errors_and_counts.begin(); it != stats->errors_and_counts.end(); ++it) {
-    best_stats.push_back(std::pair<int, std::string>(it->second, it->first));
-  }
-  std::sort(best_stats.begin(), best_stats.end(), std::greater<std::pair<int, std::string> >());
-  FILE* f = fopen(FLAGS_output_errors.c_str(), "wt");
-  for (size_t i = 0; i < best_stats.size(); ++i) {
-    fprintf(f, "%8d : %s\n", best_stats[i].first, best_stats[i].second.c_str());
-  }
-  fclose(f);
-  LOG(INFO) << "Error stats written.";
-}
-
-void Evaluate(RecordInput<std::string>* evaluation_data, GraphInference* inference,
-    PrecisionStats* total_stats, SingleLabelErrorStats* error_stats, JsonAdapter &adapter) {
-  LOG(INFO) << "Evaluating...";
-  int64 start_time = GetCurrentTimeMicros();
-  PrecisionStats stats;
-  ParallelForeachInput(evaluation_data, [&inference,&stats,error_stats](const Query& query) {
-    std::unique_ptr<Nice2Query> q(inference->CreateQuery());
-    q->FromFeaturesQueryProto(query.features());
-    std::unique_ptr<Nice2Assignment> a(inference->CreateAssignment(q.get()));
-    a->FromNodeAssignmentsProto(query.node_assignments());
-    std::unique_ptr<Nice2Assignment> refa(inference->CreateAssignment(q.get()));
-    refa->FromNodeAssignmentsProto(query.node_assignments());
-
-    a->ClearInferredAssignment();
-    inference->MapInference(q.get(), a.get());
-    a->CompareAssignments(refa.get(), &stats);
-    if (error_stats != nullptr)
-      a->CompareAssignmentErrors(refa.get(), error_stats);
-  }, adapter);
-  int64 end_time = GetCurrentTimeMicros();
-  LOG(INFO) << "Evaluation pass took " << (end_time - start_time) / 1000 << "ms.";
-
-
-  LOG(INFO) << "Correct " << stats.correct_labels << " vs " << stats.incorrect_labels << " incorrect labels";
-  double error_rate = stats.incorrect_labels / (static_cast<double>(stats.incorrect_labels + stats.correct_labels));
-  LOG(INFO) << "Error rate of " << std::fixed << error_rate;
-  PrintLabelErrorStatsSummary(error_stats);
-
-  total_stats->AddStats(stats);
-}
+DEFINE_int32(quantized_weight_bits, 0,
+    "If set to 8 or 16, evaluates the model again with weights quantized to this many bits and reports the "
+    "difference in error rate and weights memory.");
+DEFINE_int32(feature_hash_bits, 0,
+    "If set, evaluates the model again with its feature weights hashed to a table of 2^bits entries and reports "
+    "the difference in error rate and weights memory.");
+DEFINE_bool(feature_sign_hash, false, "Whether the hashed feature weights of --feature_hash_bits use a sign hash.");
 
 int main(int argc, char** argv) {
   google::InstallFailureSignalHandler();
@@ -158,7 +44,6 @@ int main(int argc, char** argv) {
   } else {
     std::unique_ptr<SingleLabelErrorStats> error_stats(CreateLabelErrorStats());
 
-    GraphInference inference;
     std::unique_ptr<RecordInput<std::string>> input;
 
     if (FLAGS_single_input.empty()) {
@@ -166,11 +51,41 @@ int main(int argc, char** argv) {
     } else {
       input.reset(new FileListRecordInput(std::vector<std::string>({FLAGS_single_input})));
     }
-    inference.LoadModel(FLAGS_model);
+    std::unique_ptr<InferenceModel> inference(InferenceModel::Load(FLAGS_model));
     PrecisionStats total_stats;
-    Evaluate(input.get(), &inference, &total_stats, error_stats.get(), adapter);
+    Evaluate(input.get(), inference.get(), &total_stats, error_stats.get(), adapter);
+    inference->LogWeightFilterStats();
+    inference->LogLazySegmentStats();
     OutputLabelErrorStats(error_stats.get());
     // No need to print total_stats. Evaluate() already prints info.
+
+    size_t full_precision_bytes = inference->GetWeightsMemoryBytes();
+    if (FLAGS_quantized_weight_bits != 0) {
+      inference = InferenceModel::Load(FLAGS_model, FLAGS_quantized_weight_bits);
+      LOG(INFO) << "Evaluating with " << FLAGS_quantized_weight_bits << "-bit weights...";
+      PrecisionStats quantized_stats;
+      Evaluate(input.get(), inference.get(), &quantized_stats, nullptr, adapter);
+      LOG(INFO) << "Quantized to " << FLAGS_quantized_weight_bits << " bits: error rate "
+          << std::fixed << GetErrorRate(total_stats) << " -> " << GetErrorRate(quantized_stats)
+          << " (delta " << std::showpos << GetErrorRate(quantized_stats) - GetErrorRate(total_stats)
+          << std::noshowpos << "), weights memory " << full_precision_bytes / 1024 << "KB -> "
+          << inference->GetWeightsMemoryBytes() / 1024 << "KB.";
+    }
+    if (FLAGS_feature_hash_bits != 0) {
+      std::unique_ptr<GraphInference> hashed_inference(new GraphInference());
+      hashed_inference->LoadModel(FLAGS_model);
+      hashed_inference->HashFeatureWeights(FLAGS_feature_hash_bits, FLAGS_feature_sign_hash);
+      hashed_inference->PrepareForInference();
+      inference.reset(new InferenceModel(std::move(hashed_inference)));
+      LOG(INFO) << "Evaluating with feature weights hashed to " << FLAGS_feature_hash_bits << " bits...";
+      PrecisionStats hashed_stats;
+      Evaluate(input.get(), inference.get(), &hashed_stats, nullptr, adapter);
+      LOG(INFO) << "Hashed to " << FLAGS_feature_hash_bits << " bits: error rate "
+          << std::fixed << GetErrorRate(total_stats) << " -> " << GetErrorRate(hashed_stats)
+          << " (delta " << std::showpos << GetErrorRate(hashed_stats) - GetErrorRate(total_stats)
+          << std::noshowpos << "), weights memory " << full_precision_bytes / 1024 << "KB -> "
+          << inference->GetWeightsMemoryBytes() / 1024 << "KB.";
+    }
   }
   return 0;
 }
@@ -0,0 +1,126 @@
+/*
+   Copyright 2015 Software Reliability Lab, ETH Zurich
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ */
+
+#include <sys/stat.h>
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+
+#include "eval_internal.h"
+
+DEFINE_string(model, "model", "File prefix of the model to prune.");
+DEFINE_string(out_model, "pruned_model", "File prefix for the pruned model.");
+DEFINE_double(min_abs_weight, 0.0, "Removes features and factor features with a smaller absolute weight.");
+DEFINE_int32(min_feature_count, 0,
+    "Removes features seen fewer times in --count_input. Factor features are only pruned by --min_abs_weight.");
+DEFINE_string(count_input, "", "Input file with JSON objects (e.g. the training data) to count features on.");
+DEFINE_int32(max_features_per_label_relation, 0,
+    "If positive, keeps only this many features with the largest absolute weight per (label, relation). "
+    "Factor features are only pruned by --min_abs_weight.");
+
+// Size, load time, latency and error rate of one model.
+struct ModelReport {
+  ModelReport() : size_bytes(0), load_micros(0), latency_micros(0), error_rate(0) {}
+
+  int64 size_bytes;
+  int64 load_micros;
+  double latency_micros;
+  double error_rate;
+};
+
+int64 GetModelSizeBytes(const std::string& file_prefix) {
+  int64 size = 0;
+  for (const char* suffix : {"_features", "_strings", "_lfreq"}) {
+    struct stat st;
+    if (stat((file_prefix + suffix).c_str(), &st) == 0) size += st.st_size;
+  }
+  return size;
+}
+
+void LoadAndEvaluate(const std::string& file_prefix, RecordInput<std::string>* input,
+    JsonAdapter& adapter, ModelReport* report) {
+  report->size_bytes = GetModelSizeBytes(file_prefix);
+  int64 start_time = GetCurrentTimeMicros();
+  std::unique_ptr<InferenceModel> inference(InferenceModel::Load(file_prefix));
+  report->load_micros = GetCurrentTimeMicros() - start_time;
+
+  PrecisionStats stats;
+  EvaluationTime time = Evaluate(input, inference.get(), &stats, nullptr, adapter);
+  // The queries are evaluated by FLAGS_num_threads threads.
+  report->latency_micros = time.num_queries == 0 ? 0 :
+      static_cast<double>(time.time_micros) * FLAGS_num_threads / time.num_queries;
+  report->error_rate = GetErrorRate(stats);
+}
+
+void CountFeatures(const GraphInference& inference, GraphInference::FeatureCounts* counts, JsonAdapter& adapter) {
+  LOG(INFO) << "Counting features on " << FLAGS_count_input << "...";
+  FileRecordInput<std::string> input(FLAGS_count_input);
+  std::mutex counts_mutex;
+  ParallelForeachInput(&input, [&inference,&counts,&counts_mutex](const Query& query) {
+    std::unique_ptr<Nice2Query> q(inference.CreateQuery());
+    q->FromFeaturesQueryProto(query.features());
+    std::unique_ptr<Nice2Assignment> a(inference.CreateAssignment(q.get()));
+    a->FromNodeAssignmentsProto(query.node_assignments());
+    GraphInference::FeatureCounts query_counts;
+    inference.AddFeatureCounts(q.get(), a.get(), &query_counts);
+    std::lock_guard<std::mutex> guard(counts_mutex);
+    for (auto it = query_counts.begin(); it != query_counts.end(); ++it) {
+      (*counts)[it->first] += it->second;
+    }
+  }, adapter);
+  LOG(INFO) << "Counted " << counts->size() << " features.";
+}
+
+void PrintReportLine(const char* name, const ModelReport& report) {
+  LOG(INFO) << StringPrintf("%-8s %10lldKB %8.1fms %10.1fus %10.6f", name,
+      static_cast<long long>(report.size_bytes / 1024), report.load_micros / 1000.0,
+      report.latency_micros, report.error_rate);
+}
+
+int main(int argc, char** argv) {
+  google::InstallFailureSignalHandler();
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  google::InitGoogleLogging(argv[0]);
+
+  JsonAdapter adapter;
+  FileRecordInput<std::string> input(FLAGS_input);
+
+  ModelReport original_report;
+  LoadAndEvaluate(FLAGS_model, &input, adapter, &original_report);
+  {
+    GraphInference inference;
+    inference.LoadModel(FLAGS_model);
+    ModelPruningOptions options;
+    options.min_abs_weight = FLAGS_min_abs_weight;
+    options.min_feature_count = FLAGS_min_feature_count;
+    options.max_features_per_label_relation = FLAGS_max_features_per_label_relation;
+    GraphInference::FeatureCounts counts;
+    if (options.min_feature_count > 0) {
+      CHECK(!FLAGS_count_input.empty()) << "--min_feature_count needs --count_input.";
+      CountFeatures(inference, &counts, adapter);
+    }
+    inference.PruneModel(options, &counts);
+    inference.SaveModel(FLAGS_out_model);
+  }
+
+  ModelReport pruned_report;
+  LoadAndEvaluate(FLAGS_out_model, &input, adapter, &pruned_report);
+
+  LOG(INFO) << StringPrintf("%-8s %12s %10s %12s %10s", "model", "size", "load", "latency", "error rate");
+  PrintReportLine("original", original_report);
+  PrintReportLine("pruned", pruned_report);
+  return 0;
+}
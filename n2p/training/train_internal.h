@@ -1,9 +1,11 @@
 #include <cmath>
 #include <string>
 #include <fstream>
+#include <atomic>
 #include <functional>
 #include <mutex>
 #include <thread>
+#include <unordered_map>
 
 #include <gflags/gflags.h>
 #include <glog/logging.h>
@@ -12,6 +14,7 @@
 
 #include "base/base.h"
 #include "base/readerutil.h"
+#include "base/stringprintf.h"
 #include "n2p/inference/graph_inference.h"
 
 using nice2protos::Query;
@@ -46,21 +49,43 @@ DEFINE_int32(num_pass_change_training,  10, "When using pseudolikelihood combine
 DEFINE_double(initial_learning_rate_ssvm, 0.1, "Initial learning rate of SSVM in the combined version.");
 DEFINE_string(learning_rate_update_formula_pl, PROP_PASS_LEARN_RATE_UPDATE_PL,"Learning update formula for PL learning. ");
 DEFINE_double(pl_lambda, 1.0, "Lambda used in the formula for computing the learning rate proportional to the training pass and the initial learning rate.");
-
+DEFINE_bool(compact_training_corpus, true,
+    "Whether the training passes after the first one build the training queries from a compact form with "
+    "interned labels, kept in RAM, instead of parsing the records again. Not used with --training_cache_file.");
+DEFINE_string(training_cache_file, "",
+    "If set, the training records are cached in this file between the training passes instead of in RAM. "
+    "The passes read it in shuffled blocks.");
+DEFINE_int32(training_cache_block_kb, 4096, "The size of the blocks of --training_cache_file.");
+DEFINE_int32(feature_hash_bits, 0,
+    "If set, the feature weights are learned in a table of 2^bits entries indexed by a hash of the feature, "
+    "which bounds their memory.");
+DEFINE_bool(feature_sign_hash, false, "Whether the hashed feature weights use a sign hash.");
+DECLARE_bool(huge_pages);
+
+// Returns the query of a record: the record itself, or the query converted from it into buffer. Buffer is
+// reused for the records of a thread.
 template <class InputType>
-using Adapter = std::function<Query(const InputType&)>;
+using Adapter = std::function<const Query&(const InputType& record, Query* buffer)>;
 
 typedef std::function<void(const Query& query)> InputProcessor;
 
 template <class InputType>
 void ForeachInput(InputRecordReader<InputType>* reader, InputProcessor proc, Adapter<InputType>& adapter) {
-  while (!reader->ReachedEnd()) {
-    InputType record;
-    if (!reader->Read(&record)) {
-      continue;
+  // Reused for all records, so that they keep their allocations.
+  std::vector<InputType> record_buffer;
+  std::vector<const InputType*> records;
+  Query query_buffer;
+  // The threads take the reader lock once per batch.
+  AdaptiveBatchSize batch_size;
+  for (;;) {
+    int64 start_time = GetCurrentTimeMicros();
+    if (reader->ReadBorrowedBatch(batch_size.size(), &record_buffer, &records) == 0) {
+      break;
     }
-    Query query;
-    proc(adapter(record));
+    for (const InputType* record : records) {
+      proc(adapter(*record, &query_buffer));
+    }
+    batch_size.Update(GetCurrentTimeMicros() - start_time);
   }
 }
 
@@ -82,16 +107,102 @@ void ParallelForeachInput(RecordInput<InputType>* input, InputProcessor proc, Ad
   }
 }
 
+typedef std::function<void(Nice2Query* query, Nice2Assignment* assignment)> TrainingProcessor;
+
+// Runs proc on the query and assignment of every training sample. The first call reads the samples from input
+// and converts them to corpus. The later calls build the queries from corpus, which is shuffled before each
+// pass as ShuffledCacheInput shuffles its records.
+template <class InputType>
+void ParallelForeachTrainingQuery(RecordInput<InputType>* input, const GraphInference* inference,
+                                  std::vector<CompactQuery>* corpus, TrainingProcessor proc,
+                                  Adapter<InputType> &adapter) {
+  // The corpus would not fit in RAM either.
+  bool keep_corpus = FLAGS_compact_training_corpus && FLAGS_training_cache_file.empty();
+  if (!keep_corpus || corpus->empty()) {
+    std::mutex mutex;
+    ParallelForeachInput(input, [inference,corpus,keep_corpus,&proc,&mutex](const Query& query) {
+      std::unique_ptr<Nice2Query> q;
+      std::unique_ptr<Nice2Assignment> a;
+      if (keep_corpus) {
+        CompactQuery compact;
+        inference->ToCompactQuery(query, &compact);
+        q.reset(inference->CreateQuery(compact));
+        a.reset(inference->CreateAssignment(q.get(), compact));
+        std::lock_guard<std::mutex> lock(mutex);
+        corpus->push_back(std::move(compact));
+      } else {
+        q.reset(inference->CreateQuery());
+        q->FromFeaturesQueryProto(query.features());
+        a.reset(inference->CreateAssignment(q.get()));
+        a->FromNodeAssignmentsProto(query.node_assignments());
+      }
+      proc(q.get(), a.get());
+    }, adapter);
+    if (keep_corpus) {
+      LOG(INFO) << "Kept " << corpus->size() << " training samples in compact form.";
+    }
+    return;
+  }
+
+  std::random_shuffle(corpus->begin(), corpus->end());
+  auto process = [inference,&proc](const CompactQuery& compact) {
+    std::unique_ptr<Nice2Query> q(inference->CreateQuery(compact));
+    std::unique_ptr<Nice2Assignment> a(inference->CreateAssignment(q.get(), compact));
+    proc(q.get(), a.get());
+  };
+  if (!FLAGS_hogwild) {
+    for (const CompactQuery& compact : *corpus) {
+      process(compact);
+    }
+    return;
+  }
+  std::atomic<size_t> next_sample(0);
+  std::vector<std::thread> threads;
+  for (int i = 0; i < FLAGS_num_threads; ++i) {
+    threads.push_back(std::thread([corpus,&process,&next_sample]() {
+      for (size_t sample = next_sample++; sample < corpus->size(); sample = next_sample++) {
+        process((*corpus)[sample]);
+      }
+    }));
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+}
+
+// Caches the records of input for the training passes, which read them in a different order each time.
+template <class InputType>
+RecordInput<InputType>* NewShuffledInput(RecordInput<InputType>* input, const std::string& cache_file_suffix) {
+  if (FLAGS_training_cache_file.empty()) {
+    // With the compact corpus, only the first training pass reads the records after InitTrain (see
+    // ParallelForeachTrainingQuery), so the cache is released after it.
+    return new ShuffledCacheInput<InputType>(input, FLAGS_compact_training_corpus ? 1 : -1);
+  }
+  return new ShuffledBlockFileInput<InputType>(input, FLAGS_training_cache_file + cache_file_suffix,
+                                               static_cast<size_t>(FLAGS_training_cache_block_kb) * 1024);
+}
+
 template <class InputType>
 void InitTrain(RecordInput<InputType>* input, GraphInference* inference, Adapter<InputType> &adapter) {
-  int count = 0;
-  std::mutex mutex;
-  ParallelForeachInput(input, [&inference,&count,&mutex](const Query& query) {
-    std::lock_guard<std::mutex> lock(mutex);
-    inference->AddQueryToModel(query);
-    ++count;
+  // Each thread counts its queries separately.
+  ThreadModelCounts thread_counts;
+  inference->StartCountingQueries();
+  ParallelForeachInput(input, [&inference,&thread_counts](const Query& query) {
+    inference->CountQueryFeatures(query, thread_counts.GetForCurrentThread());
   }, adapter);
+  std::vector<std::unique_ptr<ModelCounts> > counts;
+  thread_counts.TakeAll(&counts);
+  int count = 0;
+  for (const std::unique_ptr<ModelCounts>& thread_query_counts : counts) {
+    count += thread_query_counts->num_queries;
+  }
+  inference->AddModelCounts(&counts);
   LOG(INFO) << "Loaded " << count << " training data samples.";
+  if (FLAGS_feature_hash_bits != 0) {
+    inference->HashFeatureWeights(FLAGS_feature_hash_bits, FLAGS_feature_sign_hash);
+  }
+  inference->SetCandidateListThreads(std::max(FLAGS_num_threads, 1));
+  inference->SetTraining(true);
   inference->PrepareForInference();
 }
 
@@ -119,7 +230,8 @@ void TestInference(RecordInput<InputType>* input, GraphInference* inference, Ada
 }
 
 template <class InputType>
-void TrainPL(RecordInput<InputType>* input, GraphInference* inference, int num_training_passes, double start_learning_rate,
+void TrainPL(RecordInput<InputType>* input, std::vector<CompactQuery>* corpus, GraphInference* inference,
+    int num_training_passes, double start_learning_rate,
              Adapter<InputType> &adapter) {
   inference->InitializeFeatureWeights(FLAGS_regularization_const);
   inference->PLInit(FLAGS_max_labels_z);
@@ -139,13 +251,10 @@ void TrainPL(RecordInput<InputType>* input, GraphInference* inference, int num_t
       learning_rate = start_learning_rate / (1 + FLAGS_pl_lambda * (pass + 1));
     }
 
-    ParallelForeachInput(input, [&inference,&learning_rate,pass](const Query& query) {
-      std::unique_ptr<Nice2Query> q(inference->CreateQuery());
-      q->FromFeaturesQueryProto(query.features());
-      std::unique_ptr<Nice2Assignment> a(inference->CreateAssignment(q.get()));
-      a->FromNodeAssignmentsProto(query.node_assignments());
-      inference->PLLearn(q.get(), a.get(), learning_rate);
+    ParallelForeachTrainingQuery(input, inference, corpus, [&inference,&learning_rate](Nice2Query* q, Nice2Assignment* a) {
+      inference->PLLearn(q, a, learning_rate);
     }, adapter);
+    inference->MergeGradientBuffers();
 
     int64 end_time = GetCurrentTimeMicros();
     LOG(INFO) << "Training pass took " << (end_time - start_time) / 1000 << "ms.";
@@ -157,7 +266,8 @@ void TrainPL(RecordInput<InputType>* input, GraphInference* inference, int num_t
 }
 
 template <class InputType>
-void TrainSSVM(RecordInput<InputType>* input, GraphInference* inference, int num_training_passes, double start_learning_rate,
+void TrainSSVM(RecordInput<InputType>* input, std::vector<CompactQuery>* corpus, GraphInference* inference,
+    int num_training_passes, double start_learning_rate,
                Adapter<InputType> &adapter) {
   if (FLAGS_training_method.compare(PL_SSVM_TRAIN_NAME) != 0) {
     inference->InitializeFeatureWeights(FLAGS_regularization_const);
@@ -174,18 +284,17 @@ void TrainSSVM(RecordInput<InputType>* input, GraphInference* inference, int num
   for (int pass = 0; pass < num_training_passes; ++pass) {
     double error_rate = 0.0;
 
-    GraphInference backup_inference(*inference);
+    // Only the weights change in a pass, the rest of the model is reused if the pass is reverted.
+    WeightSnapshot backup_weights;
+    inference->SaveWeightSnapshot(&backup_weights);
 
     int64 start_time = GetCurrentTimeMicros();
     PrecisionStats stats;
 
-    ParallelForeachInput(input, [&inference,&stats,&learning_rate,pass](const Query& query) {
-      std::unique_ptr<Nice2Query> q(inference->CreateQuery());
-      q->FromFeaturesQueryProto(query.features());
-      std::unique_ptr<Nice2Assignment> a(inference->CreateAssignment(q.get()));
-      a->FromNodeAssignmentsProto(query.node_assignments());
-      inference->SSVMLearn(q.get(), a.get(), learning_rate, &stats);
+    ParallelForeachTrainingQuery(input, inference, corpus, [&inference,&stats,&learning_rate](Nice2Query* q, Nice2Assignment* a) {
+      inference->SSVMLearn(q, a, learning_rate, &stats);
     }, adapter);
+    inference->MergeGradientBuffers();
 
     int64 end_time = GetCurrentTimeMicros();
     LOG(INFO) << "Training pass took " << (end_time - start_time) / 1000 << "ms.";
@@ -196,7 +305,7 @@ void TrainSSVM(RecordInput<InputType>* input, GraphInference* inference, int num
     if (error_rate > last_error_rate) {
       LOG(INFO) << "Reverting last pass.";
       learning_rate *= 0.5;  // Halve the learning rate.
-      *inference = backup_inference;
+      inference->RestoreWeightSnapshot(backup_weights);
       if (learning_rate < FLAGS_stop_learning_rate) break;  // Stop learning in this case.
     } else {
       last_error_rate = error_rate;
@@ -256,25 +365,29 @@ void Evaluate(RecordInput<InputType>* evaluation_data, GraphInference* inference
 
 template <class InputType>
 int LearningMain(Adapter<InputType> adapter) {
+  SetHugePagesEnabled(FLAGS_huge_pages);
   if (FLAGS_cross_validation_folds > 1) {
     PrecisionStats total_stats;
     for (int fold_id = 0; fold_id < FLAGS_cross_validation_folds; ++fold_id) {
       GraphInference inference;
       std::unique_ptr<RecordInput<InputType>> training_data(
-          new ShuffledCacheInput<InputType>(new CrossValidationInput<InputType>(new FileRecordInput<InputType>(FLAGS_input),
-                                                                                fold_id, FLAGS_cross_validation_folds, true)));
+          NewShuffledInput<InputType>(new CrossValidationInput<InputType>(new FileRecordInput<InputType>(FLAGS_input),
+                                                                          fold_id, FLAGS_cross_validation_folds, true),
+                                      StringPrintf(".%d.train", fold_id)));
       std::unique_ptr<RecordInput<InputType>> validation_data(
-          new ShuffledCacheInput<InputType>(new CrossValidationInput<InputType>(new FileRecordInput<InputType>(FLAGS_input),
-                                                                                fold_id, FLAGS_cross_validation_folds, false)));
+          NewShuffledInput<InputType>(new CrossValidationInput<InputType>(new FileRecordInput<InputType>(FLAGS_input),
+                                                                          fold_id, FLAGS_cross_validation_folds, false),
+                                      StringPrintf(".%d.validation", fold_id)));
       LOG(INFO) << "Training fold " << fold_id;
       InitTrain(training_data.get(), &inference, adapter);
+      std::vector<CompactQuery> training_corpus;
       if (FLAGS_training_method.compare(PL_TRAIN_NAME) == 0) {
-        TrainPL(training_data.get(), &inference, FLAGS_num_training_passes, FLAGS_start_learning_rate, adapter);
+        TrainPL(training_data.get(), &training_corpus, &inference, FLAGS_num_training_passes, FLAGS_start_learning_rate, adapter);
       } else if (FLAGS_training_method.compare(SSVM_TRAIN_NAME) == 0) {
-        TrainSSVM(training_data.get(), &inference, FLAGS_num_training_passes, FLAGS_start_learning_rate, adapter);
+        TrainSSVM(training_data.get(), &training_corpus, &inference, FLAGS_num_training_passes, FLAGS_start_learning_rate, adapter);
       } else if (FLAGS_training_method.compare(PL_SSVM_TRAIN_NAME) == 0) {
-        TrainPL(training_data.get(), &inference, FLAGS_num_pass_change_training, FLAGS_start_learning_rate, adapter);
-        TrainSSVM(training_data.get(), &inference, FLAGS_num_training_passes, FLAGS_initial_learning_rate_ssvm,
+        TrainPL(training_data.get(), &training_corpus, &inference, FLAGS_num_pass_change_training, FLAGS_start_learning_rate, adapter);
+        TrainSSVM(training_data.get(), &training_corpus, &inference, FLAGS_num_training_passes, FLAGS_initial_learning_rate_ssvm,
                   adapter);
       } else {
         LOG(INFO) << "ERROR: training method name not recognized";
@@ -298,20 +411,21 @@ int LearningMain(Adapter<InputType> adapter) {
     LOG(INFO) << "Running structured training...";
     // Structured training.
     GraphInference inference;
-    std::unique_ptr<RecordInput<InputType>> input(new ShuffledCacheInput<InputType>(new FileRecordInput<InputType>(FLAGS_input)));
+    std::unique_ptr<RecordInput<InputType>> input(NewShuffledInput<InputType>(new FileRecordInput<InputType>(FLAGS_input), ""));
     InitTrain(input.get(), &inference, adapter);
     LOG(INFO) << "Training inited...";
+    std::vector<CompactQuery> training_corpus;
     if (FLAGS_training_method.compare(PL_TRAIN_NAME) == 0) {
       LOG(INFO) << "Running PL training...";
-      TrainPL(input.get(), &inference, FLAGS_num_training_passes, FLAGS_start_learning_rate, adapter);
+      TrainPL(input.get(), &training_corpus, &inference, FLAGS_num_training_passes, FLAGS_start_learning_rate, adapter);
     } else if (FLAGS_training_method.compare(SSVM_TRAIN_NAME) == 0) {
       LOG(INFO) << "Running SSVM training...";
-      TrainSSVM(input.get(), &inference, FLAGS_num_training_passes, FLAGS_start_learning_rate, adapter);
+      TrainSSVM(input.get(), &training_corpus, &inference, FLAGS_num_training_passes, FLAGS_start_learning_rate, adapter);
     } else if (FLAGS_training_method.compare(PL_SSVM_TRAIN_NAME) == 0) {
       LOG(INFO) << "Running PL training...";
-      TrainPL(input.get(), &inference, FLAGS_num_pass_change_training, FLAGS_start_learning_rate, adapter);
+      TrainPL(input.get(), &training_corpus, &inference, FLAGS_num_pass_change_training, FLAGS_start_learning_rate, adapter);
       LOG(INFO) << "Running SSVM training...";
-      TrainSSVM(input.get(), &inference, FLAGS_num_training_passes, FLAGS_initial_learning_rate_ssvm, adapter);
+      TrainSSVM(input.get(), &training_corpus, &inference, FLAGS_num_training_passes, FLAGS_initial_learning_rate_ssvm, adapter);
     } else {
       LOG(INFO) << "ERROR: training method name not recognized";
       return 1;
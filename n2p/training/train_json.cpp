@@ -32,13 +32,14 @@ int main(int argc, char** argv) {
   google::ParseCommandLineFlags(&argc, &argv, true);
   google::InitGoogleLogging(argv[0]);
 
-  return LearningMain<std::string>([](const std::string &line) {
+  return LearningMain<std::string>([](const std::string &line, Query* buffer) -> const Query& {
     JsonAdapter adapter;
     Json::Reader json_reader;
     Json::Value v;
     if (!json_reader.parse(line, v, false)) {
       LOG(ERROR) << "Could not parse input: " << json_reader.getFormattedErrorMessages();
     }
-    return adapter.JsonToQuery(v);
+    adapter.JsonToQuery(v, buffer);
+    return *buffer;
   });
 }
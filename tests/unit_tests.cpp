@@ -14,14 +14,33 @@
    limitations under the License.
  */
 
+#include <algorithm>
+#include <fstream>
+#include <thread>
+
+#include <gflags/gflags.h>
 #include <glog/logging.h>
 
 #include "gtest/gtest.h"
 #include "json/json.h"
 
+#include "base/bloom_filter.h"
+#include "base/concurrent_stringset.h"
+#include "base/readerutil.h"
+#include "base/stringset.h"
 #include "n2p/inference/graph_inference.h"
+#include "n2p/inference/inference_model.h"
 #include "n2p/json_server/json_adapter.h"
 
+DECLARE_bool(initial_greedy_assignment_pass);
+DECLARE_int32(graph_per_node_passes);
+DECLARE_int32(graph_per_arc_passes);
+DECLARE_int32(graph_inference_threads);
+DECLARE_int32(min_nodes_for_parallel_inference);
+DECLARE_bool(lazy_model_segments);
+DECLARE_string(unknown_label);
+DECLARE_int32(min_freq_known_label);
+
 static const size_t mockFactorsLimit = 0;
 
 TEST(FactorFeaturesLevelTest, NextLevelZeroEntryWhenCurrentDepthGreaterThanMaximumDepth) {
@@ -380,6 +399,673 @@ TEST(MapInferenceTest, GivesCorrectPermutationsOfFactorFeatureTestGivenDuplicate
   EXPECT_EQ(0, precision_stats.incorrect_labels);
 }
 
+TEST(MapInferenceTest, GivesDistinctLabelsToNodesInTheSameScope) {
+  const std::string training_data_sample = "{\"query\":[{\"a\":0,\"b\":3,\"f2\":\"mock\"},{\"a\":2,\"b\":3,\"f2\":\"mock\"}]," \
+        "\"assign\":[{\"v\":0,\"inf\":\"base\"},{\"v\":2,\"inf\":\"props\"},{\"v\":3,\"giv\":\"split\"}]}";
+
+  const std::string data_sample = "{\"query\":[{\"a\":0,\"b\":3,\"f2\":\"mock\"},{\"a\":2,\"b\":3,\"f2\":\"mock\"},{\"cn\":\"!=\",\"n\":[0,2]}]," \
+        "\"assign\":[{\"v\":0,\"inf\":\"a\"},{\"v\":2,\"inf\":\"b\"},{\"v\":3,\"giv\":\"split\"}]}";
+
+  JsonAdapter adapter;
+  Json::Reader jsonreader;
+  Json::Value data_sample_value;
+  jsonreader.parse(data_sample, data_sample_value, false);
+  GraphInference unit_under_test;
+  SetUpUnitUnderTest(training_data_sample, unit_under_test, adapter);
+  std::unique_ptr<Nice2Query> query(unit_under_test.CreateQuery());
+  nice2protos::Query proto_query = adapter.JsonToQuery(data_sample_value);
+  query->FromFeaturesQueryProto(proto_query.features());
+  std::unique_ptr<Nice2Assignment> assignment(unit_under_test.CreateAssignment(query.get()));
+  assignment->FromNodeAssignmentsProto(proto_query.node_assignments());
+
+  unit_under_test.MapInference(query.get(), assignment.get());
+
+  nice2protos::InferResponse response;
+  assignment->FillInferResponse(&response);
+  std::vector<std::string> inferred_labels;
+  for (const auto& node_assignment : response.node_assignments()) {
+    if (!node_assignment.given()) inferred_labels.push_back(node_assignment.label());
+  }
+  ASSERT_EQ(2, inferred_labels.size());
+  EXPECT_NE(inferred_labels[0], inferred_labels[1]);
+}
+
+TEST(MapInferenceTest, GivesCorrectAssignmentToIndependentComponentsInParallel) {
+  const std::string training_data_sample = "{\"query\":[{\"a\":0,\"b\":1,\"f2\":\"mock\"},{\"a\":2,\"b\":3,\"f2\":\"other\"}]," \
+        "\"assign\":[{\"v\":0,\"inf\":\"base\"},{\"v\":1,\"giv\":\"split\"},{\"v\":2,\"inf\":\"props\"},{\"v\":3,\"giv\":\"step\"}]}";
+
+  const std::string data_sample = "{\"query\":[{\"a\":0,\"b\":1,\"f2\":\"mock\"},{\"a\":2,\"b\":3,\"f2\":\"other\"}]," \
+        "\"assign\":[{\"v\":0,\"inf\":\"a\"},{\"v\":1,\"giv\":\"split\"},{\"v\":2,\"inf\":\"b\"},{\"v\":3,\"giv\":\"step\"}]}";
+
+  JsonAdapter adapter;
+  Json::Reader jsonreader;
+  Json::Value data_sample_value;
+  jsonreader.parse(data_sample, data_sample_value, false);
+  GraphInference unit_under_test;
+  SetUpUnitUnderTest(training_data_sample, unit_under_test, adapter);
+  std::unique_ptr<Nice2Query> query(unit_under_test.CreateQuery());
+  nice2protos::Query proto_query = adapter.JsonToQuery(data_sample_value);
+  query->FromFeaturesQueryProto(proto_query.features());
+  std::unique_ptr<Nice2Assignment> assignment(unit_under_test.CreateAssignment(query.get()));
+  assignment->FromNodeAssignmentsProto(proto_query.node_assignments());
+
+  {
+    google::FlagSaver flag_saver;
+    FLAGS_graph_inference_threads = 2;
+    FLAGS_min_nodes_for_parallel_inference = 0;
+    unit_under_test.MapInference(query.get(), assignment.get());
+  }
+
+  const std::string ref_data_sample = "{\"query\":[{\"a\":0,\"b\":1,\"f2\":\"mock\"},{\"a\":2,\"b\":3,\"f2\":\"other\"}]," \
+        "\"assign\":[{\"v\":0,\"inf\":\"base\"},{\"v\":1,\"giv\":\"split\"},{\"v\":2,\"inf\":\"props\"},{\"v\":3,\"giv\":\"step\"}]}";
+  std::vector<std::string> ref_data_samples;
+  ref_data_samples.push_back(ref_data_sample);
+  PrecisionStats precision_stats;
+  ComputePrecisionStats(ref_data_samples, &precision_stats, unit_under_test, assignment.get(), adapter);
+
+  EXPECT_EQ(2, precision_stats.correct_labels);
+  EXPECT_EQ(0, precision_stats.incorrect_labels);
+}
+
+TEST(MapInferenceTest, GivesBestAssignmentOfTreeAmongAllCandidates) {
+  // Features of type "r": (alpha, beta) x2, (beta, gamma) x2, (gamma, alpha) x3, (alpha, alpha) x1.
+  const std::string training_data_sample = "{\"query\":[{\"a\":0,\"b\":1,\"f2\":\"r\"},{\"a\":4,\"b\":3,\"f2\":\"r\"}," \
+        "{\"a\":1,\"b\":2,\"f2\":\"r\"},{\"a\":3,\"b\":5,\"f2\":\"r\"},{\"a\":2,\"b\":4,\"f2\":\"r\"}," \
+        "{\"a\":2,\"b\":0,\"f2\":\"r\"},{\"a\":5,\"b\":0,\"f2\":\"r\"},{\"a\":0,\"b\":4,\"f2\":\"r\"}]," \
+        "\"assign\":[{\"v\":0,\"inf\":\"alpha\"},{\"v\":1,\"inf\":\"beta\"},{\"v\":2,\"inf\":\"gamma\"}," \
+        "{\"v\":3,\"inf\":\"beta\"},{\"v\":4,\"inf\":\"alpha\"},{\"v\":5,\"inf\":\"gamma\"}]}";
+  const std::vector<std::string> labels = {"alpha", "beta", "gamma"};
+  auto chain = [](const std::string& l0, const std::string& l1, const std::string& l2) {
+    return "{\"query\":[{\"a\":0,\"b\":1,\"f2\":\"r\"},{\"a\":1,\"b\":2,\"f2\":\"r\"}]," \
+        "\"assign\":[{\"v\":0,\"inf\":\"" + l0 + "\"},{\"v\":1,\"inf\":\"" + l1 + "\"},{\"v\":2,\"inf\":\"" + l2 + "\"}]}";
+  };
+
+  google::FlagSaver flag_saver;
+  FLAGS_initial_greedy_assignment_pass = false;
+  FLAGS_graph_per_node_passes = 0;
+  FLAGS_graph_per_arc_passes = 0;
+  JsonAdapter adapter;
+  Json::Reader jsonreader;
+  GraphInference unit_under_test;
+  SetUpUnitUnderTest(training_data_sample, unit_under_test, adapter);
+
+  Json::Value data_sample_value;
+  jsonreader.parse(chain("alpha", "alpha", "alpha"), data_sample_value, false);
+  nice2protos::Query proto_query = adapter.JsonToQuery(data_sample_value);
+  std::unique_ptr<Nice2Query> query(unit_under_test.CreateQuery());
+  query->FromFeaturesQueryProto(proto_query.features());
+  std::unique_ptr<Nice2Assignment> assignment(unit_under_test.CreateAssignment(query.get()));
+  assignment->FromNodeAssignmentsProto(proto_query.node_assignments());
+  unit_under_test.MapInference(query.get(), assignment.get());
+
+  // Every label is a candidate of every node, so the dynamic program finds the best of all labelings.
+  double best_score = -1e100;
+  for (const std::string& l0 : labels) {
+    for (const std::string& l1 : labels) {
+      for (const std::string& l2 : labels) {
+        Json::Value value;
+        jsonreader.parse(chain(l0, l1, l2), value, false);
+        std::unique_ptr<Nice2Assignment> enumerated(unit_under_test.CreateAssignment(query.get()));
+        enumerated->FromNodeAssignmentsProto(adapter.JsonToQuery(value).node_assignments());
+        best_score = std::max(best_score, unit_under_test.GetAssignmentScore(enumerated.get()));
+      }
+    }
+  }
+  EXPECT_DOUBLE_EQ(5.0, best_score);
+  EXPECT_DOUBLE_EQ(best_score, unit_under_test.GetAssignmentScore(assignment.get()));
+}
+
+TEST(MapInferenceTest, GivesSameAssignmentWithLazilyLoadedModel) {
+  const std::string training_data_sample = "{\"query\":[{\"a\":0,\"b\":1,\"f2\":\"mock\"},{\"a\":2,\"b\":3,\"f2\":\"other\"}," \
+        "{\"a\":4,\"b\":1,\"f2\":\"mock\"},{\"a\":0,\"b\":3,\"f2\":\"unused\"}]," \
+        "\"assign\":[{\"v\":0,\"inf\":\"base\"},{\"v\":1,\"giv\":\"split\"},{\"v\":2,\"inf\":\"props\"}," \
+        "{\"v\":3,\"giv\":\"step\"},{\"v\":4,\"inf\":\"parts\"}]}";
+  const std::string data_sample = "{\"query\":[{\"a\":0,\"b\":1,\"f2\":\"mock\"},{\"a\":2,\"b\":3,\"f2\":\"other\"}]," \
+        "\"assign\":[{\"v\":0,\"inf\":\"a\"},{\"v\":1,\"giv\":\"split\"},{\"v\":2,\"inf\":\"b\"},{\"v\":3,\"giv\":\"step\"}]}";
+
+  JsonAdapter adapter;
+  const std::string file_prefix = testing::TempDir() + "lazy_segments_test_model";
+  {
+    GraphInference trained;
+    SetUpUnitUnderTest(training_data_sample, trained, adapter);
+    trained.SaveModel(file_prefix);
+  }
+  google::FlagSaver flag_saver;
+  FLAGS_lazy_model_segments = false;
+  std::unique_ptr<InferenceModel> eager_model(InferenceModel::Load(file_prefix));
+  FLAGS_lazy_model_segments = true;
+  std::unique_ptr<InferenceModel> lazy_model(InferenceModel::Load(file_prefix));
+
+  Json::Reader jsonreader;
+  Json::Value data_sample_value;
+  jsonreader.parse(data_sample, data_sample_value, false);
+  nice2protos::Query proto_query = adapter.JsonToQuery(data_sample_value);
+  std::unique_ptr<Nice2Assignment> assignments[2];
+  std::unique_ptr<Nice2Query> queries[2];
+  const InferenceModel* models[2] = {eager_model.get(), lazy_model.get()};
+  for (int i = 0; i < 2; ++i) {
+    queries[i].reset(models[i]->CreateQuery());
+    queries[i]->FromFeaturesQueryProto(proto_query.features());
+    assignments[i].reset(models[i]->CreateAssignment(queries[i].get()));
+    assignments[i]->FromNodeAssignmentsProto(proto_query.node_assignments());
+    models[i]->MapInference(queries[i].get(), assignments[i].get());
+  }
+
+  // Both models read the same strings, so the labels have the same ids.
+  PrecisionStats precision_stats;
+  assignments[1]->CompareAssignments(assignments[0].get(), &precision_stats);
+  EXPECT_EQ(2, precision_stats.correct_labels);
+  EXPECT_EQ(0, precision_stats.incorrect_labels);
+  EXPECT_DOUBLE_EQ(eager_model->GetAssignmentScore(assignments[0].get()),
+                   lazy_model->GetAssignmentScore(assignments[1].get()));
+}
+
+TEST(MapInferenceTest, GivesSameScoresForQueriesBuiltFromCompactQueries) {
+  const std::string training_data_sample = "{\"query\":[{\"a\":0,\"b\":1,\"f2\":\"mock\"},{\"a\":2,\"b\":1,\"f2\":\"mock\"}," \
+        "{\"a\":0,\"b\":3,\"f2\":\"other\"}]," \
+        "\"assign\":[{\"v\":0,\"inf\":\"base\"},{\"v\":1,\"giv\":\"split\"},{\"v\":2,\"inf\":\"props\"},{\"v\":3,\"giv\":\"step\"}]}";
+  // Node 4 has a given label and node 2 an inferred label that are not in the model.
+  const std::string data_sample = "{\"query\":[{\"a\":0,\"b\":1,\"f2\":\"mock\"},{\"a\":2,\"b\":1,\"f2\":\"mock\"}," \
+        "{\"a\":0,\"b\":3,\"f2\":\"other\"},{\"a\":2,\"b\":4,\"f2\":\"other\"},{\"a\":0,\"b\":1,\"f2\":\"mock\"}," \
+        "{\"cn\":\"!=\",\"n\":[0,2]}]," \
+        "\"assign\":[{\"v\":0,\"inf\":\"base\"},{\"v\":1,\"giv\":\"split\"},{\"v\":2,\"inf\":\"unseen_inferred\"}," \
+        "{\"v\":3,\"giv\":\"step\"},{\"v\":4,\"giv\":\"unseen_given\"}]}";
+
+  JsonAdapter adapter;
+  GraphInference unit_under_test;
+  SetUpUnitUnderTest(training_data_sample, unit_under_test, adapter);
+  Json::Reader jsonreader;
+  Json::Value data_sample_value;
+  jsonreader.parse(data_sample, data_sample_value, false);
+  nice2protos::Query proto_query = adapter.JsonToQuery(data_sample_value);
+
+  std::unique_ptr<Nice2Query> query(unit_under_test.CreateQuery());
+  query->FromFeaturesQueryProto(proto_query.features());
+  std::unique_ptr<Nice2Assignment> assignment(unit_under_test.CreateAssignment(query.get()));
+  assignment->FromNodeAssignmentsProto(proto_query.node_assignments());
+
+  CompactQuery compact;
+  unit_under_test.ToCompactQuery(proto_query, &compact);
+  std::unique_ptr<Nice2Query> compact_query(unit_under_test.CreateQuery(compact));
+  std::unique_ptr<Nice2Assignment> compact_assignment(
+      unit_under_test.CreateAssignment(compact_query.get(), compact));
+
+  EXPECT_DOUBLE_EQ(unit_under_test.GetAssignmentScore(assignment.get()),
+                   unit_under_test.GetAssignmentScore(compact_assignment.get()));
+  unit_under_test.MapInference(query.get(), assignment.get());
+  unit_under_test.MapInference(compact_query.get(), compact_assignment.get());
+  EXPECT_DOUBLE_EQ(unit_under_test.GetAssignmentScore(assignment.get()),
+                   unit_under_test.GetAssignmentScore(compact_assignment.get()));
+
+  nice2protos::InferResponse response, compact_response;
+  assignment->FillInferResponse(&response);
+  compact_assignment->FillInferResponse(&compact_response);
+  ASSERT_EQ(response.node_assignments_size(), compact_response.node_assignments_size());
+  for (int i = 0; i < response.node_assignments_size(); ++i) {
+    EXPECT_EQ(response.node_assignments(i).node_index(), compact_response.node_assignments(i).node_index());
+    EXPECT_EQ(response.node_assignments(i).label(), compact_response.node_assignments(i).label());
+    EXPECT_EQ(response.node_assignments(i).given(), compact_response.node_assignments(i).given());
+  }
+  EXPECT_EQ("unseen_given", compact_response.node_assignments(4).label());
+}
+
+TEST(GraphInferenceTest, RestoresTheWeightsOfASnapshot) {
+  const std::string training_data_sample = "{\"query\":[{\"a\":0,\"b\":1,\"f2\":\"mock\"},{\"a\":2,\"b\":3,\"f2\":\"other\"}," \
+        "{\"a\":4,\"b\":1,\"f2\":\"mock\"},{\"a\":0,\"b\":3,\"f2\":\"unused\"}]," \
+        "\"assign\":[{\"v\":0,\"inf\":\"base\"},{\"v\":1,\"giv\":\"split\"},{\"v\":2,\"inf\":\"props\"}," \
+        "{\"v\":3,\"giv\":\"step\"},{\"v\":4,\"inf\":\"parts\"}]}";
+
+  JsonAdapter adapter;
+  GraphInference unit_under_test;
+  SetUpUnitUnderTest(training_data_sample, unit_under_test, adapter);
+  unit_under_test.InitializeFeatureWeights(2.0);
+  unit_under_test.SSVMInit(0.5);
+  WeightSnapshot snapshot;
+  unit_under_test.SaveWeightSnapshot(&snapshot);
+
+  Json::Reader jsonreader;
+  Json::Value training_data_sample_value;
+  jsonreader.parse(training_data_sample, training_data_sample_value, false);
+  nice2protos::Query proto_query = adapter.JsonToQuery(training_data_sample_value);
+  std::unique_ptr<Nice2Query> query(unit_under_test.CreateQuery());
+  query->FromFeaturesQueryProto(proto_query.features());
+  std::unique_ptr<Nice2Assignment> assignment(unit_under_test.CreateAssignment(query.get()));
+  assignment->FromNodeAssignmentsProto(proto_query.node_assignments());
+  PrecisionStats stats;
+  for (int pass = 0; pass < 3; ++pass) {
+    unit_under_test.SSVMLearn(query.get(), assignment.get(), 0.5, &stats);
+  }
+  unit_under_test.MergeGradientBuffers();
+  WeightSnapshot trained;
+  unit_under_test.SaveWeightSnapshot(&trained);
+  ASSERT_NE(snapshot.features, trained.features);
+
+  unit_under_test.RestoreWeightSnapshot(snapshot);
+  WeightSnapshot restored;
+  unit_under_test.SaveWeightSnapshot(&restored);
+  EXPECT_EQ(snapshot.features, restored.features);
+  EXPECT_EQ(snapshot.factor_features, restored.factor_features);
+
+  // Adding a query rebuilds the feature tables, after which the snapshot no longer matches them.
+  unit_under_test.AddQueryToModel(proto_query);
+  EXPECT_DEATH(unit_under_test.RestoreWeightSnapshot(snapshot), "rebuilt since the snapshot");
+}
+
+TEST(GraphInferenceTest, BuildsTheSameModelFromConcurrentCounts) {
+  // "parts" and "step" are in one query only, so they are merged into the unknown label.
+  const std::string training_data_samples[] = {
+      "{\"query\":[{\"a\":0,\"b\":1,\"f2\":\"mock\"},{\"a\":2,\"b\":1,\"f2\":\"mock\"},{\"group\":[0,1,2]}]," \
+        "\"assign\":[{\"v\":0,\"inf\":\"base\"},{\"v\":1,\"giv\":\"split\"},{\"v\":2,\"inf\":\"props\"}]}",
+      "{\"query\":[{\"a\":0,\"b\":1,\"f2\":\"mock\"},{\"a\":0,\"b\":2,\"f2\":\"other\"}]," \
+        "\"assign\":[{\"v\":0,\"inf\":\"base\"},{\"v\":1,\"giv\":\"split\"},{\"v\":2,\"giv\":\"step\"}]}",
+      "{\"query\":[{\"a\":0,\"b\":1,\"f2\":\"mock\"},{\"a\":2,\"b\":1,\"f2\":\"mock\"},{\"group\":[0,1,2]}]," \
+        "\"assign\":[{\"v\":0,\"inf\":\"parts\"},{\"v\":1,\"giv\":\"split\"},{\"v\":2,\"inf\":\"props\"}]}",
+      "{\"query\":[{\"a\":0,\"b\":1,\"f2\":\"mock\"},{\"group\":[0,1,2]}]," \
+        "\"assign\":[{\"v\":0,\"inf\":\"base\"},{\"v\":1,\"giv\":\"split\"},{\"v\":2,\"inf\":\"props\"}]}"};
+  const int num_samples = 4;
+  google::FlagSaver flag_saver;
+  FLAGS_unknown_label = "unknown";
+  FLAGS_min_freq_known_label = 2;
+
+  JsonAdapter adapter;
+  Json::Reader jsonreader;
+  std::vector<nice2protos::Query> proto_queries;
+  for (int i = 0; i < num_samples; ++i) {
+    Json::Value sample_value;
+    jsonreader.parse(training_data_samples[i], sample_value, false);
+    proto_queries.push_back(adapter.JsonToQuery(sample_value));
+  }
+
+  GraphInference serial_model;
+  for (const nice2protos::Query& proto_query : proto_queries) {
+    serial_model.AddQueryToModel(proto_query);
+  }
+  serial_model.PrepareForInference();
+
+  GraphInference counted_model;
+  counted_model.StartCountingQueries();
+  std::vector<std::unique_ptr<ModelCounts> > counts;
+  std::vector<std::thread> threads;
+  for (int i = 0; i < num_samples; ++i) {
+    counts.emplace_back(new ModelCounts());
+    ModelCounts* thread_counts = counts.back().get();
+    const nice2protos::Query* proto_query = &proto_queries[i];
+    threads.push_back(std::thread([&counted_model, proto_query, thread_counts]() {
+      counted_model.CountQueryFeatures(*proto_query, thread_counts);
+    }));
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+  counted_model.AddModelCounts(&counts);
+  counted_model.PrepareForInference();
+
+  // The models may give different ids to the labels, so they are compared by the scores of the same queries
+  // and by the names of the inferred labels.
+  const GraphInference* models[2] = {&serial_model, &counted_model};
+  for (const nice2protos::Query& proto_query : proto_queries) {
+    double scores[2], inferred_scores[2];
+    nice2protos::InferResponse responses[2];
+    for (int m = 0; m < 2; ++m) {
+      std::unique_ptr<Nice2Query> query(models[m]->CreateQuery());
+      query->FromFeaturesQueryProto(proto_query.features());
+      std::unique_ptr<Nice2Assignment> assignment(models[m]->CreateAssignment(query.get()));
+      assignment->FromNodeAssignmentsProto(proto_query.node_assignments());
+      scores[m] = models[m]->GetAssignmentScore(assignment.get());
+      models[m]->MapInference(query.get(), assignment.get());
+      inferred_scores[m] = models[m]->GetAssignmentScore(assignment.get());
+      assignment->FillInferResponse(&responses[m]);
+    }
+    EXPECT_DOUBLE_EQ(scores[0], scores[1]);
+    EXPECT_DOUBLE_EQ(inferred_scores[0], inferred_scores[1]);
+    ASSERT_EQ(responses[0].node_assignments_size(), responses[1].node_assignments_size());
+    for (int i = 0; i < responses[0].node_assignments_size(); ++i) {
+      EXPECT_EQ(responses[0].node_assignments(i).label(), responses[1].node_assignments(i).label());
+    }
+  }
+}
+
+// The score of a query with a single arc between two given labels, i.e. the weight of one feature.
+template <class Model>
+static double GetFeatureScore(const Model& model, const std::string& a, const std::string& b,
+    const std::string& relation, JsonAdapter& adapter) {
+  const std::string sample = "{\"query\":[{\"a\":0,\"b\":1,\"f2\":\"" + relation + "\"}]," \
+      "\"assign\":[{\"v\":0,\"giv\":\"" + a + "\"},{\"v\":1,\"giv\":\"" + b + "\"}]}";
+  Json::Reader jsonreader;
+  Json::Value sample_value;
+  jsonreader.parse(sample, sample_value, false);
+  nice2protos::Query proto_query = adapter.JsonToQuery(sample_value);
+  std::unique_ptr<Nice2Query> query(model.CreateQuery());
+  query->FromFeaturesQueryProto(proto_query.features());
+  std::unique_ptr<Nice2Assignment> assignment(model.CreateAssignment(query.get()));
+  assignment->FromNodeAssignmentsProto(proto_query.node_assignments());
+  return model.GetAssignmentScore(assignment.get());
+}
+
+TEST(MapInferenceTest, GivesSameAssignmentWithQuantizedWeights) {
+  const std::string training_data_sample = "{\"query\":[{\"a\":0,\"b\":1,\"f2\":\"mock\"},{\"a\":2,\"b\":3,\"f2\":\"other\"}," \
+        "{\"a\":4,\"b\":1,\"f2\":\"mock\"},{\"a\":0,\"b\":3,\"f2\":\"unused\"}]," \
+        "\"assign\":[{\"v\":0,\"inf\":\"base\"},{\"v\":1,\"giv\":\"split\"},{\"v\":2,\"inf\":\"props\"}," \
+        "{\"v\":3,\"giv\":\"step\"},{\"v\":4,\"inf\":\"parts\"}]}";
+  const std::string data_sample = "{\"query\":[{\"a\":0,\"b\":1,\"f2\":\"mock\"},{\"a\":2,\"b\":3,\"f2\":\"other\"}]," \
+        "\"assign\":[{\"v\":0,\"inf\":\"a\"},{\"v\":1,\"giv\":\"split\"},{\"v\":2,\"inf\":\"b\"},{\"v\":3,\"giv\":\"step\"}]}";
+  // The arcs of the training sample, as (label at a, label at b, relation).
+  const char* features[][3] = {{"base", "split", "mock"}, {"props", "step", "other"}, {"parts", "split", "mock"},
+                               {"base", "step", "unused"}, {"props", "split", "mock"}};
+
+  JsonAdapter adapter;
+  Json::Reader jsonreader;
+  Json::Value training_data_sample_value;
+  jsonreader.parse(training_data_sample, training_data_sample_value, false);
+  nice2protos::Query training_query = adapter.JsonToQuery(training_data_sample_value);
+  const std::string file_prefix = testing::TempDir() + "quantized_weights_test_model";
+  double min_weight = 0, max_weight = 0;
+  {
+    // A few training steps, so that the weights are not small integers.
+    GraphInference trained;
+    SetUpUnitUnderTest(training_data_sample, trained, adapter);
+    trained.InitializeFeatureWeights(3.0);
+    trained.SSVMInit(0.5);
+    std::unique_ptr<Nice2Query> query(trained.CreateQuery());
+    query->FromFeaturesQueryProto(training_query.features());
+    std::unique_ptr<Nice2Assignment> assignment(trained.CreateAssignment(query.get()));
+    assignment->FromNodeAssignmentsProto(training_query.node_assignments());
+    PrecisionStats stats;
+    for (int pass = 0; pass < 3; ++pass) {
+      trained.SSVMLearn(query.get(), assignment.get(), 0.3, &stats);
+    }
+    trained.MergeGradientBuffers();
+    WeightSnapshot weights;
+    trained.SaveWeightSnapshot(&weights);
+    for (double weight : weights.features) {
+      min_weight = std::min(min_weight, weight);
+      max_weight = std::max(max_weight, weight);
+    }
+    trained.SaveModel(file_prefix);
+  }
+
+  google::FlagSaver flag_saver;
+  FLAGS_lazy_model_segments = false;
+  std::unique_ptr<InferenceModel> full_precision_model(InferenceModel::Load(file_prefix));
+  Json::Value data_sample_value;
+  jsonreader.parse(data_sample, data_sample_value, false);
+  nice2protos::Query proto_query = adapter.JsonToQuery(data_sample_value);
+  std::unique_ptr<Nice2Query> full_precision_query(full_precision_model->CreateQuery());
+  full_precision_query->FromFeaturesQueryProto(proto_query.features());
+  std::unique_ptr<Nice2Assignment> full_precision_assignment(
+      full_precision_model->CreateAssignment(full_precision_query.get()));
+  full_precision_assignment->FromNodeAssignmentsProto(proto_query.node_assignments());
+  full_precision_model->MapInference(full_precision_query.get(), full_precision_assignment.get());
+
+  for (int bits : {8, 16}) {
+    std::unique_ptr<InferenceModel> quantized_model(InferenceModel::Load(file_prefix, bits));
+    ASSERT_EQ(bits, quantized_model->GetQuantizedWeightBits());
+    double max_error;
+    if (bits == 8) {
+      WeightQuantizer<uint8_t> quantizer;
+      quantizer.SetRange(min_weight, max_weight);
+      max_error = quantizer.MaxError();
+    } else {
+      WeightQuantizer<uint16_t> quantizer;
+      quantizer.SetRange(min_weight, max_weight);
+      max_error = quantizer.MaxError();
+    }
+    for (const auto& feature : features) {
+      EXPECT_NEAR(GetFeatureScore(*full_precision_model, feature[0], feature[1], feature[2], adapter),
+                  GetFeatureScore(*quantized_model, feature[0], feature[1], feature[2], adapter), max_error + 1e-12)
+          << feature[0] << " " << feature[1] << " " << feature[2] << " with " << bits << " bits";
+    }
+
+    std::unique_ptr<Nice2Query> query(quantized_model->CreateQuery());
+    query->FromFeaturesQueryProto(proto_query.features());
+    std::unique_ptr<Nice2Assignment> assignment(quantized_model->CreateAssignment(query.get()));
+    assignment->FromNodeAssignmentsProto(proto_query.node_assignments());
+    quantized_model->MapInference(query.get(), assignment.get());
+    // Both models read the same strings, so the labels have the same ids.
+    PrecisionStats precision_stats;
+    assignment->CompareAssignments(full_precision_assignment.get(), &precision_stats);
+    EXPECT_EQ(2, precision_stats.correct_labels);
+    EXPECT_EQ(0, precision_stats.incorrect_labels);
+  }
+}
+
+TEST(GraphInferenceTest, SavesAndLoadsHashedWeights) {
+  const std::string training_data_sample = "{\"query\":[{\"a\":0,\"b\":1,\"f2\":\"mock\"},{\"a\":2,\"b\":3,\"f2\":\"other\"}," \
+        "{\"a\":4,\"b\":1,\"f2\":\"mock\"},{\"a\":0,\"b\":3,\"f2\":\"unused\"}]," \
+        "\"assign\":[{\"v\":0,\"inf\":\"base\"},{\"v\":1,\"giv\":\"split\"},{\"v\":2,\"inf\":\"props\"}," \
+        "{\"v\":3,\"giv\":\"step\"},{\"v\":4,\"inf\":\"parts\"}]}";
+  const char* features[][3] = {{"base", "split", "mock"}, {"props", "step", "other"}, {"parts", "split", "mock"},
+                               {"base", "step", "unused"}};
+
+  JsonAdapter adapter;
+  for (bool sign_hash : {false, true}) {
+    const std::string file_prefix = testing::TempDir() + "hashed_weights_test_model";
+    GraphInference trained;
+    SetUpUnitUnderTest(training_data_sample, trained, adapter);
+    trained.HashFeatureWeights(12, sign_hash);
+    trained.PrepareForInference();
+    trained.SaveModel(file_prefix);
+    GraphInference loaded;
+    loaded.LoadModel(file_prefix);
+    EXPECT_EQ(12, loaded.GetFeatureHashBits());
+    for (const auto& feature : features) {
+      double weight = GetFeatureScore(trained, feature[0], feature[1], feature[2], adapter);
+      EXPECT_DOUBLE_EQ(1.0, weight) << feature[0] << " " << feature[1] << " " << feature[2];
+      EXPECT_DOUBLE_EQ(weight, GetFeatureScore(loaded, feature[0], feature[1], feature[2], adapter))
+          << feature[0] << " " << feature[1] << " " << feature[2] << (sign_hash ? " with" : " without") << " sign hash";
+    }
+  }
+}
+
+TEST(GraphInferenceTest, MergesRareLabelsOfHashedWeightsIntoUnknownLabel) {
+  // "props" and "parts" are in one query each, so their features are merged into the features of the unknown
+  // label.
+  const std::string training_data_samples[] = {
+      "{\"query\":[{\"a\":0,\"b\":1,\"f2\":\"mock\"},{\"a\":2,\"b\":1,\"f2\":\"mock\"}]," \
+        "\"assign\":[{\"v\":0,\"inf\":\"base\"},{\"v\":1,\"giv\":\"split\"},{\"v\":2,\"inf\":\"props\"}]}",
+      "{\"query\":[{\"a\":0,\"b\":1,\"f2\":\"mock\"},{\"a\":2,\"b\":1,\"f2\":\"mock\"}]," \
+        "\"assign\":[{\"v\":0,\"inf\":\"base\"},{\"v\":1,\"giv\":\"split\"},{\"v\":2,\"inf\":\"parts\"}]}"};
+  google::FlagSaver flag_saver;
+  FLAGS_unknown_label = "unknown";
+  FLAGS_min_freq_known_label = 2;
+
+  JsonAdapter adapter;
+  Json::Reader jsonreader;
+  GraphInference models[2];
+  for (int hashed = 0; hashed < 2; ++hashed) {
+    for (const std::string& sample : training_data_samples) {
+      Json::Value sample_value;
+      jsonreader.parse(sample, sample_value, false);
+      models[hashed].AddQueryToModel(adapter.JsonToQuery(sample_value));
+    }
+    if (hashed) models[hashed].HashFeatureWeights(12, false);
+    models[hashed].PrepareForInference();
+  }
+  EXPECT_EQ(12, models[1].GetFeatureHashBits());
+  for (const GraphInference& model : models) {
+    EXPECT_DOUBLE_EQ(2.0, GetFeatureScore(model, "unknown", "split", "mock", adapter));
+    EXPECT_DOUBLE_EQ(2.0, GetFeatureScore(model, "base", "split", "mock", adapter));
+  }
+}
+
+TEST(BlockedBloomFilterTest, ContainsAllAddedKeysAndRejectsMostOthers) {
+  BlockedBloomFilter filter;
+  EXPECT_TRUE(filter.MayContain(1));
+
+  filter.Reset(1000, 10, 1 << 20);
+  for (uint64 key = 0; key < 1000; ++key) {
+    filter.Add(key * 7919);
+  }
+  BlockedBloomFilter copy(filter);
+  int false_positives = 0;
+  for (uint64 key = 0; key < 1000; ++key) {
+    EXPECT_TRUE(filter.MayContain(key * 7919));
+    EXPECT_TRUE(copy.MayContain(key * 7919));
+    if (filter.MayContain(key * 7919 + 1)) ++false_positives;
+  }
+  EXPECT_LT(false_positives, 50);
+}
+
+TEST(StringSetTest, GivesDenseIdsInOrderOfAddition) {
+  StringSet strings;
+  std::vector<int> indices;
+  // Most additions do not rehash the table, some do. The strings cross 64-byte words at various offsets.
+  for (int i = 0; i < 20000; ++i) {
+    indices.push_back(strings.addString(("s" + std::to_string(i)).c_str()));
+    ASSERT_EQ(i, strings.denseId(indices.back())) << "After adding " << strings.getString(indices.back());
+    if (i % 1000 == 999) {
+      for (int j = 0; j <= i; ++j) {
+        ASSERT_EQ(j, strings.denseId(indices[j]));
+      }
+    }
+  }
+  EXPECT_EQ(20000, strings.numEntries());
+  EXPECT_EQ(-1, strings.denseId(indices[1] + 1));
+}
+
+TEST(ConcurrentStringSetTest, GivesStringSetIdsToStringsAddedConcurrently) {
+  StringSet strings;
+  int existing = strings.addString("existing");
+  ConcurrentStringSet concurrent_strings;
+  concurrent_strings.Reset(strings);
+  EXPECT_EQ(existing, concurrent_strings.Find("existing"));
+  EXPECT_EQ(-1, concurrent_strings.Find("label0"));
+
+  std::vector<std::thread> threads;
+  std::vector<std::vector<int> > ids(4, std::vector<int>(1000));
+  for (size_t t = 0; t < ids.size(); ++t) {
+    threads.push_back(std::thread([&concurrent_strings, &ids, t]() {
+      for (int i = 0; i < 1000; ++i) {
+        ids[t][i] = concurrent_strings.Add("label" + std::to_string(i));
+      }
+    }));
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+  EXPECT_EQ(1000, concurrent_strings.NumNewStrings());
+  concurrent_strings.AddNewStringsTo(&strings);
+  for (size_t t = 0; t < ids.size(); ++t) {
+    for (int i = 0; i < 1000; ++i) {
+      EXPECT_EQ(ids[0][i], ids[t][i]);
+      EXPECT_STREQ(("label" + std::to_string(i)).c_str(), strings.getString(ids[t][i]));
+    }
+  }
+}
+
+TEST(ShuffledBlockFileInputTest, GivesEachRecordOncePerPass) {
+  const std::string input_file = testing::TempDir() + "block_file_input_test";
+  std::vector<std::string> records;
+  {
+    std::ofstream out(input_file);
+    for (int i = 0; i < 1000; ++i) {
+      records.push_back("record" + std::to_string(i));
+      out << records.back() << "\n";
+    }
+  }
+  std::sort(records.begin(), records.end());
+
+  // Small blocks, so that the records are spread over many of them.
+  ShuffledBlockFileInput<std::string> input(new FileRecordInput<std::string>(input_file),
+                                            input_file + ".cache", 256);
+  // The first pass writes the block file, the second one reads it with Read and the third with ReadBatch.
+  for (int pass = 0; pass < 3; ++pass) {
+    std::unique_ptr<InputRecordReader<std::string> > reader(input.CreateReader());
+    std::vector<std::string> read_records;
+    if (pass < 2) {
+      std::string record;
+      while (reader->Read(&record)) {
+        read_records.push_back(record);
+      }
+    } else {
+      std::vector<std::string> batch;
+      for (size_t num_records; (num_records = reader->ReadBatch(7, &batch)) > 0;) {
+        read_records.insert(read_records.end(), batch.begin(), batch.begin() + num_records);
+      }
+    }
+    EXPECT_TRUE(reader->ReachedEnd()) << "Pass " << pass;
+    std::sort(read_records.begin(), read_records.end());
+    EXPECT_EQ(records, read_records) << "Pass " << pass;
+  }
+}
+
+TEST(CrossValidationReaderTest, GivesSameFoldsWithReadAndReadBatch) {
+  const std::string input_file = testing::TempDir() + "cross_validation_test";
+  std::vector<std::string> records;
+  {
+    std::ofstream out(input_file);
+    for (int i = 0; i < 100; ++i) {
+      records.push_back("record" + std::to_string(i));
+      out << records.back() << "\n";
+    }
+  }
+
+  const int num_folds = 3;
+  for (int fold_id = 0; fold_id < num_folds; ++fold_id) {
+    std::vector<std::string> folds[2];
+    for (bool training : {false, true}) {
+      CrossValidationInput<std::string> input(new FileRecordInput<std::string>(input_file), fold_id, num_folds,
+                                              training);
+      std::vector<std::string> read_records, batch_records;
+      {
+        // Read returns false for the rows of the other fold.
+        std::unique_ptr<InputRecordReader<std::string> > reader(input.CreateReader());
+        std::string record;
+        while (!reader->ReachedEnd()) {
+          if (reader->Read(&record)) read_records.push_back(record);
+        }
+      }
+      {
+        std::unique_ptr<InputRecordReader<std::string> > reader(input.CreateReader());
+        std::vector<std::string> batch;
+        for (size_t num_records; (num_records = reader->ReadBatch(7, &batch)) > 0;) {
+          batch_records.insert(batch_records.end(), batch.begin(), batch.begin() + num_records);
+        }
+      }
+      EXPECT_EQ(read_records, batch_records) << "Fold " << fold_id << (training ? " training" : " held out");
+      folds[training] = read_records;
+    }
+    // Each record is in exactly one of the two sets.
+    EXPECT_EQ(records.size(), folds[0].size() + folds[1].size()) << "Fold " << fold_id;
+    std::vector<std::string> all_records(folds[0]);
+    all_records.insert(all_records.end(), folds[1].begin(), folds[1].end());
+    std::sort(all_records.begin(), all_records.end());
+    std::vector<std::string> sorted_records(records);
+    std::sort(sorted_records.begin(), sorted_records.end());
+    EXPECT_EQ(sorted_records, all_records) << "Fold " << fold_id;
+  }
+}
+
+TEST(FileListRecordReaderTest, GivesSameRecordsWithReadAndReadBatch) {
+  std::vector<std::string> filelist, records;
+  for (int i = 0; i < 10; ++i) {
+    filelist.push_back(testing::TempDir() + "file_list_test_" + std::to_string(i));
+    records.push_back("{\"file\":" + std::to_string(i) + "}\n");
+    std::ofstream out(filelist.back());
+    out << records.back();
+  }
+
+  std::vector<std::string> read_records, batch_records;
+  {
+    FileListRecordReader reader(filelist);
+    std::string record;
+    while (reader.Read(&record)) {
+      read_records.push_back(record);
+    }
+    EXPECT_TRUE(reader.ReachedEnd());
+  }
+  {
+    FileListRecordReader reader(filelist);
+    std::vector<std::string> batch;
+    for (size_t num_records; (num_records = reader.ReadBatch(3, &batch)) > 0;) {
+      batch_records.insert(batch_records.end(), batch.begin(), batch.begin() + num_records);
+    }
+    EXPECT_TRUE(reader.ReachedEnd());
+  }
+  EXPECT_EQ(records, read_records);
+  EXPECT_EQ(records, batch_records);
+}
+
 GTEST_API_ int main(int argc, char** argv) {
   testing::InitGoogleTest(&argc, argv);
   //testing::UnitTest& unit_test = *testing::UnitTest::GetInstance();